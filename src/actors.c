@@ -6,174 +6,407 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 
 #include "messages.h"
 #include "crater.h"
-
-#define READBUFSIZE 1024
+#include "filter.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "trace.h"
+
+// The read buffer never grows: GIVE_DATA bodies are streamed through it and
+// every other message must fit in it whole.
+#define READBUFSIZE (64 * 1024)
 #define WRITBUFSIZE 1024
+// How often a silent client is checked against the ring's policies
+#define CONTEXT_TICK_USEC 100000
 
-// Reads from and writes to a client socket
-static int client_rw(int client, Buffer* rbuf, Buffer* wbuf) {
-    buffer_reset(rbuf);
-    buffer_reset(wbuf);
+// Reads from a client socket, appending to whatever is left in rbuf.
+// Waits at most timeout, or indefinitely if it is NULL.  Returns 1 if
+// anything was read, 0 if not and -1 once the client is gone.
+static int client_rw(int client, Buffer* rbuf, struct timeval* timeout) {
     fd_set readset;
     FD_ZERO(&readset);
     FD_SET(client, &readset);
-    fd_set writeset;
-    FD_ZERO(&writeset);
-    FD_SET(client, &readset);
-    select(client + 1, &readset, &writeset, NULL, NULL);
+    if (select(client + 1, &readset, NULL, NULL, timeout) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        LOG_ERROR("Failed to select on client: %s", strerror(errno));
+        return -1;
+    }
     if (FD_ISSET(client, &readset)) {
-        printf("Have client read data\n");
         size_t size = rbuf->max - rbuf->len;
         if (size == 0) {
-            if (buffer_grow(rbuf) < 0) {
-                return -1;
-            }
+            // The incoming handler always frees space or rejects the message
+            LOG_WARN("Client read buffer is full");
+            return -1;
         }
-        ssize_t n = read(client, rbuf->buf, size);
+        ssize_t n = read(client, &rbuf->buf[rbuf->len], size);
         if (n < 0) {
-            perror("Failed to read from client: ");
+            LOG_ERROR("Failed to read from client: %s", strerror(errno));
         } else if (n == 0) {
-            printf("Client %d closed their connection\n", client);
+            LOG_INFO("Client %d closed their connection", client);
             return -1;
         } else {
-            rbuf->len = (size_t)n;
+            rbuf->len += (size_t)n;
+            return 1;
         }
     }
-    if (FD_ISSET(client, &writeset)) {
-        printf("Have client write data\n");
-        ssize_t n = write(client, wbuf->buf, wbuf->len);
-        if (n < 0) {
-            perror("Failed to write to client: ");
+    return 0;
+}
+
+static uint64_t context_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Detaches a consumer that has fallen behind, between its requests, so it
+// reads from the journal from its lease cursor on
+static int context_detach(Context* ctx) {
+    Actor* a = ctx->actor;
+    if (ctx->history == NULL) {
+        ctx->history = malloc(sizeof(*ctx->history));
+        if (ctx->history == NULL) {
             return -1;
-        } else {
-            wbuf->len = n;
         }
+        journal_history_open(ctx->history, ctx->crater->journal,
+                             SLOT_UNKNOWN, a->read);
     }
+    actor_set_attachment(a, ACTOR_DETACHED);
     return 0;
 }
 
-// Reads an incoming message and handles it if recognized.
-// Returns -1 on error.
-static int context_handle_incoming(Context* ctx, Buffer* rbuf, Buffer* wbuf) {
-    printf("Handling incoming data\n");
+// Applies the ring's policies to a client between its requests, at now
+// having last heard from it at active.  Returns -1 if the client is to be
+// disconnected: it has been silent too long, or is a consumer that has
+// stayed too far behind under LAG_EVICT.
+static int context_check(Context* ctx, uint64_t now, uint64_t active) {
+    Crater* c = ctx->crater;
+    Actor* a = ctx->actor;
+    if (c->idle_timeout_usec > 0 && a->type != ACTOR_PRODUCER &&
+        now - active >= c->idle_timeout_usec) {
+        LOG_WARN("Evicting client %d from ring %s, silent for %llu ms",
+                 ctx->client, c->name,
+                 (long long unsigned)(now - active) / 1000);
+        __atomic_fetch_add(&c->evictions, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (a->type != ACTOR_CONSUMER || c->lag_policy == LAG_BLOCK ||
+        actor_attachment(a) != ACTOR_ATTACHED) {
+        return 0;
+    }
+    uint64_t lag = crater_lag(c, a, ctx->io);
+    if (lag <= c->max_lag) {
+        ctx->lagging_usec = 0;
+        return 0;
+    }
+    // A burst from the producer puts every consumer behind for a moment
+    if (ctx->lagging_usec == 0) {
+        ctx->lagging_usec = now;
+    }
+    if (now - ctx->lagging_usec < c->lag_grace_usec) {
+        return 0;
+    }
+    ctx->lagging_usec = 0;
+    if (c->lag_policy == LAG_EVICT) {
+        LOG_WARN("Evicting consumer %d from ring %s, %llu slots behind",
+                 ctx->client, c->name, (long long unsigned)lag);
+        __atomic_fetch_add(&c->evictions, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (context_detach(ctx) < 0) {
+        return -1;
+    }
+    LOG_WARN("Detached consumer %d from ring %s, %llu slots behind, to "
+             "catch up from the journal", ctx->client, c->name,
+             (long long unsigned)lag);
+    __atomic_fetch_add(&c->detaches, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Checks the key of the item just parsed.  Keys only route input, and a
+// partition refuses items keyed for another, which would otherwise be read
+// out of order with the rest of their key.  Returns -1 if the item is
+// refused.
+static int context_check_key(Context* ctx) {
+    Crater* c = ctx->crater;
+    if (ctx->give.io != SLOT_INPUT) {
+        LOG_WARN("Only input items carry a key");
+        return -1;
+    }
+    if (c->partitions == 0) {
+        return 0;
+    }
+    uint64_t p = key_partition(ctx->give.key, c->partitions);
+    if (p != c->partition) {
+        LOG_WARN("Refused item keyed for partition %llu on ring %s, "
+                 "partition %llu of %llu", (long long unsigned)p, c->name,
+                 (long long unsigned)c->partition,
+                 (long long unsigned)c->partitions);
+        return -1;
+    }
+    return 0;
+}
+
+// Tells the producer its item was refused, so it can tell which of its
+// items to resend
+static void context_reject_item(Context* ctx, uint64_t len, Buffer* wbuf) {
+    size_t start = buffer_begin_message(wbuf, MSG_REJECT);
+    buffer_write_uint64(wbuf, ctx->given);
+    buffer_write_uint64(wbuf, len);
+    buffer_end_message(wbuf, start);
+}
+
+// Feeds buffered bytes to the GIVE_DATA parser, publishing each item as it
+// completes.  Returns bytes consumed, or -1 on error.
+static ssize_t context_stream_give_data(Context* ctx, const char* buf,
+                                        size_t len, Buffer* wbuf) {
+    size_t r = 0;
+    for (;;) {
+        size_t used = 0;
+        GiveDataParseEvent ev = give_data_parser_feed(&ctx->give, &buf[r],
+                                                      len - r, &used);
+        r += used;
+        switch (ev) {
+        case GDEVENT_NEED_MORE:
+            return r;
+        case GDEVENT_ITEM: {
+            if (ctx->give.keyed && context_check_key(ctx) < 0) {
+                return -1;
+            }
+            Buffer item = ctx->give.item;
+            ctx->give.item = (Buffer) { .buf = NULL, .len = 0, .max = 0 };
+            int ret = context_publish_item(ctx, ctx->give.io, ctx->give.kind,
+                                           item);
+            if (ret < 0) {
+                buffer_free(&item);
+                LOG_ERROR("Failed to process give-data");
+                return -1;
+            }
+            if (ret > 0) {
+                context_reject_item(ctx, item.len, wbuf);
+                buffer_free(&item);
+            }
+            ctx->given++;
+        }; break;
+        case GDEVENT_DONE:
+            ctx->streaming = false;
+            return r;
+        case GDEVENT_TOO_LARGE:
+            LOG_WARN("Rejected item over the %llu byte size cap",
+                     (long long unsigned)ctx->give.max_item);
+            return -1;
+        case GDEVENT_ERROR:
+        default:
+            LOG_WARN("Malformed MSG_GIVE_DATA");
+            return -1;
+        }
+    }
+}
+
+// Handles the message at the front of buf.  Returns the number of bytes
+// consumed (0 if more data is needed), or -1 on error.
+static ssize_t context_handle_message(Context* ctx, const char* buf,
+                                      size_t len, Buffer* wbuf) {
+    if (ctx->streaming) {
+        return context_stream_give_data(ctx, buf, len, wbuf);
+    }
+
     uint64_t rmlen = 0;
     MessageType rmtype = MSG_UNKNOWN;
-    size_t n = parse_message_header(rbuf->buf, rbuf->len, &rmlen, &rmtype);
+    size_t n = parse_message_header(buf, len, &rmlen, &rmtype);
+    if (n == 0) {
+        return 0;
+    }
     if (rmlen > MSGMAXLEN) {
-        printf("Received message is too long\n");
+        LOG_WARN("Received message is too long");
         return -1;
     }
-    if (n == 0) {
-        printf("Not enough in the header\n");
+
+    if (rmtype == MSG_GIVE_DATA) {
+        LOG_TRACE("Received MSG_GIVE_DATA");
+        ACTOR_METRIC_ADD(ctx->actor, requests, 1);
+        give_data_parser_init(&ctx->give, rmlen);
+        ctx->give.max_item = ctx->crater->item_max;
+        ctx->streaming = true;
+        ssize_t r = context_stream_give_data(ctx, &buf[n], len - n, wbuf);
+        return (r < 0) ? -1 : (ssize_t)n + r;
+    }
+
+    // Everything else is small and is only handled once complete
+    if (n + rmlen > READBUFSIZE) {
+        LOG_WARN("Received message does not fit the read buffer");
+        return -1;
+    }
+    if (len - n < rmlen) {
         return 0;
     }
 
+    ACTOR_METRIC_ADD(ctx->actor, requests, 1);
     switch (rmtype) {
     case MSG_GET_DATA: {
-        printf("Received MSG_GET_DATA\n");
+        LOG_TRACE("Received MSG_GET_DATA");
         GetDataMsg m;
-        size_t r = parse_message_get_data(&rbuf->buf[n], rbuf->len - n, &m);
-        if (r == 0) {
-            return buffer_grow(rbuf);
-        } else {
-            // Move remaining data to the beginning of the buffer
-            // TODO -- use circular buffer
-            buffer_strip(rbuf, r + n);
-            int ret = context_process_get_data_msg(ctx, m, wbuf);
-            get_data_msg_destroy(&m);
-            if (ret < 0) {
-                printf("Failed to process get data\n");
-            }
-            return ret;
+        if (parse_message_get_data(&buf[n], rmlen, &m) == 0) {
+            LOG_WARN("Malformed MSG_GET_DATA");
+            return -1;
+        }
+        int ret = context_process_get_data_msg(ctx, m, wbuf);
+        get_data_msg_destroy(&m);
+        if (ret < 0) {
+            LOG_ERROR("Failed to process get data");
+            return -1;
         }
     }; break;
 
-    case MSG_GIVE_DATA: {
-        printf("Received MSG_GIVE_DATA\n");
-        GiveDataMsg m;
-        size_t r = parse_message_give_data(&rbuf->buf[n], rbuf->len - n, &m);
-        if (r == 0) {
-            printf("Couldn't parse message, growing buffer\n");
-            return buffer_grow(rbuf);
-        } else {
-            int ret = context_process_give_data_msg(ctx, m);
-            if (ret < 0) {
-                printf("Failed to process give-data\n");
-            }
-            give_data_msg_destroy(&m);
-            return ret;
+    case MSG_COMMIT: {
+        LOG_TRACE("Received MSG_COMMIT");
+        CommitMsg m;
+        if (parse_message_commit(&buf[n], rmlen, &m) == 0) {
+            LOG_WARN("Malformed MSG_COMMIT");
+            return -1;
+        }
+        if (context_process_commit_msg(ctx, m) < 0) {
+            LOG_ERROR("Failed to process commit");
+            return -1;
         }
     }; break;
 
+    case MSG_STATS:
+        metrics_write_stats(ctx->crater, wbuf);
+        break;
+
     case MSG_UNKNOWN:
     default:
-        printf("Unknown message received\n");
+        LOG_WARN("Unknown message received");
         break;
     }
 
-    buffer_reset(rbuf);
-    return 0;
+    return n + rmlen;
+}
+
+// Handles every complete message in rbuf and keeps any trailing partial
+// message for the next read.  Returns -1 on error.
+static int context_handle_incoming(Context* ctx, Buffer* rbuf, Buffer* wbuf) {
+    size_t off = 0;
+    int ret = 0;
+    while (off < rbuf->len) {
+        ssize_t n = context_handle_message(ctx, &rbuf->buf[off],
+                                           rbuf->len - off, wbuf);
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        off += (size_t)n;
+    }
+    buffer_strip(rbuf, off);
+    return ret;
 }
 
-static int handle_outgoing(int client, Buffer* buf) {
-    if (buf->len == 0) {
+static ssize_t handle_outgoing(int client, Buffer* buf, size_t from) {
+    if (buf->len <= from) {
         return 0;
     }
-    ssize_t n = write(client, buf->buf, buf->len);
+    ssize_t n = write(client, &buf->buf[from], buf->len - from);
     if (n < 0) {
-        perror("Failed to write to client: ");
+        LOG_ERROR("Failed to write to client: %s", strerror(errno));
     }
     return n;
 }
 
 // Thread main function.  Returns NULL on failure, else Context*
 void* context_run(void* context) {
-    printf("context_run for new client\n");
+    LOG_DEBUG("context_run for new client");
     Context* c = (Context*)context;
-    // TODO -- switch to circular buffer for reading
+    pool_thread_attach();
     Buffer rbuf;
     buffer_alloc(&rbuf, READBUFSIZE);
     Buffer wbuf;
     buffer_alloc(&wbuf, WRITBUFSIZE);
-    while (client_rw(c->client, &rbuf, &wbuf) == 0) {
+    buffer_alloc(&c->scratch, 1024);
+    Crater* crater = c->crater;
+    // Silent clients are only checked on if a policy needs it
+    bool ticking = crater->idle_timeout_usec > 0 ||
+        crater->lag_policy != LAG_BLOCK;
+    if (crater->idle_timeout_usec > 0) {
+        // A client that stops reading its replies is silent too
+        struct timeval tv = {
+            .tv_sec = (time_t)(crater->idle_timeout_usec / 1000000),
+            .tv_usec = (suseconds_t)(crater->idle_timeout_usec % 1000000)
+        };
+        if (setsockopt(c->client, SOL_SOCKET, SO_SNDTIMEO, &tv,
+                       sizeof(tv)) < 0) {
+            LOG_ERROR("Failed to set a send timeout: %s", strerror(errno));
+        }
+    }
+    uint64_t active = context_now_usec();
+    bool open = true;
+    while (open) {
+        struct timeval tick = { .tv_sec = 0, .tv_usec = CONTEXT_TICK_USEC };
+        int r = client_rw(c->client, &rbuf, ticking ? &tick : NULL);
+        if (r < 0) {
+            break;
+        }
+        if (ticking) {
+            uint64_t now = context_now_usec();
+            if (r > 0) {
+                active = now;
+            }
+            if (context_check(c, now, active) < 0) {
+                break;
+            }
+        }
         int ret = context_handle_incoming(c, &rbuf, &wbuf);
         if (ret < 0) {
-            printf("Failed to handle incoming message\n");
+            LOG_ERROR("Failed to handle incoming message");
             break;
         }
-        if (wbuf.len > 0) {
-            size_t wrote = 0;
-            while (wrote < wbuf.len) {
-                ssize_t n = handle_outgoing(c->client, &wbuf);
-                if (n < 0) {
-                    printf("Failed to handle outgoing message\n");
-                    break;
-                }
-                wrote += n;
+        size_t wrote = 0;
+        while (wrote < wbuf.len) {
+            ssize_t n = handle_outgoing(c->client, &wbuf, wrote);
+            if (n < 0) {
+                // A partial reply would leave the client out of step
+                LOG_ERROR("Failed to handle outgoing message");
+                open = false;
+                break;
             }
+            wrote += n;
         }
+        buffer_reset(&wbuf);
     }
 
+    if (c->streaming) {
+        give_data_parser_destroy(&c->give);
+        c->streaming = false;
+    }
     buffer_free(&rbuf);
     buffer_free(&wbuf);
+    buffer_free(&c->scratch);
+    pool_thread_detach();
+    crater_leave(c);
 
     return c;
 }
 
-int context_do_thread(Context* c) {
+static int context_do_thread(Context* c, void* (*run)(void*)) {
     if (pthread_attr_setdetachstate(&c->thread_attr,
                                     PTHREAD_CREATE_JOINABLE) != 0) {
-        perror("Failed to make thread joinable: ");
+        LOG_ERROR("Failed to make thread joinable: %s", strerror(errno));
         return -1;
     }
-    if (pthread_create(&c->thread, &c->thread_attr, &context_run, c) != 0) {
-        perror("Failed to create thread: ");
+    if (pthread_create(&c->thread, &c->thread_attr, run, c) != 0) {
+        LOG_ERROR("Failed to create thread: %s", strerror(errno));
         return -1;
     }
     return 0;
@@ -183,42 +416,75 @@ Context* context_alloc(int client) {
     Context* c = (Context*)calloc(1, sizeof(*c));
     c->client = client;
     c->actor = NULL;
+    c->stage = NULL;
+    c->filter.op = FILTER_NONE;
+    pthread_attr_init(&c->thread_attr);
     return c;
 }
 
 int context_destroy(Context* c) {
     // Assume that the client is closed regardless of failure, and that the
-    // context thread has stopped.
-    if (close(c->client) != 0) {
-        perror("Failed to close client: ");
+    // context thread has stopped.  Embedded stages have no client.
+    if (c->client >= 0 && close(c->client) != 0) {
+        LOG_ERROR("Failed to close client: %s", strerror(errno));
     }
     void* ret = NULL;
     if (pthread_join(c->thread, &ret) != 0) {
-        perror("pthread join failed: ");
+        LOG_ERROR("pthread join failed: %s", strerror(errno));
     } else {
         if (ret == NULL) {
-            printf("Thread ended in failed state\n");
+            LOG_ERROR("Thread ended in failed state");
         }
     }
+    filter_destroy(&c->filter);
+    if (c->history != NULL) {
+        journal_history_close(c->history);
+        free(c->history);
+        c->history = NULL;
+    }
     return 0;
 }
 
 // Spawns a new thread with the context handler
 int context_spawn(Context* ctx) {
-    if (context_do_thread(ctx) != 0) {
+    return context_spawn_with(ctx, &context_run);
+}
+
+// Spawns a new thread running run(ctx), for contexts that are not driven by
+// a client socket
+int context_spawn_with(Context* ctx, void* (*run)(void*)) {
+    if (context_do_thread(ctx, run) != 0) {
         if (context_destroy(ctx) != 0) {
-            printf("Failed to destroy context for client %d\n", ctx->client);
+            LOG_ERROR("Failed to destroy context for client %d", ctx->client);
         }
         return -1;
     }
     return 0;
 }
 
+void actor_init(Actor* a) {
+    a->slot = 0;
+    a->read = 0;
+    a->stride = 1;
+    a->type = ACTOR_UNKNOWN;
+    a->attachment = ACTOR_ATTACHED;
+    a->latency = NULL;
+    memset(a->name, 0, sizeof(a->name));
+    a->name_seq = 0;
+    memset(&a->metrics, 0, sizeof(a->metrics));
+}
+
+// Frees what the actor owns, but not the actor
+void actor_destroy(Actor* a) {
+    free(a->latency);
+    a->latency = NULL;
+}
+
 static int actors_resize(Actors* a, size_t max) {
     if (max < a->len) {
         return -1;
     }
-    Actor* i = realloc(a->i, max * sizeof(*i));
+    Actor** i = realloc(a->i, max * sizeof(*i));
     if (i == NULL) {
         return -1;
     }
@@ -228,7 +494,12 @@ static int actors_resize(Actors* a, size_t max) {
 }
 
 static int actors_grow(Actors* a) {
-    return actors_resize(a, a->max * 2);
+    return actors_resize(a, (a->max == 0) ? 1 : a->max * 2);
+}
+
+// Makes room for max actors.  Returns -1 if out of memory.
+int actors_reserve(Actors* a, size_t max) {
+    return (max > a->max) ? actors_resize(a, max) : 0;
 }
 
 void actors_alloc(Actors* a, size_t start) {
@@ -238,33 +509,35 @@ void actors_alloc(Actors* a, size_t start) {
 }
 
 void actors_destroy(Actors* c) {
+    for (size_t i = 0; i < c->len; i++) {
+        actor_destroy(c->i[i]);
+        free(c->i[i]);
+    }
     free(c->i);
     c->i = NULL;
     c->len = 0;
     c->max = 0;
 }
 
-// Returns a new Actor*
+// Returns a new, vacant Actor*.  Actors are allocated individually so the
+// pointers held by running contexts stay valid when the array grows.
 Actor* actors_fetch(Actors* a) {
     if (a->len >= a->max) {
         if (actors_grow(a) < 0) {
             return NULL;
         }
     }
-    Actor* actor = &a->i[a->len++];
-    actor->slot = 0;
-    actor->stride = 1;
-    actor->type = ACTOR_UNKNOWN;
-    return actor;
-}
-
-// Can only be called immediately after an unfetch.
-int actors_unfetch(Actors* a) {
-    if (a->len == 0) {
-        return -1;
+    // Keeps the metrics on their own cache line
+    Actor* actor = NULL;
+    if (posix_memalign((void**)&actor, ACTOR_CACHELINE, sizeof(*actor)) != 0) {
+        return NULL;
     }
-    a->len--;
-    return 1;
+    actor_init(actor);
+    // Holds nothing back until it is given a cursor
+    actor->attachment = ACTOR_VACANT;
+    a->i[a->len] = actor;
+    __atomic_store_n(&a->len, a->len + 1, __ATOMIC_RELEASE);
+    return actor;
 }
 
 static void actor_group_destroy(ActorGroup* g) {
@@ -282,33 +555,151 @@ void actor_groups_destroy(ActorGroups* g) {
     g->max = 0;
 }
 
+// Counts a GET_DATA reply that leased `leased` slots and sent n items of
+// bytes in total.  A transformer's reads are not items; its writes are.
+static void context_count_reply(Actor* actor, uint64_t leased, uint64_t n,
+                                uint64_t bytes) {
+    if (leased == 0) {
+        ACTOR_METRIC_ADD(actor, empty_polls, 1);
+    }
+    if (actor->type == ACTOR_CONSUMER) {
+        ACTOR_METRIC_ADD(actor, items, n);
+        ACTOR_METRIC_ADD(actor, bytes, bytes);
+    }
+}
+
+// Serves GET_DATA to a detached consumer from the journal, up to the
+// journaler's cursor.  Every reply carries slot numbers, and a slot missing
+// from the journal ends the consumer rather than go unread.  Once the
+// consumer has committed up to the ring, and is within the ring's lag
+// limit, the vacuum is asked to attach it; reading continues from the
+// journal until it has.
+static int context_process_history(Context* ctx, GetDataMsg m, Buffer* wbuf) {
+    Crater* c = ctx->crater;
+    Actor* actor = ctx->actor;
+    JournalHistory* h = ctx->history;
+    if (actor_attachment(actor) == ACTOR_DETACHED &&
+        actor_slot(actor) >= actor_slot(&c->vacuum) &&
+        (c->lag_policy != LAG_DETACH ||
+         crater_lag(c, actor, m.io) <= c->max_lag)) {
+        actor_set_attachment(actor, ACTOR_JOINING);
+    }
+    if (h->io != m.io || h->next != actor->read) {
+        journal_history_close(h);
+        journal_history_open(h, c->journal, m.io, actor->read);
+    }
+    uint64_t end = actor_slot(&c->journaler);
+
+    bool filtered = (ctx->filter.op != FILTER_NONE);
+    size_t start = buffer_begin_message(wbuf, MSG_DATA);
+    buffer_write_uint8(wbuf, m.io);
+    buffer_write_uint8(wbuf, DATA_SLOTTED);
+    buffer_write_uint64(wbuf, actor->read);
+    size_t end_at = wbuf->len;
+    buffer_write_uint64(wbuf, 0);
+    size_t count_at = wbuf->len;
+    buffer_write_uint64(wbuf, 0);
+
+    uint64_t slot = actor->read;
+    uint64_t n = 0;
+    uint64_t bytes = 0;
+    for (;;) {
+        uint64_t at = 0;
+        SlotData item;
+        int r = journal_history_peek(h, end, &at, &item);
+        if (r < 0) {
+            return -1;
+        } else if (r == 0) {
+            break;
+        }
+        if (m.max_type == GDMAX_ELEMS && n >= m.max) {
+            break;
+        }
+        // Skipped items are leased without counting against the byte limit
+        if (filtered && !filter_match(&ctx->filter, item.buf, item.len)) {
+            journal_history_consume(h);
+            slot = at + 1;
+            continue;
+        }
+        if (m.max_type == GDMAX_BYTES && n > 0 && bytes + item.len > m.max) {
+            break;
+        }
+        journal_history_consume(h);
+        slot = at + 1;
+        if (buffer_write_uint64(wbuf, at) < 0 ||
+            buffer_write_uint64(wbuf, item.len) < 0 ||
+            buffer_write(wbuf, item.buf, item.len) < 0) {
+            return -1;
+        }
+        CRATER_PROBE(consume, at, actor, item.len);
+        bytes += item.len;
+        n++;
+    }
+    buffer_put_uint64(wbuf, end_at, slot);
+    buffer_put_uint64(wbuf, count_at, n);
+    buffer_end_message(wbuf, start);
+    context_count_reply(actor, slot - actor->read, n, bytes);
+    actor->read = slot;
+    return 0;
+}
+
+// Leases the next range of published slots to the actor and writes them to
+// wbuf as a MSG_DATA reply.  The actor's gating cursor is not moved; the
+// slots stay protected from the vacuum until a COMMIT releases them, so a
+// consumer may issue several GET_DATAs ahead of its commits.  Slots that
+// fail the consumer's filter are leased but not sent, and the reply then
+// carries each item's slot number.
 int context_process_get_data_msg(Context* ctx, GetDataMsg m, Buffer* wbuf) {
-    buffer_reset(wbuf);
     if (m.max_type == GDMAX_UNKNOWN || m.io == SLOT_UNKNOWN) {
         return -1;
     }
-    uint64_t max = m.max;
-    // TODO -- this is cross-thread read, make sure its ok (memory barrier?)
+    Actor* actor = ctx->actor;
     uint64_t max_slot = 0;
+    switch (actor->type) {
+    case ACTOR_CONSUMER:
+        break;
+    case ACTOR_TRANSFORMER:
+        if (m.io == SLOT_INPUT) {
+            break;
+        }
+        // fall through
+    default:
+        LOG_WARN("Actor can't read that column");
+        return -1;
+    }
+    ctx->io = m.io;
+    if (actor_attachment(actor) != ACTOR_ATTACHED) {
+        return context_process_history(ctx, m, wbuf);
+    }
+    if (ctx->history != NULL) {
+        // Caught up with the ring
+        journal_history_close(ctx->history);
+        free(ctx->history);
+        ctx->history = NULL;
+    }
     switch (m.io) {
     case SLOT_INPUT:
-        max_slot = ctx->crater->producer.slot;
-        break;
     case SLOT_OUTPUT:
-        max_slot = ctx->crater->transformer.slot;
+        max_slot = crater_published(ctx->crater, m.io);
         break;
     default:
         assert(false);
         return -1;
     }
-    if (m.max_type == GDMAX_ELEMS) {
-        size_t avail = max_slot - ctx->actor->slot;
-        if (avail < max) {
-            max = avail;
-        }
-    }
 
-    uint64_t slot = ctx->actor->slot;
+    bool filtered = (ctx->filter.op != FILTER_NONE);
+    size_t start = buffer_begin_message(wbuf, MSG_DATA);
+    buffer_write_uint8(wbuf, m.io);
+    buffer_write_uint8(wbuf, filtered ? DATA_SLOTTED : 0);
+    buffer_write_uint64(wbuf, actor->read);
+    size_t end_at = wbuf->len;
+    buffer_write_uint64(wbuf, 0);
+    size_t count_at = wbuf->len;
+    buffer_write_uint64(wbuf, 0);
+
+    uint64_t slot = actor->read;
+    uint64_t n = 0;
+    uint64_t bytes = 0;
     while (slot < max_slot) {
         Buffer buf;
         switch (m.io) {
@@ -316,79 +707,139 @@ int context_process_get_data_msg(Context* ctx, GetDataMsg m, Buffer* wbuf) {
             buf = crater_get_input(ctx->crater, slot);
             break;
         case SLOT_OUTPUT:
-            buf = crater_get_output(ctx->crater, slot);
+            buf = crater_view_output(ctx->crater, slot, &ctx->scratch);
             break;
         default:
             assert(false);
             return -1;
         }
-        if (m.max_type == GDMAX_ELEMS && wbuf->len + buf.len > m.max) {
+        if (m.max_type == GDMAX_ELEMS && n >= m.max) {
+            break;
+        }
+        // Skipped items are leased without counting against the byte limit
+        if (filtered && !filter_match(&ctx->filter, buf.buf, buf.len)) {
+            slot += actor->stride;
+            continue;
+        }
+        // Always hand out at least one item so an oversized one can't wedge
+        // the consumer
+        if (m.max_type == GDMAX_BYTES && n > 0 && bytes + buf.len > m.max) {
             break;
         }
-        if (buffer_write(wbuf, buf.buf, buf.len) < 0) {
+        if ((filtered && buffer_write_uint64(wbuf, slot) < 0) ||
+            buffer_write_uint64(wbuf, buf.len) < 0 ||
+            buffer_write(wbuf, buf.buf, buf.len) < 0) {
             return -1;
         }
-        slot += ctx->actor->stride;
+        if (crater_traced(ctx->crater, slot)) {
+            crater_trace_read(ctx->crater, actor, m.io, slot);
+        }
+        CRATER_PROBE(consume, slot, actor, buf.len);
+        bytes += buf.len;
+        n++;
+        slot += actor->stride;
     }
-    ctx->actor->slot = slot;
+    buffer_put_uint64(wbuf, end_at, slot);
+    buffer_put_uint64(wbuf, count_at, n);
+    buffer_end_message(wbuf, start);
+    context_count_reply(actor, slot - actor->read, n, bytes);
+    actor->read = slot;
 
     return 0;
 }
 
-int context_process_give_data_msg(Context* ctx, GiveDataMsg m) {
-    printf("Processing MSG_GIVE_DATA\n");
-    switch (ctx->actor->type) {
-    case ACTOR_TRANSFORMER:
-    case ACTOR_PRODUCER:
-        break;
-    default:
-        printf("Actor can't write\n");
+// Advances a consumer's gating cursor, releasing its leased slots below
+// m.slot to the vacuum.  Committing slots that were never leased is an error;
+// committing an already committed position is a no-op.
+int context_process_commit_msg(Context* ctx, CommitMsg m) {
+    Actor* actor = ctx->actor;
+    if (actor->type != ACTOR_CONSUMER) {
+        LOG_WARN("Only consumers commit");
         return -1;
     }
-    if (m.io == SLOT_UNKNOWN) {
-        printf("SLOT_UNKNOWN rejected\n");
+    if (m.slot > actor->read) {
+        LOG_WARN("Commit to %lu is past the leased range", m.slot);
         return -1;
     }
-    // TODO -- this is cross-thread read. Review.  Do we need a memory barrier,
-    // or is volatile sufficient?
-    uint64_t max_slot = 0;
-    uint64_t slot = ctx->actor->slot;
-    switch (m.io) {
+    if (m.slot > actor->slot) {
+        crater_publish(actor, m.slot);
+    }
+    return 0;
+}
+
+// Stores item in the next slot of the actor's column and publishes it.
+// Ownership of item.buf passes to the ring on success.  Producers block
+// while the ring is full.  Only output may be given by reference to input.
+// Returns 0 once published, 1 if the byte budget refused the item, which
+// is skipped, or -1 on error.
+int context_publish_item(Context* ctx, SlotDestination io, ItemKind kind,
+                         Buffer item) {
+    Actor* actor = ctx->actor;
+    uint64_t slot = actor->slot;
+    switch (io) {
     case SLOT_INPUT:
-        max_slot = ctx->crater->vacuum.slot;
-        // The followers (vacuum, consumer) move up to the active slot of
-        // the producer. If a follower's slot is equal to the producer's,
-        // the producer has the full ring to access before it catches up.
-        if (max_slot == slot) {
-            max_slot += ctx->crater->len;
+        if (actor->type != ACTOR_PRODUCER) {
+            LOG_WARN("Only the producer can write input");
+            return -1;
+        }
+        if (kind != ITEM_DATA) {
+            LOG_WARN("Input must be given in full");
+            return -1;
         }
+        if (crater_admit(ctx->crater, item.len) < 0) {
+            LOG_DEBUG("Rejected %lu byte item %llu over the byte budget",
+                      item.len, (long long unsigned)ctx->given);
+            return 1;
+        }
+        crater_claim(ctx->crater, actor, io);
+        crater_set_input(ctx->crater, slot, item.buf, item.len, item.max);
+        CRATER_PROBE(produce, slot, actor, item.len);
+        LOG_TRACE("Wrote %lu bytes to crater input slot %lu", item.len, slot);
         break;
     case SLOT_OUTPUT:
-        max_slot = ctx->crater->producer.slot;
-        break;
-    default:
-        printf("Invalid slot type\n");
-        assert(false);
-        return -1;
-    }
-    printf("m.n, slot, max_slot: %lu, %lu, %lu\n", m.n, slot, max_slot);
-    for (uint64_t i = 0; i < m.n && slot < max_slot; i++, slot++) {
-        SlotData data = m.data[i];
-        switch (m.io) {
-        case SLOT_INPUT:
-            crater_set_copy_input(ctx->crater, slot, data.buf, data.len);
-            printf("Wrote %lu bytes to crater input slot %lu\n", data.len, slot);
+        if (actor->type != ACTOR_TRANSFORMER) {
+            LOG_WARN("Only the transformer can write output");
+            return -1;
+        }
+        if (item.len > ctx->crater->item_max) {
+            LOG_WARN("Rejected %lu byte item over the size cap", item.len);
+            return -1;
+        }
+        // Output is only valid against input the transformer has leased
+        if (slot >= actor->read) {
+            LOG_WARN("Output for slot %lu is ahead of input", slot);
+            return -1;
+        }
+        switch (kind) {
+        case ITEM_SAME:
+            crater_set_output_same(ctx->crater, slot);
             break;
-        case SLOT_OUTPUT:
-            crater_set_copy_output(ctx->crater, slot, data.buf, data.len);
-            printf("Wrote %lu bytes to crater output slot %lu\n", data.len, slot);
+        case ITEM_PATCH:
+            if (crater_set_output_patch(ctx->crater, slot, item.buf, item.len,
+                                        item.max) < 0) {
+                LOG_WARN("Patch for slot %lu is outside its input", slot);
+                return -1;
+            }
             break;
+        case ITEM_DATA:
         default:
-            printf("Invalid slot type\n");
-            assert(false);
-            return -1;
+            crater_set_output(ctx->crater, slot, item.buf, item.len,
+                              item.max);
+            break;
         }
+        CRATER_PROBE(transform, slot, actor, item.len);
+        LOG_TRACE("Wrote %lu bytes to crater output slot %lu", item.len, slot);
+        break;
+    default:
+        LOG_WARN("Invalid slot type");
+        return -1;
+    }
+    if (crater_traced(ctx->crater, slot)) {
+        crater_trace_write(ctx->crater, actor, io, slot);
     }
+    crater_publish(actor, slot + 1);
+    ACTOR_METRIC_ADD(actor, items, 1);
+    ACTOR_METRIC_ADD(actor, bytes, item.len);
     return 0;
 }
 
@@ -435,10 +886,14 @@ int contexts_add(Contexts* c, Context* ctx) {
     return p;
 }
 
-Context* contexts_pop(Contexts* c) {
-    if (c->len == 0) {
-        return NULL;
+// Removes ctx from the list, which may reorder it.  Returns -1 if ctx is
+// not in it.
+int contexts_remove(Contexts* c, Context* ctx) {
+    for (size_t i = 0; i < c->len; i++) {
+        if (c->contexts[i] == ctx) {
+            c->contexts[i] = c->contexts[--c->len];
+            return 0;
+        }
     }
-    c->len--;
-    return c->contexts[c->len];
+    return -1;
 }
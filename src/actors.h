@@ -4,24 +4,141 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include "messages.h"
 
+struct ActorLatency;
 struct Crater;
+struct JournalHistory;
+
+// Whether a consumer reads the ring.  One that starts below the ring reads
+// the journal instead, detached, and does not hold back the vacuum until
+// it catches up and the vacuum attaches it.  One that leaves is detached
+// at once, and its place is vacant once the server has reaped it.
+typedef enum {
+    ACTOR_ATTACHED,
+    ACTOR_DETACHED,
+    // Detached, and asking the vacuum to attach it at its cursor
+    ACTOR_JOINING,
+    // No consumer drives the actor; one joining may take its place
+    ACTOR_VACANT
+} ActorAttachment;
+
+#define ACTOR_CACHELINE 64
+
+// Counters of one actor.  Only the thread driving the actor writes them,
+// with relaxed stores that cost no locked instructions, and they sit on
+// their own cache line away from the cursors other threads poll.
+typedef struct {
+    // Items and payload bytes written (producer, transformer) or read
+    // (consumers)
+    uint64_t items;
+    uint64_t bytes;
+    // Messages handled
+    uint64_t requests;
+    // GET_DATA replies with nothing to lease
+    uint64_t empty_polls;
+    // Claims that had to wait for a free slot or for published input
+    uint64_t stalls;
+} __attribute__((aligned(ACTOR_CACHELINE))) ActorMetrics;
+
+#define ACTOR_METRIC_ADD(a, field, n) \
+    __atomic_store_n(&(a)->metrics.field, (a)->metrics.field + (n), \
+                     __ATOMIC_RELAXED)
+#define ACTOR_METRIC_READ(a, field) \
+    __atomic_load_n(&(a)->metrics.field, __ATOMIC_RELAXED)
 
 typedef struct {
+    // Gating cursor: every slot below it is done with and may be reclaimed
     volatile uint64_t slot;
+    // Lease cursor: slots in [slot, read) have been handed out by GET_DATA
+    // but not yet committed.  Only touched by the owning context.
+    uint64_t read;
     uint64_t stride;
     ActorType type;
+    volatile uint8_t attachment;
+    // Latency histograms, allocated by the owning thread on its first
+    // traced slot
+    struct ActorLatency* latency;
+    // Consumers only: name the cursor is saved under, empty if it has none.
+    // name_seq is odd while a consumer taking the place renames it.
+    char name[CONSUMERNAMEMAX + 1];
+    volatile uint32_t name_seq;
+    ActorMetrics metrics;
 } Actor;
 
+// Cursors are written by their owning thread and read by the others, so
+// they are published with release and observed with acquire ordering.
+static inline uint64_t actor_slot(const Actor* a) {
+    return __atomic_load_n(&a->slot, __ATOMIC_ACQUIRE);
+}
+
+static inline void actor_set_slot(Actor* a, uint64_t slot) {
+    __atomic_store_n(&a->slot, slot, __ATOMIC_RELEASE);
+}
+
+static inline ActorAttachment actor_attachment(const Actor* a) {
+    return (ActorAttachment)__atomic_load_n(&a->attachment, __ATOMIC_ACQUIRE);
+}
+
+static inline void actor_set_attachment(Actor* a, ActorAttachment s) {
+    __atomic_store_n(&a->attachment, (uint8_t)s, __ATOMIC_RELEASE);
+}
+
+// Moves a from attachment from to to, unless another thread moved it first
+static inline bool actor_swap_attachment(Actor* a, ActorAttachment from,
+                                         ActorAttachment to) {
+    uint8_t expect = (uint8_t)from;
+    return __atomic_compare_exchange_n(&a->attachment, &expect, (uint8_t)to,
+                                       false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+}
+
+// A consumer taking a place renames it, NULL for no name, and places its
+// cursor before calling actor_rename_end.  Only the thread adding actors
+// renames them.
+static inline void actor_rename_begin(Actor* a, const char* name) {
+    __atomic_store_n(&a->name_seq, a->name_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(a->name, 0, sizeof(a->name));
+    if (name != NULL) {
+        strncpy(a->name, name, CONSUMERNAMEMAX);
+    }
+}
+
+static inline void actor_rename_end(Actor* a) {
+    __atomic_store_n(&a->name_seq, a->name_seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copies a's name, into CONSUMERNAMEMAX + 1 bytes at name, and its cursor
+// as they were under one name.  Returns false if a was being renamed.
+static inline bool actor_named_slot(const Actor* a, char* name,
+                                    uint64_t* slot, uint32_t* seq) {
+    *seq = __atomic_load_n(&a->name_seq, __ATOMIC_ACQUIRE);
+    if (*seq % 2 != 0) {
+        return false;
+    }
+    memcpy(name, a->name, sizeof(a->name));
+    *slot = actor_slot(a);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    name[CONSUMERNAMEMAX] = '\0';
+    return __atomic_load_n(&a->name_seq, __ATOMIC_RELAXED) == *seq;
+}
+
+// Only one thread adds actors.  Others may walk the list once it is known
+// not to grow past max, reading its length with actors_len.
 typedef struct {
-    size_t len;
+    volatile size_t len;
     size_t max;
-    Actor* i;
+    Actor** i;
 } Actors;
 
+static inline size_t actors_len(const Actors* a) {
+    return __atomic_load_n(&a->len, __ATOMIC_ACQUIRE);
+}
+
 typedef struct {
     ssize_t id;
     Actor* i;
@@ -41,6 +158,25 @@ typedef struct {
     int client;
     Actor* actor;
     struct Crater* crater;
+    // GIVE_DATA frame currently being streamed into the ring, if any
+    bool streaming;
+    GiveDataParser give;
+    // Items given on the connection, which a MSG_REJECT counts by
+    uint64_t given;
+    // Embedded stage driving this context instead of a client, if any
+    void* stage;
+    // Items failing the filter are skipped by GET_DATA
+    Filter filter;
+    // Assembles patched output items for GET_DATA
+    Buffer scratch;
+    // Journal reader for a detached consumer
+    struct JournalHistory* history;
+    // Column a consumer last read, and since when it has been over the
+    // ring's lag limit, 0 if it is not
+    SlotDestination io;
+    uint64_t lagging_usec;
+    // Set by the context's thread as it exits, for the server to reap it
+    volatile bool done;
 } Context;
 
 typedef struct {
@@ -49,23 +185,28 @@ typedef struct {
     size_t max;
 } Contexts;
 
+void actor_init(Actor* a);
+void actor_destroy(Actor* a);
 void actors_alloc(Actors* a, size_t start);
+int actors_reserve(Actors* a, size_t max);
 Actor* actors_fetch(Actors* a);
-int actors_unfetch(Actors* a);
 
 void contexts_alloc(Contexts* c, size_t start);
 int contexts_add(Contexts* c, Context* ctx);
 void contexts_destroy(Contexts* c);
-Context* contexts_pop(Contexts* c);
+int contexts_remove(Contexts* c, Context* ctx);
 
 void actor_groups_destroy(ActorGroups* g);
 void actors_destroy(Actors* c);
 
 Context* context_alloc(int client);
 int context_spawn(Context* c);
+int context_spawn_with(Context* c, void* (*run)(void*));
 int context_destroy(Context* c);
 
 int context_process_get_data_msg(Context* c, GetDataMsg m, Buffer* wbuf);
-int context_process_give_data_msg(Context* c, GiveDataMsg m);
+int context_process_commit_msg(Context* c, CommitMsg m);
+int context_publish_item(Context* c, SlotDestination io, ItemKind kind,
+                         Buffer item);
 
 #endif /* ACTORS_H */
@@ -0,0 +1,31 @@
+#include "addr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Converts hostname of the form "xxx.xx.xx.xxx:yyyy" to an Addr
+// Returns 0 on success, -1 on error.
+int addr_from_hostname(const char* hostname, Addr* addr) {
+    uint16_t port = 0;
+    char* colon = strchr(hostname, ':');
+    if (colon != NULL) {
+        int iport = atoi(colon + 1);
+        if (iport < 0 || iport > UINT16_MAX) {
+            return -1;
+        }
+        port = (uint16_t)iport;
+    }
+    addr->port = port;
+    size_t ip_len = 0;
+    if (colon == NULL) {
+        ip_len = strlen(hostname);
+    } else {
+        ip_len = colon - hostname;
+    }
+    char* ip = malloc(ip_len + 1);
+    strncpy(ip, hostname, ip_len);
+    ip[ip_len] = '\0';
+    int ret = inet_aton(ip, &addr->host);
+    free(ip);
+    return (ret == 0) ? -1 : 0;
+}
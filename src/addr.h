@@ -0,0 +1,15 @@
+#ifndef ADDR_H
+#define ADDR_H
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+typedef struct {
+    struct in_addr host;
+    uint16_t port;
+} Addr;
+
+int addr_from_hostname(const char* hostname, Addr* addr);
+
+#endif /* ADDR_H */
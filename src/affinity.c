@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static void cpu_list_add(CpuList* l, unsigned long cpu) {
+    uint64_t bit = (uint64_t)1 << (cpu % 64);
+    if (!(l->bits[cpu / 64] & bit)) {
+        l->bits[cpu / 64] |= bit;
+        l->count++;
+    }
+}
+
+// Parses a list of CPUs and ranges such as "0,2-5,8".  Returns -1 if
+// malformed or a CPU is not present on this machine.
+int cpu_list_parse(const char* s, CpuList* l) {
+    memset(l, 0, sizeof(*l));
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpus <= 0 || ncpus > AFFINITY_MAX_CPUS) {
+        ncpus = AFFINITY_MAX_CPUS;
+    }
+    const char* p = s;
+    while (*p != '\0') {
+        char* end = NULL;
+        unsigned long lo = strtoul(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+        unsigned long hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtoul(p, &end, 10);
+            if (end == p) {
+                return -1;
+            }
+            p = end;
+        }
+        if (hi < lo || hi >= (unsigned long)ncpus) {
+            return -1;
+        }
+        for (unsigned long cpu = lo; cpu <= hi; cpu++) {
+            cpu_list_add(l, cpu);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return (l->count > 0) ? 0 : -1;
+}
+
+// Parses "role=cpus", role being one of p, t, c, v (vacuum) or j
+// (journal).  Returns -1 if malformed.
+int placement_parse(Placement* p, const char* spec) {
+    if (spec[0] == '\0' || spec[1] != '=') {
+        return -1;
+    }
+    CpuList* l = NULL;
+    switch (spec[0]) {
+    case 'p':
+        l = &p->producer;
+        break;
+    case 't':
+        l = &p->transformer;
+        break;
+    case 'c':
+        l = &p->consumer;
+        break;
+    case 'v':
+        l = &p->vacuum;
+        break;
+    case 'j':
+        l = &p->journal;
+        break;
+    default:
+        return -1;
+    }
+    return cpu_list_parse(&spec[2], l);
+}
+
+const CpuList* placement_for(const Placement* p, ActorType type) {
+    switch (type) {
+    case ACTOR_PRODUCER:
+        return &p->producer;
+    case ACTOR_TRANSFORMER:
+        return &p->transformer;
+    case ACTOR_CONSUMER:
+        return &p->consumer;
+    default:
+        return NULL;
+    }
+}
+
+static void cpu_list_to_set(const CpuList* l, cpu_set_t* set) {
+    CPU_ZERO(set);
+    for (size_t cpu = 0; cpu < AFFINITY_MAX_CPUS && cpu < CPU_SETSIZE;
+         cpu++) {
+        if (l->bits[cpu / 64] & ((uint64_t)1 << (cpu % 64))) {
+            CPU_SET(cpu, set);
+        }
+    }
+}
+
+// Threads created with attr will only run on the CPUs in l
+int affinity_set_attr(pthread_attr_t* attr, const CpuList* l) {
+    if (l == NULL || l->count == 0) {
+        return 0;
+    }
+    cpu_set_t set;
+    cpu_list_to_set(l, &set);
+    int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (err != 0) {
+        LOG_ERROR("Failed to set thread affinity: %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Moves the calling thread onto the CPUs in l
+int affinity_set_self(const CpuList* l) {
+    if (l == NULL || l->count == 0) {
+        return 0;
+    }
+    cpu_set_t set;
+    cpu_list_to_set(l, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        LOG_ERROR("Failed to set thread affinity: %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
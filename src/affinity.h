@@ -0,0 +1,36 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "messages.h"
+
+// CPU placement for the threads of a crater.  An empty CpuList leaves the
+// thread to the scheduler.
+
+#define AFFINITY_MAX_CPUS 1024
+
+typedef struct {
+    uint64_t bits[AFFINITY_MAX_CPUS / 64];
+    size_t count;
+} CpuList;
+
+typedef struct {
+    CpuList producer;
+    CpuList transformer;
+    CpuList consumer;
+    // The main thread: accepts clients, then runs the vacuum
+    CpuList vacuum;
+    CpuList journal;
+} Placement;
+
+int cpu_list_parse(const char* s, CpuList* l);
+int placement_parse(Placement* p, const char* spec);
+const CpuList* placement_for(const Placement* p, ActorType type);
+
+int affinity_set_attr(pthread_attr_t* attr, const CpuList* l);
+int affinity_set_self(const CpuList* l);
+
+#endif /* AFFINITY_H */
@@ -0,0 +1,376 @@
+// In-process ring benchmark.  Drives a Crater through the embedded stage
+// API, with no sockets or framing, so the numbers measure sequencing, slot
+// storage and the vacuum alone.  Run without a topology it sweeps a fixed
+// suite; otherwise it runs the one configuration given.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "crater.h"
+#include "pool.h"
+
+#define BENCH_MAX_THREADS 64
+
+typedef struct {
+    size_t producers;
+    bool transformer;
+    size_t consumers;
+    uint64_t ring;
+    size_t payload;
+    size_t inline_max;
+    uint64_t items;
+} BenchOptions;
+
+typedef struct {
+    double secs;
+    // -1 if the counter is unavailable
+    int64_t cache_misses;
+} BenchResult;
+
+typedef struct {
+    Crater* crater;
+    const BenchOptions* opts;
+    // Producers share the ring's single producer cursor under this lock
+    pthread_mutex_t claim;
+    volatile bool go;
+} Bench;
+
+typedef struct {
+    Bench* bench;
+    Actor* actor;
+    uint64_t count;
+    uint64_t sum;
+} BenchThread;
+
+static void bench_options_default(BenchOptions* o) {
+    o->producers = 1;
+    o->transformer = false;
+    o->consumers = 1;
+    o->ring = 1024;
+    o->payload = 16;
+    o->inline_max = 64;
+    o->items = 2000000;
+}
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_wait_go(Bench* b) {
+    unsigned spins = 0;
+    while (!__atomic_load_n(&b->go, __ATOMIC_ACQUIRE)) {
+        crater_backoff(&spins);
+    }
+}
+
+static void* bench_producer(void* arg) {
+    BenchThread* t = arg;
+    Bench* b = t->bench;
+    Crater* c = b->crater;
+    char* payload = malloc(b->opts->payload);
+    memset(payload, 'x', b->opts->payload);
+    pool_thread_attach();
+    bench_wait_go(b);
+    bool shared = b->opts->producers > 1;
+    for (uint64_t i = 0; i < t->count; i++) {
+        if (shared) {
+            pthread_mutex_lock(&b->claim);
+        }
+        uint64_t slot = crater_claim(c, &c->producer, SLOT_INPUT);
+        crater_set_copy_input(c, slot, payload, b->opts->payload);
+        crater_publish(&c->producer, slot + 1);
+        if (shared) {
+            pthread_mutex_unlock(&b->claim);
+        }
+    }
+    pool_thread_detach();
+    free(payload);
+    return NULL;
+}
+
+static void* bench_transformer(void* arg) {
+    BenchThread* t = arg;
+    Bench* b = t->bench;
+    Crater* c = b->crater;
+    bench_wait_go(b);
+    uint64_t slot = 0;
+    while (slot < b->opts->items) {
+        uint64_t end = crater_wait(c, SLOT_INPUT, slot);
+        for (; slot < end; slot++) {
+            crater_set_output_same(c, slot);
+        }
+        crater_publish(t->actor, end);
+    }
+    return NULL;
+}
+
+static void* bench_consumer(void* arg) {
+    BenchThread* t = arg;
+    Bench* b = t->bench;
+    Crater* c = b->crater;
+    SlotDestination io = b->opts->transformer ? SLOT_OUTPUT : SLOT_INPUT;
+    Buffer scratch;
+    buffer_alloc(&scratch, 64);
+    bench_wait_go(b);
+    uint64_t slot = 0;
+    while (slot < b->opts->items) {
+        uint64_t end = crater_wait(c, io, slot);
+        for (; slot < end; slot++) {
+            Buffer v = (io == SLOT_OUTPUT) ?
+                crater_view_output(c, slot, &scratch) :
+                crater_get_input(c, slot);
+            // Touch the payload so the read is not optimized away
+            t->sum += (uint8_t)v.buf[v.len - 1];
+        }
+        crater_publish(t->actor, end);
+    }
+    buffer_free(&scratch);
+    return NULL;
+}
+
+static void* bench_vacuum(void* arg) {
+    Bench* b = arg;
+    Crater* c = b->crater;
+    pool_thread_attach();
+    bench_wait_go(b);
+    unsigned spins = 0;
+    while (actor_slot(&c->vacuum) < b->opts->items) {
+        if (crater_vacuum(c) > 0) {
+            spins = 0;
+        } else {
+            crater_backoff(&spins);
+        }
+    }
+    pool_thread_detach();
+    return NULL;
+}
+
+// Counts cache misses of this thread and of every thread it creates from
+// now on.  Returns -1 if the kernel does not allow it.
+static int bench_perf_open(void) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.inherit = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+// Runs one configuration.  Returns -1 if the ring could not be set up.
+static int bench_run(const BenchOptions* o, BenchResult* r) {
+    if (o->producers + o->consumers + 2 > BENCH_MAX_THREADS) {
+        printf("At most %d threads\n", BENCH_MAX_THREADS);
+        return -1;
+    }
+    CraterOptions co;
+    crater_options_default(&co);
+    co.len = o->ring;
+    co.inline_max = o->inline_max;
+    co.n_consumers = o->consumers;
+    Crater* c = crater_alloc(&co);
+    if (c == NULL) {
+        return -1;
+    }
+    c->config.expect_transformer = o->transformer;
+    c->producer.type = ACTOR_PRODUCER;
+    c->transformer.type = ACTOR_TRANSFORMER;
+
+    Bench b = { .crater = c, .opts = o, .go = false };
+    pthread_mutex_init(&b.claim, NULL);
+    BenchThread threads[BENCH_MAX_THREADS];
+    pthread_t ids[BENCH_MAX_THREADS];
+    size_t n = 0;
+    memset(threads, 0, sizeof(threads));
+
+    int perf = bench_perf_open();
+    uint64_t per = o->items / o->producers;
+    for (size_t i = 0; i < o->producers; i++) {
+        threads[n] = (BenchThread) { .bench = &b, .actor = &c->producer };
+        threads[n].count = (i + 1 == o->producers) ?
+            o->items - per * i : per;
+        pthread_create(&ids[n], NULL, bench_producer, &threads[n]);
+        n++;
+    }
+    if (o->transformer) {
+        threads[n] = (BenchThread) { .bench = &b, .actor = &c->transformer };
+        pthread_create(&ids[n], NULL, bench_transformer, &threads[n]);
+        n++;
+    }
+    for (size_t i = 0; i < o->consumers; i++) {
+        Actor* a = actors_fetch(&c->consumers);
+        a->type = ACTOR_CONSUMER;
+        a->attachment = ACTOR_ATTACHED;
+        threads[n] = (BenchThread) { .bench = &b, .actor = a };
+        pthread_create(&ids[n], NULL, bench_consumer, &threads[n]);
+        n++;
+    }
+    pthread_t vacuum;
+    pthread_create(&vacuum, NULL, bench_vacuum, &b);
+
+    uint64_t start = bench_now_ns();
+    __atomic_store_n(&b.go, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < n; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    r->secs = (double)(bench_now_ns() - start) / 1e9;
+    pthread_join(vacuum, NULL);
+
+    r->cache_misses = -1;
+    if (perf >= 0) {
+        uint64_t misses = 0;
+        if (read(perf, &misses, sizeof(misses)) == sizeof(misses)) {
+            r->cache_misses = (int64_t)misses;
+        }
+        close(perf);
+    }
+    pthread_mutex_destroy(&b.claim);
+    crater_destroy(c);
+    return 0;
+}
+
+static void bench_topology_name(const BenchOptions* o, char* buf,
+                                size_t len) {
+    if (o->transformer) {
+        snprintf(buf, len, "%zuP-1T-%zuC", o->producers, o->consumers);
+    } else {
+        snprintf(buf, len, "%zuP-%zuC", o->producers, o->consumers);
+    }
+}
+
+static void bench_print_header(void) {
+    printf("%-12s %8s %8s %10s %8s %12s %8s %14s\n", "topology", "ring",
+           "payload", "items", "secs", "ops/s", "ns/op", "misses/op");
+}
+
+static void bench_print(const BenchOptions* o, const BenchResult* r) {
+    char name[32];
+    bench_topology_name(o, name, sizeof(name));
+    printf("%-12s %8llu %8zu %10llu %8.3f %12.0f %8.1f ", name,
+           (long long unsigned)o->ring, o->payload,
+           (long long unsigned)o->items, r->secs,
+           (double)o->items / r->secs, r->secs * 1e9 / (double)o->items);
+    if (r->cache_misses >= 0) {
+        printf("%14.2f\n", (double)r->cache_misses / (double)o->items);
+    } else {
+        printf("%14s\n", "-");
+    }
+    fflush(stdout);
+}
+
+// Sweeps every topology over a few ring and payload sizes
+static int bench_suite(const BenchOptions* base) {
+    static const struct {
+        size_t producers;
+        bool transformer;
+        size_t consumers;
+    } topologies[] = {
+        { 1, false, 1 },
+        { 1, true, 1 },
+        { 1, true, 4 },
+        { 2, false, 1 },
+    };
+    static const uint64_t rings[] = { 1024, 65536 };
+    static const size_t payloads[] = { 16, 1024 };
+    bench_print_header();
+    for (size_t t = 0; t < sizeof(topologies) / sizeof(topologies[0]); t++) {
+        for (size_t r = 0; r < sizeof(rings) / sizeof(rings[0]); r++) {
+            for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]);
+                 p++) {
+                BenchOptions o = *base;
+                o.producers = topologies[t].producers;
+                o.transformer = topologies[t].transformer;
+                o.consumers = topologies[t].consumers;
+                o.ring = rings[r];
+                o.payload = payloads[p];
+                BenchResult res;
+                if (bench_run(&o, &res) < 0) {
+                    return -1;
+                }
+                bench_print(&o, &res);
+            }
+        }
+    }
+    return 0;
+}
+
+static void usage(void) {
+    printf("Usage: ./crater-bench [-p producers] [-t] [-c consumers] "
+           "[-r slots] [-s bytes] [-i bytes] [-n items]\n");
+    printf("Without -p, -t or -c, runs the whole suite.\n");
+    printf("  -p  Producer threads, sharing the ring's producer cursor "
+           "(default 1)\n");
+    printf("  -t  Run a transformer; consumers then read its output\n");
+    printf("  -c  Consumer threads (default 1)\n");
+    printf("  -r  Ring slots (default 1024)\n");
+    printf("  -s  Payload size (default 16)\n");
+    printf("  -i  Inline payload limit (default 64)\n");
+    printf("  -n  Items per run (default 2000000)\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOptions o;
+    bench_options_default(&o);
+    bool single = false;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hp:tc:r:s:i:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            o.producers = (size_t)atoi(optarg);
+            single = true;
+            break;
+        case 't':
+            o.transformer = true;
+            single = true;
+            break;
+        case 'c':
+            o.consumers = (size_t)atoi(optarg);
+            single = true;
+            break;
+        case 'r':
+            o.ring = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            o.payload = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            o.inline_max = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            o.items = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage();
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (o.producers == 0 || o.consumers == 0 || o.ring == 0 ||
+        o.payload == 0 || o.items < o.producers) {
+        usage();
+        return 1;
+    }
+    if (!single) {
+        return (bench_suite(&o) < 0) ? 1 : 0;
+    }
+    BenchResult r;
+    if (bench_run(&o, &r) < 0) {
+        printf("Failed to set up the ring\n");
+        return 1;
+    }
+    bench_print_header();
+    bench_print(&o, &r);
+    return 0;
+}
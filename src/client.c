@@ -1,31 +1,61 @@
-#include <stdio.h>
+#include "client.h"
 
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <assert.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-#include "server.h"
+#define CLIENTBUFSIZE (64 * 1024)
+#define HEADERLEN (sizeof(uint64_t) + sizeof(uint8_t))
+// GIVE_DATA body bytes before the first item: io and count
+#define GIVEDATAPREFIX (sizeof(uint8_t) + sizeof(uint64_t))
+// Backoff bounds while fetches come back empty
+#define EMPTY_SLEEP_MIN_USEC 50
+#define EMPTY_SLEEP_MAX_USEC 1000
 
-typedef struct {
-    int client;
-    ActorType type;
-} Client;
+// Reports an error to stderr.  The library never writes to stdout, which
+// is the application's.
+static void client_error(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
 
-int client_connect(Client* c, Addr addr) {
+static uint64_t client_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void client_options_default(ClientOptions* o) {
+    o->batch_bytes = 64 * 1024;
+    o->linger_usec = 1000;
+    o->max_pending = 4 * 1024 * 1024;
+    o->fetch_depth = 2;
+    o->fetch_max = 1024;
+    o->filter = (Filter) {
+        .op = FILTER_NONE, .offset = 0, .len = 0, .value = NULL
+    };
+    o->start = START_DEFAULT;
+    o->start_slot = 0;
+    o->ring = NULL;
+    o->name = NULL;
+}
 
+static int client_socket(Addr addr) {
     int client = socket(AF_INET, SOCK_STREAM, 0);
     if (client < 0) {
-        perror("Failed to make socket: ");
-        return -1;
-    }
-
-    struct sockaddr_in cin;
-    memset(&cin, 0, sizeof(cin));
-    cin.sin_family = AF_INET;
-    cin.sin_port = htons(0);
-    cin.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(client, (struct sockaddr*)&cin, sizeof(cin)) < 0) {
-        perror("Failed to bind to socket: ");
+        client_error("Failed to make socket: %s", strerror(errno));
         return -1;
     }
 
@@ -35,214 +65,907 @@ int client_connect(Client* c, Addr addr) {
     sin.sin_port = htons(addr.port);
     sin.sin_addr = addr.host;
     if (connect(client, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-        perror("Failed to connect to server: ");
+        client_error("Failed to connect to server: %s", strerror(errno));
+        close(client);
         return -1;
     }
+    // Requests and small batches must not wait on delayed ACKs
+    int one = 1;
+    if (setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        client_error("Failed to set TCP_NODELAY: %s", strerror(errno));
+    }
+    return client;
+}
 
-    c->client = client;
+// Waits up to timeout_ms (forever if negative) for the socket to become
+// readable, or writable if want_write.  Returns -1 on error.
+static int client_wait(Client* c, bool want_read, bool want_write,
+                       int timeout_ms) {
+    fd_set readset;
+    FD_ZERO(&readset);
+    if (want_read) {
+        FD_SET(c->client, &readset);
+    }
+    fd_set writeset;
+    FD_ZERO(&writeset);
+    if (want_write) {
+        FD_SET(c->client, &writeset);
+    }
+    struct timeval tv;
+    struct timeval* tvp = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+    if (select(c->client + 1, &readset, &writeset, NULL, tvp) < 0 &&
+        errno != EINTR) {
+        client_error("select failed: %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-static size_t write_uint64(uint64_t val, char* buf, size_t len) {
-    if (len < sizeof(uint64_t)) {
-        return 0;
+// Bytes of wbuf that may go on the wire.  An open batch is held back until
+// it is closed and its header is final.
+static size_t client_sendable(Client* c) {
+    return c->batching ? c->batch_start : c->wbuf.len;
+}
+
+// Sends as much as the socket takes without blocking
+static int client_send_pending(Client* c) {
+    size_t end = client_sendable(c);
+    while (c->wsent < end) {
+        ssize_t n = send(c->client, &c->wbuf.buf[c->wsent], end - c->wsent,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            client_error("send failed: %s", strerror(errno));
+            return -1;
+        }
+        c->wsent += (size_t)n;
+    }
+    // Drop what has been sent so wbuf only holds pending bytes
+    if (c->wsent > 0 && c->wsent == end) {
+        buffer_strip(&c->wbuf, c->wsent);
+        if (c->batching) {
+            c->batch_start -= c->wsent;
+            c->batch_count_at -= c->wsent;
+        }
+        c->wsent = 0;
     }
-    *(uint64_t*)buf = val;
-    return sizeof(uint64_t);
+    return 0;
 }
 
-static size_t write_uint8(uint8_t val, char* buf, size_t len) {
-    if (len < sizeof(uint8_t)) {
-        return 0;
+static void client_open_batch(Client* c) {
+    SlotDestination io = SLOT_INPUT;
+    if (c->type == ACTOR_TRANSFORMER) {
+        io = SLOT_OUTPUT;
     }
-    *(uint8_t*)buf = val;
-    return sizeof(uint8_t);
+    c->batch_start = buffer_begin_message(&c->wbuf, MSG_GIVE_DATA);
+    buffer_write_uint8(&c->wbuf, io);
+    c->batch_count_at = c->wbuf.len;
+    buffer_write_uint64(&c->wbuf, 0);
+    c->batch_n = 0;
+    c->batch_bytes = 0;
+    c->batch_deadline = client_now_usec() + c->opts.linger_usec;
+    c->batching = true;
 }
 
-static size_t write_bytes(char* data, size_t ndata, char* buf, size_t len) {
-    if (len < ndata) {
-        return 0;
+static void client_close_batch(Client* c) {
+    if (!c->batching) {
+        return;
     }
-    memcpy(buf, data, ndata);
-    return ndata;
-}
-
-static char* serialize_configure_msg(ConfigureMessage m, size_t* buflen) {
-    size_t mlen = sizeof(uint8_t);
-    size_t blen = mlen + sizeof(uint64_t) + sizeof(uint8_t);
-    char* buf = malloc(blen);
-    size_t r = 0;
-    r += write_uint64(mlen, buf, blen);
-    r += write_uint8(MSG_CONFIGURE, &buf[r], blen - r);
-    r += write_uint8(m.actor_type, &buf[r], blen - r);
-    *buflen = r;
-    return buf;
-}
-
-static char* serialize_give_data_msg(GiveDataMsg m, size_t* buflen) {
-    size_t mlen = sizeof(uint8_t) + sizeof(m.n);
-    for (uint64_t i = 0; i < m.n; i++) {
-        mlen += sizeof(m.data[i].len) + m.data[i].len;
-    }
-    size_t blen = mlen + sizeof(uint64_t) + sizeof(uint8_t);
-    char* buf = malloc(blen);
-    size_t r = 0;
-    r += write_uint64(mlen, buf, blen);
-    r += write_uint8(MSG_GIVE_DATA, &buf[r], blen - r);
-    r += write_uint8(m.io, &buf[r], blen - r);
-    r += write_uint64(m.n, &buf[r], blen - r);
-    for (uint64_t i = 0; i < m.n; i++) {
-        r += write_uint64(m.data[i].len, &buf[r], blen - r);
-        r += write_bytes(m.data[i].buf, m.data[i].len, &buf[r], blen - r);
-    }
-    *buflen = r;
-    return buf;
-}
-
-int client_sendall(Client* c, char* buf, size_t len) {
-    size_t wrote = 0;
-    while (wrote < len) {
-        ssize_t n = send(c->client, &buf[wrote], len, 0);
-        if (n < 0) {
-            perror("send failed: ");
-            free(buf);
+    buffer_put_uint64(&c->wbuf, c->batch_count_at, c->batch_n);
+    buffer_end_message(&c->wbuf, c->batch_start);
+    c->batching = false;
+}
+
+// Adds a record to the open batch, regardless of how much is pending.
+// flags are ITEM_FLAG_* bits for the record's length word; key is only
+// sent with ITEM_FLAG_KEYED.
+static int client_append(Client* c, uint64_t flags, uint64_t key,
+                         const char* data, size_t len) {
+    size_t prefix = (flags == ITEM_FLAG_KEYED) ? 2 * sizeof(uint64_t) :
+        sizeof(uint64_t);
+    if (GIVEDATAPREFIX + prefix + len > MSGMAXLEN) {
+        client_error("Record of %lu bytes is too large", len);
+        return -1;
+    }
+    // Keep each frame under MSGMAXLEN
+    if (c->batching && c->wbuf.len - c->batch_start - HEADERLEN +
+        prefix + len > MSGMAXLEN) {
+        client_close_batch(c);
+    }
+    if (!c->batching) {
+        client_open_batch(c);
+    }
+    if (buffer_write_uint64(&c->wbuf, len | flags) < 0 ||
+        (flags == ITEM_FLAG_KEYED && buffer_write_uint64(&c->wbuf, key) < 0) ||
+        buffer_write(&c->wbuf, data, len) < 0) {
+        return -1;
+    }
+    c->batch_n++;
+    c->batch_bytes += len;
+    if (c->batch_bytes >= c->opts.batch_bytes) {
+        client_close_batch(c);
+        return client_send_pending(c);
+    }
+    return 0;
+}
+
+int client_connect(Client* c, Addr addr, ActorType type,
+                   const ClientOptions* opts) {
+    memset(c, 0, sizeof(*c));
+    c->client = -1;
+    c->type = type;
+    if (opts == NULL) {
+        client_options_default(&c->opts);
+    } else {
+        c->opts = *opts;
+    }
+    if (c->opts.ring != NULL &&
+        (c->opts.ring[0] == '\0' || strlen(c->opts.ring) > RINGNAMEMAX)) {
+        client_error("Ring names are 1 to %d bytes", RINGNAMEMAX);
+        return -1;
+    }
+    if (c->opts.name != NULL &&
+        (c->opts.name[0] == '\0' || strlen(c->opts.name) > CONSUMERNAMEMAX)) {
+        client_error("Consumer names are 1 to %d bytes", CONSUMERNAMEMAX);
+        return -1;
+    }
+    c->client = client_socket(addr);
+    if (c->client < 0) {
+        return -1;
+    }
+    buffer_alloc(&c->rbuf, CLIENTBUFSIZE);
+    buffer_alloc(&c->wbuf, CLIENTBUFSIZE);
+    buffer_alloc(&c->stats, 256);
+    buffer_alloc(&c->rejects, 64);
+
+    // The configure message must be the first frame; anything queued after
+    // it is pipelined behind it
+    size_t start = buffer_begin_message(&c->wbuf, MSG_CONFIGURE);
+    buffer_write_uint8(&c->wbuf, type);
+    const Filter* f = &c->opts.filter;
+    const char* ring = c->opts.ring;
+    const char* name = c->opts.name;
+    if (f->op != FILTER_NONE || c->opts.start != START_DEFAULT ||
+        ring != NULL || name != NULL) {
+        buffer_write_uint8(&c->wbuf, f->op);
+        buffer_write_uint64(&c->wbuf, f->offset);
+        buffer_write_uint64(&c->wbuf, f->len);
+        buffer_write(&c->wbuf, f->value, f->len);
+    }
+    if (c->opts.start != START_DEFAULT || ring != NULL || name != NULL) {
+        buffer_write_uint8(&c->wbuf, c->opts.start);
+        buffer_write_uint64(&c->wbuf, c->opts.start_slot);
+    }
+    if (ring != NULL || name != NULL) {
+        // An empty ring name joins the server's first ring
+        const char* r = (ring == NULL) ? "" : ring;
+        buffer_write_uint64(&c->wbuf, strlen(r));
+        buffer_write(&c->wbuf, r, strlen(r));
+    }
+    if (name != NULL) {
+        buffer_write_uint64(&c->wbuf, strlen(name));
+        buffer_write(&c->wbuf, name, strlen(name));
+    }
+    c->opts.filter.value = NULL;
+    c->opts.ring = NULL;
+    c->opts.name = NULL;
+    buffer_end_message(&c->wbuf, start);
+
+    int flags = fcntl(c->client, F_GETFL, 0);
+    if (flags < 0 || fcntl(c->client, F_SETFL, flags | O_NONBLOCK) < 0) {
+        client_error("Failed to make socket non-blocking: %s",
+                     strerror(errno));
+        client_close(c);
+        return -1;
+    }
+    if (client_flush(c) < 0) {
+        client_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+void client_close(Client* c) {
+    if (c->client >= 0 && close(c->client) < 0) {
+        client_error("Failed to close client: %s", strerror(errno));
+    }
+    c->client = -1;
+    buffer_free(&c->rbuf);
+    buffer_free(&c->wbuf);
+    buffer_free(&c->stats);
+    buffer_free(&c->rejects);
+}
+
+// Sends what it can once max_pending bytes are waiting.  Returns 1 if they
+// still are, 0 if there is room, or -1 on error.
+static int client_full(Client* c) {
+    if (c->wbuf.len - c->wsent >= c->opts.max_pending) {
+        if (client_send_pending(c) < 0) {
             return -1;
         }
-        wrote += (size_t)n;
+        if (c->wbuf.len - c->wsent >= c->opts.max_pending) {
+            return 1;
+        }
     }
     return 0;
 }
 
-int client_send_config(Client* c) {
-    ConfigureMessage m;
-    m.actor_type = c->type;
-    size_t len = 0;
-    char* buf = serialize_configure_msg(m, &len);
-    if (buf == NULL) {
+// Queues a record for the producer's input column, or the transformer's
+// output column.  Returns 0 once queued, 1 if max_pending bytes are already
+// waiting (call client_poll and retry), or -1 on error.
+int client_produce(Client* c, const char* data, size_t len) {
+    if (c->type != ACTOR_PRODUCER && c->type != ACTOR_TRANSFORMER) {
+        client_error("Actor can't produce");
         return -1;
     }
-    printf("Sending %lu bytes as configuration\n", len);
-    int sent = client_sendall(c, buf, len);
-    free(buf);
-    return sent;
+    int full = client_full(c);
+    if (full != 0) {
+        return full;
+    }
+    return client_append(c, 0, 0, data, len);
 }
 
-static GiveDataMsg create_give_data_msg(const char text[]) {
-    size_t tlen = strlen(text);
-    GiveDataMsg m;
-    m.io = SLOT_INPUT;
-    m.n = 10;
-    m.data = malloc(m.n * sizeof(SlotData));
-    for (uint64_t i = 0; i < m.n; i++) {
-        m.data[i].len = tlen;
-        char* c = malloc(tlen);
-        strncpy(c, text, tlen);
-        m.data[i].buf = c;
+// Like client_produce, for producers only, tagging the record with the
+// hash of its key.  A partition ring refuses records keyed for another.
+int client_produce_keyed(Client* c, uint64_t key, const char* data,
+                         size_t len) {
+    if (c->type != ACTOR_PRODUCER) {
+        client_error("Only producers key records");
+        return -1;
+    }
+    int full = client_full(c);
+    if (full != 0) {
+        return full;
     }
-    return m;
+    return client_append(c, ITEM_FLAG_KEYED, key, data, len);
 }
 
-int client_give_data(Client* c) {
-    const char text[] = "hello world";
-    GiveDataMsg m = create_give_data_msg(text);
-    size_t blen = 0;
-    char* buf = serialize_give_data_msg(m, &blen);
-    give_data_msg_destroy(&m);
-    if (buf == NULL) {
+// Reads the MSG_REJECTs the server has sent a producer, without waiting,
+// and keeps the numbers of the refused records for client_rejected.
+// Returns CLIENT_REJECTED if any are kept, 0 if none, or -1 on error.
+static int client_read_rejects(Client* c) {
+    if (c->type != ACTOR_PRODUCER) {
+        return 0;
+    }
+    for (;;) {
+        size_t off = 0;
+        for (;;) {
+            uint64_t mlen = 0;
+            MessageType mtype = MSG_UNKNOWN;
+            size_t n = parse_message_header(&c->rbuf.buf[off],
+                                            c->rbuf.len - off, &mlen, &mtype);
+            if (n == 0) {
+                break;
+            }
+            if (mtype != MSG_REJECT || n + mlen > c->rbuf.max) {
+                client_error("Unexpected message from server");
+                return -1;
+            }
+            if (c->rbuf.len - off - n < mlen) {
+                break;
+            }
+            RejectMsg m;
+            if (parse_message_reject(&c->rbuf.buf[off + n], mlen, &m) == 0) {
+                client_error("Malformed MSG_REJECT");
+                return -1;
+            }
+            if (buffer_write(&c->rejects, (const char*)&m.item,
+                             sizeof(m.item)) < 0) {
+                return -1;
+            }
+            off += n + mlen;
+        }
+        buffer_strip(&c->rbuf, off);
+        ssize_t r = recv(c->client, &c->rbuf.buf[c->rbuf.len],
+                         c->rbuf.max - c->rbuf.len, 0);
+        if (r > 0) {
+            c->rbuf.len += (size_t)r;
+        } else if (r == 0) {
+            client_error("Server closed the connection");
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            client_error("recv failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return (c->rejects.len > 0) ? CLIENT_REJECTED : 0;
+}
+
+// Closes a batch whose linger time has passed and sends what the socket
+// takes.  If anything is left unsent, waits up to timeout_ms for the socket
+// to drain.  Returns CLIENT_REJECTED if the server has refused records, see
+// client_rejected, or -1 on error.
+int client_poll(Client* c, int timeout_ms) {
+    uint64_t now = client_now_usec();
+    if (c->batching && now >= c->batch_deadline) {
+        client_close_batch(c);
+    }
+    if (client_send_pending(c) < 0) {
         return -1;
     }
-    int sent = client_sendall(c, buf, blen);
-    free(buf);
-    return sent;
+    if (c->wsent < client_sendable(c) && timeout_ms != 0) {
+        // A producer reads its rejects while it waits, so a server sending
+        // them never blocks on it
+        if (client_wait(c, c->type == ACTOR_PRODUCER, true, timeout_ms) < 0 ||
+            client_read_rejects(c) < 0 || client_send_pending(c) < 0) {
+            return -1;
+        }
+    } else if (now < c->rejects_due) {
+        // Polls come as often as records; looking for rejects once per
+        // linger period keeps a syscall off each
+        return (c->rejects.len > 0) ? CLIENT_REJECTED : 0;
+    }
+    c->rejects_due = now + c->opts.linger_usec;
+    return client_read_rejects(c);
+}
+
+// Closes any open batch and blocks until everything queued has been sent.
+// Returns as client_poll does.
+int client_flush(Client* c) {
+    client_close_batch(c);
+    for (;;) {
+        if (client_send_pending(c) < 0 || client_read_rejects(c) < 0) {
+            return -1;
+        }
+        if (c->wbuf.len == 0) {
+            return client_read_rejects(c);
+        }
+        if (client_wait(c, c->type == ACTOR_PRODUCER, true, -1) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Returns 1 with the number of a record the server refused, counting the
+// records queued on c from 0, or 0 once every refusal has been returned.
+// A refused record was skipped and the rest are unaffected; it is refused
+// when the ring's byte budget is spent and the server runs with -x.
+int client_rejected(Client* c, uint64_t* record) {
+    if (c->rejects.len < sizeof(*record)) {
+        return 0;
+    }
+    memcpy(record, c->rejects.buf, sizeof(*record));
+    buffer_strip(&c->rejects, sizeof(*record));
+    return 1;
 }
 
-int client_get_data(Client* c) {
-    return -1;
+// Queues a GET_DATA request.  Replies arrive in order through client_next.
+int client_request(Client* c, SlotDestination io, GetDataMaxType max_type,
+                   uint64_t max) {
+    client_close_batch(c);
+    size_t start = buffer_begin_message(&c->wbuf, MSG_GET_DATA);
+    buffer_write_uint8(&c->wbuf, io);
+    buffer_write_uint8(&c->wbuf, max_type);
+    buffer_write_uint64(&c->wbuf, max);
+    buffer_end_message(&c->wbuf, start);
+    c->inflight++;
+    return client_send_pending(c);
 }
 
-int client_produce(Client* c) {
+// Moves the MSG_STATS frame at off in rbuf to c->stats
+static int client_stash_stats(Client* c, size_t off, size_t hlen,
+                              uint64_t mlen) {
+    buffer_reset(&c->stats);
+    if (buffer_write(&c->stats, &c->rbuf.buf[off + hlen], mlen) < 0) {
+        return -1;
+    }
+    size_t end = off + hlen + mlen;
+    memmove(&c->rbuf.buf[off], &c->rbuf.buf[end], c->rbuf.len - end);
+    c->rbuf.len -= hlen + mlen;
+    c->have_stats = true;
+    return 0;
+}
+
+// Reads whatever the server has sent, waiting until the deadline (forever
+// if timeout_ms is negative) for something to arrive.  Returns 1 if bytes
+// were read, 0 on timeout, or -1 on error.
+static int client_read_more(Client* c, uint64_t deadline, int timeout_ms) {
     for (;;) {
-        printf("Sending some data to server\n");
-        client_give_data(c);
-        sleep(3);
+        // Keep our own frames moving so the server never blocks on us
+        if (client_send_pending(c) < 0) {
+            return -1;
+        }
+        ssize_t r = recv(c->client, &c->rbuf.buf[c->rbuf.len],
+                         c->rbuf.max - c->rbuf.len, 0);
+        if (r > 0) {
+            c->rbuf.len += (size_t)r;
+            return 1;
+        } else if (r == 0) {
+            client_error("Server closed the connection");
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_error("recv failed: %s", strerror(errno));
+            return -1;
+        }
+
+        int wait = -1;
+        if (timeout_ms >= 0) {
+            uint64_t now = client_now_usec();
+            if (now >= deadline) {
+                return 0;
+            }
+            wait = (int)((deadline - now + 999) / 1000);
+        }
+        bool pending = c->wsent < client_sendable(c);
+        if (client_wait(c, true, pending, wait) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Waits up to timeout_ms (forever if negative) for the reply to the oldest
+// outstanding request.  Returns 1 with batch filled in, 0 on timeout, or -1
+// on error.  The batch is valid until the next call to client_next.
+int client_next(Client* c, DataMsg* batch, int timeout_ms) {
+    if (c->rheld > 0) {
+        buffer_strip(&c->rbuf, c->rheld);
+        c->rheld = 0;
+    }
+    if (c->inflight == 0) {
+        client_error("No outstanding requests");
+        return -1;
+    }
+    uint64_t deadline = 0;
+    if (timeout_ms >= 0) {
+        deadline = client_now_usec() + (uint64_t)timeout_ms * 1000;
+    }
+    for (;;) {
+        uint64_t mlen = 0;
+        MessageType mtype = MSG_UNKNOWN;
+        size_t n = parse_message_header(c->rbuf.buf, c->rbuf.len, &mlen,
+                                        &mtype);
+        if (n > 0) {
+            if ((mtype != MSG_DATA && mtype != MSG_STATS) ||
+                mlen > MSGMAXLEN) {
+                client_error("Unexpected message from server");
+                return -1;
+            }
+            if (c->rbuf.len - n >= mlen) {
+                if (mtype == MSG_STATS) {
+                    // Kept for client_stats
+                    if (client_stash_stats(c, 0, n, mlen) < 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (parse_message_data(&c->rbuf.buf[n], mlen, batch) == 0) {
+                    client_error("Malformed MSG_DATA");
+                    return -1;
+                }
+                c->rheld = n + mlen;
+                c->inflight--;
+                return 1;
+            }
+            // Make room for the whole frame
+            while (c->rbuf.max < n + mlen) {
+                if (buffer_grow(&c->rbuf) < 0) {
+                    return -1;
+                }
+            }
+        }
+        int r = client_read_more(c, deadline, timeout_ms);
+        if (r <= 0) {
+            return r;
+        }
+    }
+}
+
+// Asks the server for every actor's metrics; see client_stats
+int client_request_stats(Client* c) {
+    client_close_batch(c);
+    size_t start = buffer_begin_message(&c->wbuf, MSG_STATS);
+    buffer_end_message(&c->wbuf, start);
+    return client_send_pending(c);
+}
+
+// Waits up to timeout_ms (forever if negative) for the reply to
+// client_request_stats, which may arrive behind pending GET_DATA replies.
+// Returns 1 with m filled in, valid until the next reply arrives, 0 on
+// timeout, or -1 on error.
+int client_stats(Client* c, StatsMsg* m, int timeout_ms) {
+    uint64_t deadline = 0;
+    if (timeout_ms >= 0) {
+        deadline = client_now_usec() + (uint64_t)timeout_ms * 1000;
+    }
+    for (;;) {
+        if (c->have_stats) {
+            c->have_stats = false;
+            if (parse_message_stats(c->stats.buf, c->stats.len, m) == 0) {
+                client_error("Malformed MSG_STATS");
+                return -1;
+            }
+            return 1;
+        }
+        // Look behind the data replies already read, leaving them in place
+        size_t off = c->rheld;
+        for (;;) {
+            uint64_t mlen = 0;
+            MessageType mtype = MSG_UNKNOWN;
+            size_t n = parse_message_header(&c->rbuf.buf[off],
+                                            c->rbuf.len - off, &mlen, &mtype);
+            if (n == 0 || mlen > MSGMAXLEN) {
+                break;
+            }
+            if (c->rbuf.len - off - n < mlen) {
+                while (c->rbuf.max < off + n + mlen) {
+                    if (buffer_grow(&c->rbuf) < 0) {
+                        return -1;
+                    }
+                }
+                break;
+            }
+            if (mtype == MSG_STATS) {
+                if (client_stash_stats(c, off, n, mlen) < 0) {
+                    return -1;
+                }
+                break;
+            }
+            off += n + mlen;
+        }
+        if (c->have_stats) {
+            continue;
+        }
+        if (c->rbuf.len == c->rbuf.max && buffer_grow(&c->rbuf) < 0) {
+            return -1;
+        }
+        int r = client_read_more(c, deadline, timeout_ms);
+        if (r <= 0) {
+            return r;
+        }
+    }
+}
+
+// Queues a COMMIT releasing every leased slot below slot
+int client_commit(Client* c, uint64_t slot) {
+    client_close_batch(c);
+    size_t start = buffer_begin_message(&c->wbuf, MSG_COMMIT);
+    buffer_write_uint64(&c->wbuf, slot);
+    buffer_end_message(&c->wbuf, start);
+    return client_send_pending(c);
+}
+
+// Sleeps a little longer each time a pass over the ring finds nothing, and
+// not at all once it finds something
+static void client_backoff(bool progress, unsigned* sleep_usec) {
+    if (progress) {
+        *sleep_usec = EMPTY_SLEEP_MIN_USEC;
+        return;
+    }
+    usleep(*sleep_usec);
+    if (*sleep_usec < EMPTY_SLEEP_MAX_USEC) {
+        *sleep_usec *= 2;
+    }
+}
+
+// Keeps fetch_depth requests in flight
+static int client_fill(Client* c, SlotDestination io) {
+    while (c->inflight < c->opts.fetch_depth) {
+        if (client_request(c, io, GDMAX_ELEMS, c->opts.fetch_max) < 0) {
+            return -1;
+        }
     }
     return 0;
 }
 
-int client_consume(Client* c) {
-    return -1;
+// Passes every item of batch to fn and commits the slots it leased,
+// setting *progress if it leased any.  Returns 1 to go on, 0 once fn has
+// stopped the loop, or -1 on error.
+static int client_consume_batch(Client* c, DataMsg* batch, ClientItemFn fn,
+                                void* arg, bool* progress) {
+    uint64_t slot = 0;
+    SlotData item;
+    while (data_msg_next(batch, &item, &slot)) {
+        if (fn(arg, slot, item.buf, item.len) < 0) {
+            client_commit(c, slot);
+            return (client_flush(c) < 0) ? -1 : 0;
+        }
+    }
+    // A filtered batch may lease slots without returning any of them
+    if (batch->end > batch->first) {
+        if (client_commit(c, batch->end) < 0) {
+            return -1;
+        }
+        *progress = true;
+    }
+    return 1;
 }
 
-int client_transform(Client* c) {
-    return -1;
+// Keeps fetch_depth requests in flight, passes every item to fn and commits
+// each batch once fn has seen all of it.  Returns 0 when fn stops the loop,
+// -1 on error.
+int client_consume(Client* c, SlotDestination io, ClientItemFn fn,
+                   void* arg) {
+    unsigned sleep_usec = EMPTY_SLEEP_MIN_USEC;
+    for (;;) {
+        if (client_fill(c, io) < 0) {
+            return -1;
+        }
+        DataMsg batch;
+        if (client_next(c, &batch, -1) < 0) {
+            return -1;
+        }
+        bool progress = false;
+        int ret = client_consume_batch(c, &batch, fn, arg, &progress);
+        if (ret <= 0) {
+            return ret;
+        }
+        client_backoff(progress, &sleep_usec);
+    }
+}
+
+// Writes fn's output for every item of batch, setting *progress if it held
+// any.  out is scratch space.  Returns 1 to go on, 0 once fn has stopped the
+// loop, or -1 on error.
+static int client_transform_batch(Client* c, DataMsg* batch,
+                                  ClientTransformFn fn, void* arg,
+                                  Buffer* out, bool* progress) {
+    SlotData item;
+    uint64_t slot = 0;
+    while (data_msg_next(batch, &item, &slot)) {
+        buffer_reset(out);
+        int result = fn(arg, item.buf, item.len, out);
+        if (result < 0) {
+            return (client_flush(c) < 0) ? -1 : 0;
+        }
+        uint64_t flags = 0;
+        if (result == TRANSFORM_SAME) {
+            flags = ITEM_FLAG_SAME;
+            buffer_reset(out);
+        } else if (result == TRANSFORM_PATCH) {
+            flags = ITEM_FLAG_PATCH;
+        }
+        // Output is appended even past max_pending; client_next keeps
+        // sending while it waits, which is what drains it
+        if (client_append(c, flags, 0, out->buf, out->len) < 0) {
+            return -1;
+        }
+    }
+    if (batch->n > 0) {
+        *progress = true;
+    }
+    return 1;
 }
 
+// Keeps fetch_depth input requests in flight and writes fn's output for
+// every item, in order.  Returns 0 when fn stops the loop, -1 on error.
+int client_transform(Client* c, ClientTransformFn fn, void* arg) {
+    Buffer out;
+    buffer_alloc(&out, 1024);
+    unsigned sleep_usec = EMPTY_SLEEP_MIN_USEC;
+    int ret = 0;
+    for (;;) {
+        if (client_fill(c, SLOT_INPUT) < 0) {
+            ret = -1;
+            break;
+        }
+        DataMsg batch;
+        if (client_next(c, &batch, -1) < 0) {
+            ret = -1;
+            break;
+        }
+        bool progress = false;
+        ret = client_transform_batch(c, &batch, fn, arg, &out, &progress);
+        if (ret <= 0) {
+            break;
+        }
+        client_backoff(progress, &sleep_usec);
+    }
+    buffer_free(&out);
+    return ret;
+}
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        printf("Usage: ./crater-client server_addr:port actor_type\n");
-        return 0;
+// Joins every partition of the stream called name as an actor of type, or
+// the ring called name itself if partitions is 0.  opts.ring is ignored.
+// Returns -1 on error, with nothing left open.
+int stream_connect(Stream* s, Addr addr, ActorType type, const char* name,
+                   size_t partitions, const ClientOptions* opts) {
+    memset(s, 0, sizeof(*s));
+    if (partitions > PARTITIONSMAX) {
+        client_error("Streams have at most %d partitions", PARTITIONSMAX);
+        return -1;
     }
-    ActorType actor_type = ACTOR_UNKNOWN;
-    switch (argv[2][0]) {
-    case 'p':
-        actor_type = ACTOR_PRODUCER;
-        break;
-    case 'c':
-        actor_type = ACTOR_CONSUMER;
-        break;
-    case 't':
-        actor_type = ACTOR_TRANSFORMER;
-        break;
-    default:
-        printf("Unknown actor type %c.  Options are p, c, t\n", argv[2][0]);
-        return 1;
-    }
-    printf("Client actor type is %d\n", actor_type);
-
-    const char* server = argv[1];
-    Addr addr;
-    if (addr_from_hostname(server, &addr) < 0) {
-        printf("Invalid server: %s\n", server);
-        return 1;
-    }
-
-    Client c;
-    c.type = actor_type;
-    if (client_connect(&c, addr) < 0) {
-        printf("Failed to connect to %s\n", server);
-        return 1;
-    }
-
-    sleep(2);
-
-    if (client_send_config(&c) < 0) {
-        printf("Failed to send config message to %s\n", server);
-        return 1;
+    size_t n = (partitions == 0) ? 1 : partitions;
+    s->parts = calloc(n, sizeof(*s->parts));
+    if (s->parts == NULL) {
+        return -1;
+    }
+    ClientOptions o;
+    if (opts == NULL) {
+        client_options_default(&o);
     } else {
-        printf("Sent configuration\n");
+        o = *opts;
     }
+    char ring[RINGNAMEMAX + 1];
+    for (s->n = 0; s->n < n; s->n++) {
+        o.ring = name;
+        if (partitions > 0) {
+            if (name == NULL || partition_name(ring, name, s->n) < 0) {
+                client_error("Partitions need a stream name of at most %d "
+                             "bytes", RINGNAMEMAX);
+                stream_close(s);
+                return -1;
+            }
+            o.ring = ring;
+        }
+        if (client_connect(&s->parts[s->n], addr, type, &o) < 0) {
+            client_close(&s->parts[s->n]);
+            stream_close(s);
+            return -1;
+        }
+    }
+    s->partitions = partitions;
+    return 0;
+}
+
+void stream_close(Stream* s) {
+    for (size_t i = 0; i < s->n; i++) {
+        client_close(&s->parts[i]);
+    }
+    free(s->parts);
+    s->parts = NULL;
+    s->n = 0;
+}
 
-    sleep(2);
+// Queues a record for the partition its key hash belongs to.  Records of
+// one key are read in the order they were produced.  Returns as
+// client_produce does.
+int stream_produce(Stream* s, uint64_t key, const char* data, size_t len) {
+    if (s->partitions == 0) {
+        return client_produce(&s->parts[0], data, len);
+    }
+    size_t i = key_partition(key, s->partitions);
+    return client_produce_keyed(&s->parts[i], key, data, len);
+}
+
+// Pushes every partition's finished batches out.  Waits up to timeout_ms
+// for each partition left with unsent bytes.  Returns CLIENT_REJECTED if
+// a partition has refused records, see stream_rejected, or -1 on error.
+int stream_poll(Stream* s, int timeout_ms) {
+    int ret = 0;
+    for (size_t i = 0; i < s->n; i++) {
+        int r = client_poll(&s->parts[i], 0);
+        if (r < 0) {
+            return -1;
+        }
+        ret = (r == CLIENT_REJECTED) ? r : ret;
+    }
+    for (size_t i = 0; i < s->n && timeout_ms != 0; i++) {
+        Client* c = &s->parts[i];
+        if (c->wsent < client_sendable(c)) {
+            int r = client_poll(c, timeout_ms);
+            if (r < 0) {
+                return -1;
+            }
+            ret = (r == CLIENT_REJECTED) ? r : ret;
+        }
+    }
+    return ret;
+}
 
+// Returns as stream_poll does
+int stream_flush(Stream* s) {
     int ret = 0;
-    switch (c.type) {
-    case ACTOR_PRODUCER:
-        ret = client_produce(&c);
-        break;
-    case ACTOR_TRANSFORMER:
-        ret = client_transform(&c);
-        break;
-    case ACTOR_CONSUMER:
-        ret = client_consume(&c);
-        break;
-    default:
-        assert(false);
-        return 1;
-    }
-
-    if (ret != 0) {
-        return 1;
+    for (size_t i = 0; i < s->n; i++) {
+        int r = client_flush(&s->parts[i]);
+        if (r < 0) {
+            return -1;
+        }
+        ret = (r == CLIENT_REJECTED) ? r : ret;
+    }
+    return ret;
+}
+
+// Returns 1 with a record a partition refused, numbered as client_rejected
+// numbers it among the records queued for that partition, or 0 once every
+// refusal has been returned
+int stream_rejected(Stream* s, size_t* partition, uint64_t* record) {
+    for (size_t i = 0; i < s->n; i++) {
+        if (client_rejected(&s->parts[i], record)) {
+            *partition = i;
+            return 1;
+        }
     }
     return 0;
 }
+
+typedef struct {
+    StreamItemFn fn;
+    void* arg;
+    size_t partition;
+} StreamItem;
+
+static int stream_item(void* arg, uint64_t slot, const char* data,
+                       size_t len) {
+    StreamItem* item = arg;
+    return item->fn(item->arg, item->partition, slot, data, len);
+}
+
+// Reads every partition in turn, passing each item to fn with its
+// partition.  Items of one partition arrive in order; partitions are
+// interleaved.  Returns 0 when fn stops the loop, -1 on error.
+int stream_consume(Stream* s, SlotDestination io, StreamItemFn fn,
+                   void* arg) {
+    // A lone ring is waited on; several are each looked at in turn
+    int wait_ms = (s->n == 1) ? -1 : 0;
+    unsigned sleep_usec = EMPTY_SLEEP_MIN_USEC;
+    for (;;) {
+        bool progress = false;
+        for (size_t i = 0; i < s->n; i++) {
+            Client* c = &s->parts[i];
+            if (client_fill(c, io) < 0) {
+                return -1;
+            }
+            DataMsg batch;
+            int ret = client_next(c, &batch, wait_ms);
+            if (ret <= 0) {
+                if (ret < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            StreamItem item = { .fn = fn, .arg = arg, .partition = i };
+            ret = client_consume_batch(c, &batch, stream_item, &item,
+                                       &progress);
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 0) {
+                // Commits to the other partitions may still be queued
+                return stream_flush(s);
+            }
+        }
+        client_backoff(progress, &sleep_usec);
+    }
+}
+
+// Transforms every partition in turn, as client_transform does.  Returns 0
+// when fn stops the loop, -1 on error.
+int stream_transform(Stream* s, ClientTransformFn fn, void* arg) {
+    Buffer out;
+    buffer_alloc(&out, 1024);
+    int wait_ms = (s->n == 1) ? -1 : 0;
+    unsigned sleep_usec = EMPTY_SLEEP_MIN_USEC;
+    int ret = 0;
+    for (;;) {
+        bool progress = false;
+        for (size_t i = 0; i < s->n; i++) {
+            Client* c = &s->parts[i];
+            if (client_fill(c, SLOT_INPUT) < 0) {
+                ret = -1;
+                goto done;
+            }
+            DataMsg batch;
+            ret = client_next(c, &batch, wait_ms);
+            if (ret < 0) {
+                goto done;
+            } else if (ret == 0) {
+                continue;
+            }
+            ret = client_transform_batch(c, &batch, fn, arg, &out, &progress);
+            if (ret <= 0) {
+                goto done;
+            }
+        }
+        client_backoff(progress, &sleep_usec);
+    }
+
+done:
+    if (ret == 0) {
+        ret = stream_flush(s);
+    }
+    buffer_free(&out);
+    return ret;
+}
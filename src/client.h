@@ -0,0 +1,140 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addr.h"
+#include "messages.h"
+
+// libcrater-client
+//
+// A Client is one actor connection.  After client_connect the socket is
+// non-blocking: producers append records with client_produce, which batches
+// them into GIVE_DATA frames, and client_poll pushes finished batches out.
+// Consumers and transformers pipeline GET_DATA requests with
+// client_request/client_next, or hand a callback to client_consume or
+// client_transform which run the whole loop.  Failures return -1 and are
+// explained on stderr.
+
+typedef struct {
+    // A producer batch is closed once it holds this many payload bytes...
+    size_t batch_bytes;
+    // ...or once its first record has waited this long
+    uint64_t linger_usec;
+    // client_produce refuses records while this many bytes are unsent
+    size_t max_pending;
+    // GET_DATA requests kept in flight by client_consume/client_transform
+    unsigned fetch_depth;
+    // Item limit of each of those requests
+    uint64_t fetch_max;
+    // Consumers only: the server skips items failing this filter.  The value
+    // is only read by client_connect.
+    Filter filter;
+    // Consumers only: where to start reading.  start_slot is only used with
+    // START_AT.
+    StartPosition start;
+    uint64_t start_slot;
+    // Ring to join, by name, or NULL for the server's first ring.  Only
+    // read by client_connect.
+    const char* ring;
+    // Consumers only: name the server saves the cursor under, so that a
+    // consumer joining later with the same name, after a restart or
+    // failover too, resumes there.  NULL for none: the consumer then
+    // starts at the oldest slot held.  Only read by client_connect.
+    const char* name;
+} ClientOptions;
+
+typedef struct {
+    int client;
+    ActorType type;
+    ClientOptions opts;
+    // Incoming frames; the last batch returned by client_next is at the front
+    Buffer rbuf;
+    size_t rheld;
+    // Outgoing frames.  Bytes below wsent have been sent.
+    Buffer wbuf;
+    size_t wsent;
+    // Open GIVE_DATA batch at the tail of wbuf, if any
+    bool batching;
+    size_t batch_start;
+    size_t batch_count_at;
+    uint64_t batch_n;
+    size_t batch_bytes;
+    uint64_t batch_deadline;
+    // GET_DATA requests sent but not yet answered
+    unsigned inflight;
+    // Last MSG_STATS reply, until client_stats returns it
+    Buffer stats;
+    bool have_stats;
+    // Producers only: numbers of the records the server refused, until
+    // client_rejected returns them, and when client_poll next looks for
+    // more
+    Buffer rejects;
+    uint64_t rejects_due;
+} Client;
+
+// A partitioned stream, joined as one Client per partition ring.  Producers
+// route each record to the partition of its key hash, so records of a key
+// keep their order while partitions are sequenced independently; consumers
+// and transformers read every partition.  To read one partition, join its
+// ring by name with a plain Client.
+typedef struct {
+    Client* parts;
+    size_t n;
+    // 0 if the stream is a single ring that is not partitioned
+    size_t partitions;
+} Stream;
+
+// Called for every consumed item.  Return < 0 to stop consuming.
+typedef int (*ClientItemFn)(void* arg, uint64_t slot, const char* data,
+                            size_t len);
+// Writes the output for one input item to out and returns a TransformResult,
+// so unchanged or lightly edited items need not be sent back in full.
+// Return < 0 to stop.
+typedef int (*ClientTransformFn)(void* arg, const char* data, size_t len,
+                                 Buffer* out);
+// Called for every item consumed from a stream, with its partition
+typedef int (*StreamItemFn)(void* arg, size_t partition, uint64_t slot,
+                            const char* data, size_t len);
+
+// client_poll and client_flush return this while records the server
+// refused are left for client_rejected to name
+#define CLIENT_REJECTED 2
+
+void client_options_default(ClientOptions* o);
+int client_connect(Client* c, Addr addr, ActorType type,
+                   const ClientOptions* opts);
+void client_close(Client* c);
+
+int client_produce(Client* c, const char* data, size_t len);
+int client_produce_keyed(Client* c, uint64_t key, const char* data,
+                         size_t len);
+int client_poll(Client* c, int timeout_ms);
+int client_flush(Client* c);
+int client_rejected(Client* c, uint64_t* record);
+
+int client_request(Client* c, SlotDestination io, GetDataMaxType max_type,
+                   uint64_t max);
+int client_next(Client* c, DataMsg* batch, int timeout_ms);
+int client_commit(Client* c, uint64_t slot);
+
+int client_request_stats(Client* c);
+int client_stats(Client* c, StatsMsg* m, int timeout_ms);
+
+int client_consume(Client* c, SlotDestination io, ClientItemFn fn, void* arg);
+int client_transform(Client* c, ClientTransformFn fn, void* arg);
+
+int stream_connect(Stream* s, Addr addr, ActorType type, const char* name,
+                   size_t partitions, const ClientOptions* opts);
+void stream_close(Stream* s);
+int stream_produce(Stream* s, uint64_t key, const char* data, size_t len);
+int stream_poll(Stream* s, int timeout_ms);
+int stream_flush(Stream* s);
+int stream_rejected(Stream* s, size_t* partition, uint64_t* record);
+int stream_consume(Stream* s, SlotDestination io, StreamItemFn fn,
+                   void* arg);
+int stream_transform(Stream* s, ClientTransformFn fn, void* arg);
+
+#endif /* CLIENT_H */
@@ -0,0 +1,285 @@
+#include <stdio.h>
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/select.h>
+
+#include "client.h"
+
+// Hash of a line's key, its first word
+static uint64_t line_key(const Buffer* line) {
+    size_t len = 0;
+    while (len < line->len && !isspace((unsigned char)line->buf[len])) {
+        len++;
+    }
+    return key_hash(line->buf, len);
+}
+
+// Reports the lines the server refused, which were skipped.  ret is what
+// stream_poll or stream_flush returned.
+static int report_rejects(Stream* s, int ret) {
+    size_t partition = 0;
+    uint64_t record = 0;
+    while (ret == CLIENT_REJECTED &&
+           stream_rejected(s, &partition, &record)) {
+        fprintf(stderr, "Line %llu of partition %zu refused: the ring's "
+                "byte budget is spent\n", (long long unsigned)record,
+                partition);
+    }
+    return (ret < 0) ? -1 : 0;
+}
+
+// Produces one record per line of stdin, keyed by its first word
+static int produce_lines(Stream* s) {
+    Buffer line;
+    buffer_alloc(&line, 1024);
+    char buf[4096];
+    int ret = 0;
+    for (;;) {
+        // Wake up at least once per linger period so batches go out even
+        // while stdin is idle
+        fd_set readset;
+        FD_ZERO(&readset);
+        FD_SET(STDIN_FILENO, &readset);
+        struct timeval tv = {
+            .tv_sec = 0,
+            .tv_usec = (suseconds_t)s->parts[0].opts.linger_usec
+        };
+        if (select(STDIN_FILENO + 1, &readset, NULL, NULL, &tv) < 0) {
+            perror("select failed: ");
+            ret = -1;
+            break;
+        }
+        if (!FD_ISSET(STDIN_FILENO, &readset)) {
+            if (report_rejects(s, stream_poll(s, 0)) < 0) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n <= 0) {
+            if (line.len > 0) {
+                ret = stream_produce(s, line_key(&line), line.buf, line.len);
+            }
+            break;
+        }
+        for (ssize_t i = 0; i < n && ret >= 0; i++) {
+            if (buf[i] != '\n') {
+                buffer_write(&line, &buf[i], 1);
+                continue;
+            }
+            while ((ret = stream_produce(s, line_key(&line), line.buf,
+                                         line.len)) == 1) {
+                if (report_rejects(s, stream_poll(s, -1)) < 0) {
+                    ret = -1;
+                }
+            }
+            buffer_reset(&line);
+        }
+        if (ret < 0 || report_rejects(s, stream_poll(s, 0)) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    buffer_free(&line);
+    if (ret < 0) {
+        return ret;
+    }
+    return report_rejects(s, stream_flush(s));
+}
+
+static volatile sig_atomic_t stats_requested = 0;
+
+static void on_sigusr1(int sig) {
+    stats_requested = 1;
+}
+
+// Prints the server's per-actor metrics to stderr
+static int print_stats(Client* c) {
+    StatsMsg m;
+    if (client_request_stats(c) < 0 || client_stats(c, &m, 1000) <= 0) {
+        return -1;
+    }
+    static const char* names[] = { "producer", "consumer", "transformer" };
+    fprintf(stderr, "produced %llu, reclaimed %llu\n",
+            (long long unsigned)m.produced, (long long unsigned)m.reclaimed);
+    ActorStats a;
+    while (stats_msg_next(&m, &a)) {
+        fprintf(stderr, "%s %llu: cursor %llu, lag %llu, %llu items, "
+                "%llu bytes, %llu requests, %llu empty, %llu stalls\n",
+                (a.type <= ACTOR_TRANSFORMER) ? names[a.type] : "unknown",
+                (long long unsigned)a.index, (long long unsigned)a.cursor,
+                (long long unsigned)a.lag, (long long unsigned)a.items,
+                (long long unsigned)a.bytes, (long long unsigned)a.requests,
+                (long long unsigned)a.empty_polls,
+                (long long unsigned)a.stalls);
+    }
+    return 0;
+}
+
+// Prints slot: item, or partition.slot: item for a partitioned stream
+static int print_item(void* arg, size_t partition, uint64_t slot,
+                      const char* data, size_t len) {
+    Stream* s = arg;
+    if (s->partitions > 0) {
+        printf("%zu.", partition);
+    }
+    printf("%llu: %.*s\n", (long long unsigned)slot, (int)len, data);
+    if (stats_requested) {
+        stats_requested = 0;
+        fflush(stdout);
+        return print_stats(&s->parts[partition]);
+    }
+    return 0;
+}
+
+// Sends back only the span between the first and last lower case letters
+static int upcase_item(void* arg, const char* data, size_t len, Buffer* out) {
+    size_t at = 0;
+    while (at < len && !islower((unsigned char)data[at])) {
+        at++;
+    }
+    if (at == len) {
+        return TRANSFORM_SAME;
+    }
+    size_t end = len;
+    while (!islower((unsigned char)data[end - 1])) {
+        end--;
+    }
+    if (buffer_write_patch(out, at, end - at, &data[at], end - at) < 0) {
+        return -1;
+    }
+    char* span = &out->buf[out->len - (end - at)];
+    for (size_t i = 0; i < end - at; i++) {
+        span[i] = (char)toupper((unsigned char)span[i]);
+    }
+    return TRANSFORM_PATCH;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("Usage: ./crater-client server_addr:port[/ring[:partitions]] "
+               "actor_type [prefix]\n");
+        printf("  ring: join the named ring instead of the server's first\n");
+        printf("  partitions: ring names a stream of this many partitions, "
+               "all of which are joined.  Producers route each line by "
+               "its first word.\n");
+        printf("  p: produce each line of stdin\n");
+        printf("  t: transform input to upper case\n");
+        printf("  c: print the transformer's output, optionally only the "
+               "items starting with prefix\n");
+        printf("  c@earliest, c@latest, c@slot: the same, starting from the "
+               "oldest slot held, the next slot produced or the given "
+               "slot\n");
+        printf("  c=name, c=name@...: the same, saving the cursor under name "
+               "so a consumer of that name resumes there\n");
+        printf("kill -USR1 a consumer to print the server's per-actor metrics "
+               "to stderr after its next item\n");
+        return 0;
+    }
+    ActorType actor_type = ACTOR_UNKNOWN;
+    switch (argv[2][0]) {
+    case 'p':
+        actor_type = ACTOR_PRODUCER;
+        break;
+    case 'c':
+        actor_type = ACTOR_CONSUMER;
+        break;
+    case 't':
+        actor_type = ACTOR_TRANSFORMER;
+        break;
+    default:
+        printf("Unknown actor type %c.  Options are p, c, t\n", argv[2][0]);
+        return 1;
+    }
+
+    char* server = argv[1];
+    ClientOptions opts;
+    client_options_default(&opts);
+    char* ring = strchr(server, '/');
+    size_t partitions = 0;
+    if (ring != NULL) {
+        *ring++ = '\0';
+        char* colon = strchr(ring, ':');
+        if (colon != NULL) {
+            *colon++ = '\0';
+            char* end = NULL;
+            partitions = (size_t)strtoull(colon, &end, 10);
+            if (end == colon || *end != '\0' || partitions == 0) {
+                printf("Invalid partitions: %s\n", colon);
+                return 1;
+            }
+        }
+    }
+    Addr addr;
+    if (addr_from_hostname(server, &addr) < 0) {
+        printf("Invalid server: %s\n", server);
+        return 1;
+    }
+
+    char* start = strchr(argv[2], '@');
+    if (start != NULL && actor_type == ACTOR_CONSUMER) {
+        *start++ = '\0';
+        if (strcmp(start, "earliest") == 0) {
+            opts.start = START_EARLIEST;
+        } else if (strcmp(start, "latest") == 0) {
+            opts.start = START_LATEST;
+        } else {
+            char* end = NULL;
+            opts.start = START_AT;
+            opts.start_slot = strtoull(start, &end, 10);
+            if (end == start || *end != '\0') {
+                printf("Invalid start: %s\n", start);
+                return 1;
+            }
+        }
+    }
+    char* name = strchr(argv[2], '=');
+    if (name != NULL && actor_type == ACTOR_CONSUMER) {
+        opts.name = name + 1;
+    }
+    if (argc > 3 && actor_type == ACTOR_CONSUMER) {
+        opts.filter.op = FILTER_EQUAL;
+        opts.filter.len = strlen(argv[3]);
+        opts.filter.value = argv[3];
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    Stream s;
+    if (stream_connect(&s, addr, actor_type, ring, partitions, &opts) < 0) {
+        printf("Failed to connect to %s\n", server);
+        return 1;
+    }
+
+    int ret = 0;
+    switch (actor_type) {
+    case ACTOR_PRODUCER:
+        ret = produce_lines(&s);
+        break;
+    case ACTOR_TRANSFORMER:
+        ret = stream_transform(&s, upcase_item, NULL);
+        break;
+    case ACTOR_CONSUMER:
+        ret = stream_consume(&s, SLOT_OUTPUT, print_item, &s);
+        break;
+    default:
+        assert(false);
+        return 1;
+    }
+
+    stream_close(&s);
+    if (ret != 0) {
+        return 1;
+    }
+    return 0;
+}
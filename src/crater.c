@@ -1,77 +1,705 @@
 #include "crater.h"
+#include "filter.h"
+#include "journal.h"
+#include "latency.h"
+#include "log.h"
+#include "pool.h"
+#include "replica.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+
+// Number of busy polls, then yields, before a waiter falls back to sleeping
+#define WAIT_SPINS 100
+#define WAIT_YIELDS 100
+#define WAIT_SLEEP_USEC 100
+
+#define CACHELINE 64
+// Actors listed by the SIGUSR1 statistics
+#define CRATER_STATS_ACTORS 64
+// Consumers a started ring has places for, unless it started with more
+#define CRATER_MAX_CONSUMERS 64
 
 static void crater_config_init(CraterConfig* c, size_t n_consumers) {
     c->have_producer = false;
     c->have_transformer = false;
     c->have_consumers = 0;
     c->expect_consumers = n_consumers;
+    c->expect_journal = false;
     c->expect_transformer = true;
     c->expect_producer = true;
 }
 
-Crater* crater_alloc(uint64_t len, size_t n_contexts, size_t n_consumers) {
-    Crater* c = calloc(1, sizeof(*c));
-    c->buffer = calloc(len, sizeof(*c->buffer));
-    c->len = len;
-    contexts_alloc(&c->contexts, n_contexts);
-    actors_alloc(&c->consumers, n_consumers);
-    crater_config_init(&c->config, n_consumers);
+void crater_options_default(CraterOptions* o) {
+    o->name = "default";
+    o->partition = 0;
+    o->partitions = 0;
+    o->len = 100;
+    o->inline_max = 64;
+    o->budget_bytes = 0;
+    o->budget_policy = BUDGET_BLOCK;
+    o->item_max = MSGMAXLEN;
+    o->n_contexts = 1;
+    o->n_consumers = 0;
+    o->memory = (MemoryOptions) {
+        .pages = PAGES_DEFAULT, .prefault = false, .lock = false, .node = -1
+    };
+    memset(&o->placement, 0, sizeof(o->placement));
+    o->metrics_interval_usec = 0;
+    o->trace_every = 0;
+    o->max_lag = 0;
+    o->lag_grace_usec = 1000000;
+    o->lag_policy = LAG_BLOCK;
+    o->idle_timeout_usec = 0;
+}
+
+// Returns NULL if the slot array could not be mapped as requested
+Crater* crater_alloc(const CraterOptions* o) {
+    if (o->inline_max > INLINE_MAX_LIMIT) {
+        LOG_ERROR("Inline payloads are limited to %d bytes", INLINE_MAX_LIMIT);
+        return NULL;
+    }
+    if (o->name[0] == '\0' || strlen(o->name) > RINGNAMEMAX) {
+        LOG_ERROR("Ring names are 1 to %d bytes", RINGNAMEMAX);
+        return NULL;
+    }
+    // The producer is never more than a ring ahead of the slowest consumer
+    if (o->lag_policy != LAG_BLOCK && o->max_lag >= o->len) {
+        LOG_ERROR("Ring %s: the lag limit must be below its %llu slots",
+                  o->name, (long long unsigned)o->len);
+        return NULL;
+    }
+    // Actors embedded in the crater keep their metrics on their own cache
+    // lines
+    Crater* c = NULL;
+    if (posix_memalign((void**)&c, CACHELINE, sizeof(*c)) != 0) {
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, o->name);
+    c->partition = o->partition;
+    c->partitions = o->partitions;
+    // Slots with inline storage are cache line aligned, so the producer
+    // filling one slot does not share a line with readers of its neighbour
+    c->inline_max = o->inline_max;
+    c->entry_size = sizeof(Entry) + 2 * o->inline_max;
+    if (o->inline_max > 0) {
+        c->entry_size = (c->entry_size + CACHELINE - 1) / CACHELINE *
+            CACHELINE;
+    }
+    // The slot array is scanned by every actor and the vacuum, so it gets
+    // its own mapping where huge pages keep it to a few TLB entries
+    if (memory_map(&c->mapping, o->len * c->entry_size, o->memory) < 0) {
+        free(c);
+        return NULL;
+    }
+    c->slots = c->mapping.addr;
+    c->len = o->len;
+    c->budget_bytes = o->budget_bytes;
+    c->budget_policy = o->budget_policy;
+    c->item_max = o->item_max;
+    // A larger item could never be admitted, and a producer blocked on it
+    // would wait forever
+    if (c->budget_bytes > 0 && c->item_max > c->budget_bytes) {
+        c->item_max = c->budget_bytes;
+    }
+    c->placement = o->placement;
+    c->max_lag = o->max_lag;
+    c->lag_grace_usec = o->lag_grace_usec;
+    c->lag_policy = o->lag_policy;
+    c->idle_timeout_usec = o->idle_timeout_usec;
+    c->trace_every = o->trace_every;
+    if (c->trace_every > 0) {
+        c->stamps = calloc(c->len, sizeof(*c->stamps));
+        if (c->stamps == NULL) {
+            memory_unmap(&c->mapping);
+            free(c);
+            return NULL;
+        }
+    }
+    metrics_dump_init(&c->dump, o->metrics_interval_usec);
+    actor_init(&c->vacuum);
+    actor_init(&c->producer);
+    actor_init(&c->transformer);
+    actor_init(&c->journaler);
+    actor_init(&c->replicator);
+    contexts_alloc(&c->contexts, o->n_contexts);
+    actors_alloc(&c->consumers, o->n_consumers);
+    crater_config_init(&c->config, o->n_consumers);
     return c;
 }
 
+static Entry* crater_entry(Crater* c, uint64_t pos) {
+    return (Entry*)&c->slots[(pos % c->len) * c->entry_size];
+}
+
+static char* entry_inline_input(Crater* c, Entry* e) {
+    return (char*)(e + 1);
+}
+
+static char* entry_inline_output(Crater* c, Entry* e) {
+    return (char*)(e + 1) + c->inline_max;
+}
+
+static void crater_account(Crater* c, uint64_t add, uint64_t sub) {
+    if (add > 0) {
+        uint64_t n = __atomic_add_fetch(&c->bytes, add, __ATOMIC_RELAXED);
+        // Racy between writers, which only costs peak accuracy
+        if (n > c->bytes_peak) {
+            c->bytes_peak = n;
+        }
+    }
+    if (sub > 0) {
+        __atomic_sub_fetch(&c->bytes, sub, __ATOMIC_RELAXED);
+    }
+}
+
+// Frees the payloads of e that live outside it and clears it
+static void crater_entry_clear(Crater* c, Entry* e) {
+    uint64_t freed = 0;
+    if (e->input.buf != entry_inline_input(c, e)) {
+        freed += e->input.len;
+        pool_free(e->input.buf);
+    }
+    if (e->output_kind != ITEM_SAME &&
+        e->output.buf != entry_inline_output(c, e)) {
+        freed += e->output.len;
+        pool_free(e->output.buf);
+    }
+    crater_account(c, 0, freed);
+    e->input = (Buffer) { .buf = NULL, .len = 0, .max = 0 };
+    e->output = (Buffer) { .buf = NULL, .len = 0, .max = 0 };
+    e->output_kind = ITEM_DATA;
+}
+
 void crater_destroy(Crater* c) {
     contexts_destroy(&c->contexts);
     actor_groups_destroy(&c->groups);
     actors_destroy(&c->consumers);
     for (size_t i = 0; i < c->len; i++) {
-        free(c->buffer[i].input.buf);
-        free(c->buffer[i].output.buf);
+        crater_entry_clear(c, crater_entry(c, i));
     }
-    free(c->buffer);
+    memory_unmap(&c->mapping);
+    metrics_dump_destroy(&c->dump);
+    actor_destroy(&c->transformer);
+    free(c->stamps);
+    saved_cursors_free(&c->resume);
     free(c);
 }
 
 Buffer crater_get_input(Crater* c, uint64_t pos) {
-    return c->buffer[pos % c->len].input;
+    return crater_entry(c, pos)->input;
+}
+
+// Returns the output at pos as one contiguous buffer.  Patched output is
+// assembled in scratch, so the view is only valid until scratch is reused.
+Buffer crater_view_output(Crater* c, uint64_t pos, Buffer* scratch) {
+    Entry* e = crater_entry(c, pos);
+    if (e->output_kind != ITEM_PATCH) {
+        return e->output;
+    }
+    buffer_reset(scratch);
+    if (buffer_write(scratch, e->input.buf, e->patch_at) < 0 ||
+        buffer_write(scratch, e->output.buf, e->output.len) < 0 ||
+        buffer_write(scratch, &e->input.buf[e->patch_at + e->patch_cut],
+                     e->input.len - e->patch_at - e->patch_cut) < 0) {
+        // Out of memory; readers see an empty item rather than a torn one
+        buffer_reset(scratch);
+    }
+    return *scratch;
+}
+
+// Stores a payload in b, inline if it fits.  Ownership of data passes to
+// the ring either way.
+static void crater_store(Crater* c, Buffer* b, char* inline_buf, char* data,
+                         size_t len, size_t max) {
+    assert(b->buf == NULL);
+    if (len > 0 && len <= c->inline_max) {
+        memcpy(inline_buf, data, len);
+        // Freed by the writing thread, so the block goes straight back to
+        // its local cache for the next item
+        pool_free(data);
+        *b = (Buffer) { .buf = inline_buf, .len = len, .max = c->inline_max };
+    } else {
+        crater_account(c, len, 0);
+        *b = (Buffer) { .buf = data, .len = len, .max = max };
+    }
 }
 
-Buffer crater_get_output(Crater* c, uint64_t pos) {
-    return c->buffer[pos % c->len].output;
+// Copies a payload into b, inline if it fits
+static void crater_store_copy(Crater* c, Buffer* b, char* inline_buf,
+                              const char* data, size_t len) {
+    assert(b->buf == NULL);
+    char* dst = inline_buf;
+    size_t max = c->inline_max;
+    if (len == 0 || len > c->inline_max) {
+        dst = pool_alloc(len);
+        max = len;
+        crater_account(c, len, 0);
+    }
+    memcpy(dst, data, len);
+    *b = (Buffer) { .buf = dst, .len = len, .max = max };
 }
 
 void crater_set_input(Crater* c, uint64_t pos, char* data, size_t len,
                       size_t max) {
-    assert(c->buffer[pos % c->len].input.buf == NULL);
-    c->buffer[pos % c->len].input = (Buffer) {
-        .buf = data, .len = len, .max = max
-    };
+    Entry* e = crater_entry(c, pos);
+    crater_store(c, &e->input, entry_inline_input(c, e), data, len, max);
 }
 
 void crater_set_output(Crater* c, uint64_t pos, char* data, size_t len,
                        size_t max) {
-    assert(c->buffer[pos % c->len].output.buf == NULL);
-    c->buffer[pos % c->len].output = (Buffer) {
-        .buf = data, .len = len, .max = max
-    };
+    Entry* e = crater_entry(c, pos);
+    crater_store(c, &e->output, entry_inline_output(c, e), data, len, max);
+}
+
+// Publishes the input at pos unchanged as its output, without a copy
+void crater_set_output_same(Crater* c, uint64_t pos) {
+    Entry* e = crater_entry(c, pos);
+    assert(e->output.buf == NULL);
+    e->output = e->input;
+    e->output_kind = ITEM_SAME;
+}
+
+// Stores output for pos as a patch against its input.  patch is a body
+// written by buffer_write_patch; ownership passes to the ring on success.
+// Returns -1 if the patched range is outside the input.
+int crater_set_output_patch(Crater* c, uint64_t pos, char* patch, size_t len,
+                            size_t max) {
+    Entry* e = crater_entry(c, pos);
+    uint64_t at = 0;
+    uint64_t cut = 0;
+    if (len < PATCHPREFIX) {
+        return -1;
+    }
+    memcpy(&at, patch, sizeof(at));
+    memcpy(&cut, &patch[sizeof(at)], sizeof(cut));
+    if (at > e->input.len || cut > e->input.len - at) {
+        return -1;
+    }
+    len -= PATCHPREFIX;
+    memmove(patch, &patch[PATCHPREFIX], len);
+    crater_store(c, &e->output, entry_inline_output(c, e), patch, len, max);
+    e->patch_at = (uint32_t)at;
+    e->patch_cut = (uint32_t)cut;
+    e->output_kind = ITEM_PATCH;
+    return 0;
 }
 
 void crater_set_copy_input(Crater* c, uint64_t pos, const char* data,
                            size_t len) {
-    char* input = malloc(len);
-    memcpy(input, data, len);
-    crater_set_input(c, pos, input, len, len);
+    Entry* e = crater_entry(c, pos);
+    crater_store_copy(c, &e->input, entry_inline_input(c, e), data, len);
 }
 
 void crater_set_copy_output(Crater* c, uint64_t pos, const char* data,
                             size_t len) {
-    char* output = malloc(len);
-    memcpy(output, data, len);
-    crater_set_output(c, pos, output, len, len);
+    Entry* e = crater_entry(c, pos);
+    crater_store_copy(c, &e->output, entry_inline_output(c, e), data, len);
+}
+
+// Spin, then yield, then sleep.  Keeps hand-off latency low while the ring
+// is busy without burning a core when it is idle.
+void crater_backoff(unsigned* spins) {
+    if (*spins < WAIT_SPINS) {
+        (*spins)++;
+    } else if (*spins < WAIT_SPINS + WAIT_YIELDS) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        usleep(WAIT_SLEEP_USEC);
+    }
+}
+
+// Admits a producer item of len bytes against the byte budget.  Under
+// BUDGET_BLOCK, waits for the vacuum to free enough bytes; under
+// BUDGET_REJECT, returns -1 if there are not enough.  Items over the size
+// cap are always refused.
+int crater_admit(Crater* c, size_t len) {
+    if (len > c->item_max) {
+        __atomic_fetch_add(&c->budget_rejects, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // Inline items take no bytes outside the ring
+    if (c->budget_bytes == 0 || (len > 0 && len <= c->inline_max)) {
+        return 0;
+    }
+    if (crater_bytes(c) + len <= c->budget_bytes) {
+        return 0;
+    }
+    if (c->budget_policy == BUDGET_REJECT) {
+        __atomic_fetch_add(&c->budget_rejects, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_fetch_add(&c->budget_waits, 1, __ATOMIC_RELAXED);
+    unsigned spins = 0;
+    while (crater_bytes(c) + len > c->budget_bytes) {
+        crater_backoff(&spins);
+    }
+    return 0;
+}
+
+// Payload bytes currently held outside the slots
+uint64_t crater_bytes(Crater* c) {
+    return __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+}
+
+// Slots published in column io that consumer a has not committed
+uint64_t crater_lag(Crater* c, const Actor* a, SlotDestination io) {
+    uint64_t end = crater_published(c, io);
+    uint64_t slot = actor_slot(a);
+    return (end > slot) ? end - slot : 0;
+}
+
+void crater_stats_print(Crater* c, FILE* f) {
+    fprintf(f, "ring %s: %llu payload bytes (peak %llu, budget %llu), "
+            "%llu budget waits, %llu rejected, %llu evicted, "
+            "%llu detached\n", c->name,
+            (long long unsigned)crater_bytes(c),
+            (long long unsigned)c->bytes_peak,
+            (long long unsigned)c->budget_bytes,
+            (long long unsigned)__atomic_load_n(&c->budget_waits,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&c->budget_rejects,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&c->evictions,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&c->detaches,
+                                                __ATOMIC_RELAXED));
+}
+
+// Blocks until input slot pos has been reclaimed by the vacuum and may be
+// written by the producer
+void crater_wait_input(Crater* c, uint64_t pos) {
+    unsigned spins = 0;
+    while (pos >= actor_slot(&c->vacuum) + c->len) {
+        crater_backoff(&spins);
+    }
+}
+
+// Blocks until pos has been published in column io.  Returns the column's
+// cursor, so every slot in [pos, returned) may be read.
+uint64_t crater_wait(Crater* c, SlotDestination io, uint64_t pos) {
+    unsigned spins = 0;
+    uint64_t end = 0;
+    while ((end = crater_published(c, io)) <= pos) {
+        crater_backoff(&spins);
+    }
+    return end;
+}
+
+// Returns the cursor below which column io may be read.  Under synchronous
+// replication that is only what the standby has acknowledged.
+uint64_t crater_published(Crater* c, SlotDestination io) {
+    Actor* writer = (io == SLOT_OUTPUT) ? &c->transformer : &c->producer;
+    uint64_t end = actor_slot(writer);
+    if (c->replica != NULL) {
+        uint64_t acked = replica_visible(c->replica, io, end);
+        if (acked < end) {
+            end = acked;
+        }
+    }
+    return end;
+}
+
+// Blocks until the slot after a's cursor may be written in column io and
+// returns it.  Input slots must have been reclaimed by the vacuum; output
+// slots must hold published input.
+uint64_t crater_claim(Crater* c, Actor* a, SlotDestination io) {
+    uint64_t slot = a->slot;
+    if (io == SLOT_OUTPUT) {
+        if (crater_published(c, SLOT_INPUT) <= slot) {
+            ACTOR_METRIC_ADD(a, stalls, 1);
+        }
+        crater_wait(c, SLOT_INPUT, slot);
+    } else {
+        if (slot >= actor_slot(&c->vacuum) + c->len) {
+            ACTOR_METRIC_ADD(a, stalls, 1);
+        }
+        crater_wait_input(c, slot);
+    }
+    CRATER_PROBE(claim, slot, a, io);
+    return slot;
+}
+
+static ActorLatency* crater_actor_latency(Actor* a) {
+    if (a->latency == NULL) {
+        // Published for metrics_print_latency on the vacuum thread
+        __atomic_store_n(&a->latency, calloc(1, sizeof(ActorLatency)),
+                         __ATOMIC_RELEASE);
+    }
+    return a->latency;
+}
+
+static void crater_record(ActorLatency* l, LatencyStage s, uint64_t from,
+                          uint64_t now) {
+    if (from != 0 && now >= from) {
+        latency_record(&l->stage[s], now - from);
+    }
+}
+
+// Stamps traced slot pos as written to io by a, recording the transform
+// latency for output
+void crater_trace_write(Crater* c, Actor* a, SlotDestination io,
+                        uint64_t pos) {
+    SlotStamp* stamp = &c->stamps[pos % c->len];
+    uint64_t now = latency_now_ns();
+    if (io == SLOT_INPUT) {
+        stamp->input_ns = now;
+        return;
+    }
+    stamp->output_ns = now;
+    ActorLatency* l = crater_actor_latency(a);
+    if (l != NULL) {
+        crater_record(l, LATENCY_TRANSFORM, stamp->input_ns, now);
+    }
+}
+
+// Records the latency of consumer a reading traced slot pos from io
+void crater_trace_read(Crater* c, Actor* a, SlotDestination io,
+                       uint64_t pos) {
+    if (a->type != ACTOR_CONSUMER) {
+        return;
+    }
+    ActorLatency* l = crater_actor_latency(a);
+    if (l == NULL) {
+        return;
+    }
+    SlotStamp* stamp = &c->stamps[pos % c->len];
+    uint64_t now = latency_now_ns();
+    if (io == SLOT_OUTPUT) {
+        crater_record(l, LATENCY_DELIVER, stamp->output_ns, now);
+    }
+    crater_record(l, LATENCY_END_TO_END, stamp->input_ns, now);
+}
+
+// Moves a's cursor to end, publishing (or, for a consumer, releasing) every
+// slot below it
+void crater_publish(Actor* a, uint64_t end) {
+    CRATER_PROBE(publish, end, a, end - a->slot);
+    a->read = (a->read > end) ? a->read : end;
+    actor_set_slot(a, end);
+}
+
+// Whether a consumer holds back the vacuum.  A consumer asking to join is
+// attached here, by the only thread that reclaims, if its cursor is still
+// in the ring.  It may leave meanwhile, so the move is a swap.
+static bool crater_consumer_gates(Crater* c, Actor* a) {
+    switch (actor_attachment(a)) {
+    case ACTOR_ATTACHED:
+        return true;
+    case ACTOR_JOINING:
+        if (actor_slot(a) >= c->vacuum.slot) {
+            if (!actor_swap_attachment(a, ACTOR_JOINING, ACTOR_ATTACHED)) {
+                return false;
+            }
+            LOG_INFO("Consumer attached to ring %s at slot %llu", c->name,
+                     (long long unsigned)actor_slot(a));
+            return true;
+        }
+        actor_swap_attachment(a, ACTOR_JOINING, ACTOR_DETACHED);
+        return false;
+    default:
+        return false;
+    }
+}
+
+// Frees every slot that all followers have moved past.  Returns the number
+// of slots reclaimed.
+uint64_t crater_vacuum(Crater* c) {
+    uint64_t min = actor_slot(&c->producer);
+    if (c->replica != NULL && replica_live(c->replica)) {
+        uint64_t r = actor_slot(&c->replicator);
+        if (r < min) {
+            min = r;
+        }
+    }
+    if (c->config.expect_transformer) {
+        uint64_t t = actor_slot(&c->transformer);
+        if (t < min) {
+            min = t;
+        }
+    }
+    size_t n = actors_len(&c->consumers);
+    for (size_t i = 0; i < n; i++) {
+        Actor* a = c->consumers.i[i];
+        if (!crater_consumer_gates(c, a)) {
+            continue;
+        }
+        uint64_t s = actor_slot(a);
+        if (s < min) {
+            min = s;
+        }
+    }
+    if (c->config.expect_journal) {
+        uint64_t j = actor_slot(&c->journaler);
+        if (j < min) {
+            min = j;
+        }
+    }
+    return crater_reclaim(c, min);
+}
+
+// Frees every slot below end.  Only the vacuum, or a standby applying a
+// replication stream, may call this.  Returns the number of slots freed.
+uint64_t crater_reclaim(Crater* c, uint64_t end) {
+    uint64_t start = c->vacuum.slot;
+    for (uint64_t slot = start; slot < end; slot++) {
+        crater_entry_clear(c, crater_entry(c, slot));
+        if (crater_traced(c, slot)) {
+            c->stamps[slot % c->len] = (SlotStamp) { 0, 0 };
+        }
+    }
+    if (end > start) {
+        CRATER_PROBE(reclaim, end, &c->vacuum, end - start);
+        actor_set_slot(&c->vacuum, end);
+        return end - start;
+    }
+    return 0;
+}
+
+// Sets every cursor after the ring has been refilled from elsewhere (the
+// journal, or a primary this crater was standby to).  [base, in_end) must
+// hold input and [base, out_end) output.  Named consumers resume at their
+// saved cursors, and c takes ownership of them.  Cursors past the ring are
+// clamped to it; those below it are kept, and the consumer reads back from
+// the journal what has left the ring.
+void crater_resume(Crater* c, uint64_t base, uint64_t in_end,
+                   uint64_t out_end, SavedCursors* cursors) {
+    for (size_t i = 0; i < cursors->len; i++) {
+        if (cursors->i[i].slot > in_end) {
+            cursors->i[i].slot = in_end;
+        }
+    }
+    actor_set_slot(&c->vacuum, base);
+    c->producer.read = in_end;
+    actor_set_slot(&c->producer, in_end);
+    c->transformer.read = out_end;
+    actor_set_slot(&c->transformer, out_end);
+    saved_cursors_free(&c->resume);
+    c->resume = *cursors;
+    memset(cursors, 0, sizeof(*cursors));
+}
+
+// Calls save for every named consumer whose cursor has moved since the
+// last call with t, or that has taken its place since.  Does nothing until
+// the consumer list is stable.  Returns -1 if t can't grow or save fails;
+// cursors not yet saved are offered again on the next call, as are those
+// of places being renamed.
+int crater_save_cursors(Crater* c, CursorTracker* t, CursorSaveFn save,
+                        void* arg) {
+    if (!crater_consumers_stable(c)) {
+        return 0;
+    }
+    size_t n = actors_len(&c->consumers);
+    if (t->len < n) {
+        uint64_t* slots = realloc(t->slots, n * sizeof(*slots));
+        if (slots == NULL) {
+            return -1;
+        }
+        t->slots = slots;
+        uint32_t* seqs = realloc(t->seqs, n * sizeof(*seqs));
+        if (seqs == NULL) {
+            return -1;
+        }
+        t->seqs = seqs;
+        for (size_t i = t->len; i < n; i++) {
+            slots[i] = UINT64_MAX;
+            seqs[i] = UINT32_MAX;
+        }
+        t->len = n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char name[CONSUMERNAMEMAX + 1];
+        uint64_t slot = 0;
+        uint32_t seq = 0;
+        if (!actor_named_slot(c->consumers.i[i], name, &slot, &seq) ||
+            (slot == t->slots[i] && seq == t->seqs[i])) {
+            continue;
+        }
+        if (name[0] != '\0' && save(arg, name, slot) < 0) {
+            return -1;
+        }
+        t->slots[i] = slot;
+        t->seqs[i] = seq;
+    }
+    return 0;
+}
+
+void cursor_tracker_free(CursorTracker* t) {
+    free(t->slots);
+    free(t->seqs);
+    t->slots = NULL;
+    t->seqs = NULL;
+    t->len = 0;
+}
+
+SavedCursor* saved_cursors_find(SavedCursors* s, const char* name) {
+    for (size_t i = 0; i < s->len; i++) {
+        if (strcmp(s->i[i].name, name) == 0) {
+            return &s->i[i];
+        }
+    }
+    return NULL;
+}
+
+// Saves slot as the cursor of the consumer called name, replacing any
+// saved before.  Returns -1 if out of memory.
+int saved_cursors_set(SavedCursors* s, const char* name, uint64_t slot) {
+    SavedCursor* e = saved_cursors_find(s, name);
+    if (e == NULL) {
+        if (s->len == s->max) {
+            size_t max = (s->max == 0) ? 8 : s->max * 2;
+            SavedCursor* i = realloc(s->i, max * sizeof(*i));
+            if (i == NULL) {
+                return -1;
+            }
+            s->i = i;
+            s->max = max;
+        }
+        e = &s->i[s->len++];
+        memset(e->name, 0, sizeof(e->name));
+        strncpy(e->name, name, CONSUMERNAMEMAX);
+    }
+    e->slot = slot;
+    return 0;
+}
+
+// Writes the payload of a saved cursor record to out, which holds
+// SAVED_CURSOR_MAX bytes, and returns its length
+size_t saved_cursor_encode(char* out, const char* name, uint64_t slot) {
+    size_t len = strnlen(name, CONSUMERNAMEMAX);
+    memcpy(out, &slot, sizeof(slot));
+    memcpy(&out[sizeof(slot)], name, len);
+    return sizeof(slot) + len;
+}
+
+// Saves the cursor a record written by saved_cursor_encode holds.  Records
+// without a name, which journals older than consumer names hold, are
+// skipped.  Returns -1 if out of memory.
+int saved_cursors_add_record(SavedCursors* s, const char* data, size_t len) {
+    if (len <= sizeof(uint64_t) || len > SAVED_CURSOR_MAX) {
+        return 0;
+    }
+    char name[CONSUMERNAMEMAX + 1];
+    uint64_t slot = 0;
+    memcpy(&slot, data, sizeof(slot));
+    memcpy(name, &data[sizeof(slot)], len - sizeof(slot));
+    name[len - sizeof(slot)] = '\0';
+    return saved_cursors_set(s, name, slot);
+}
+
+void saved_cursors_free(SavedCursors* s) {
+    free(s->i);
+    s->i = NULL;
+    s->len = 0;
+    s->max = 0;
 }
 
 static int crater_config_ready(CraterConfig c) {
@@ -85,8 +713,131 @@ static int crater_config_ready(CraterConfig c) {
     return (have_producer && have_transformer && have_consumers);
 }
 
-// Returns 1 if crater is ready, 0 if not ready and -1 on invalid configuration
+bool crater_ready(Crater* c) {
+    return crater_config_ready(c->config);
+}
+
+// Lets the vacuum reclaim c, once every actor it expects has joined.  From
+// here on the vacuum walks the consumer list without a lock, so the list is
+// given room for the consumers still to join and never moves again.
+void crater_start(Crater* c) {
+    size_t n = actors_len(&c->consumers);
+    if (actors_reserve(&c->consumers, (n > CRATER_MAX_CONSUMERS) ? n :
+                       CRATER_MAX_CONSUMERS) < 0) {
+        LOG_WARN("No room for more consumers on ring %s", c->name);
+    }
+    __atomic_store_n(&c->started, true, __ATOMIC_RELEASE);
+}
+
+// Hands a consumer placed in the ring to the vacuum, which attaches it
+// unless its cursor is reclaimed first.  Returns whether it was attached.
+static bool crater_join(Actor* a) {
+    actor_set_attachment(a, ACTOR_JOINING);
+    unsigned spins = 0;
+    while (actor_attachment(a) == ACTOR_JOINING) {
+        crater_backoff(&spins);
+    }
+    return actor_attachment(a) == ACTOR_ATTACHED;
+}
+
+// Places a new consumer's cursors where it asked to start.  By default a
+// named consumer resumes where the last consumer of that name left off, in
+// this run or a recovered one, and any other starts at the oldest slot
+// still in the ring.  It never inherits the cursor of whichever consumer
+// held its place before.  A start below the ring
+// is read back from the journal, detached, from no earlier than its oldest
+// slot; without a journal it is moved up to the ring.
+static int crater_start_consumer(Crater* c, Context* ctx, size_t i,
+                                 ConfigureMessage m) {
+    Actor* a = ctx->actor;
+    uint64_t oldest = actor_slot(&c->vacuum);
+    uint64_t start = oldest;
+    SavedCursor* saved = (m.name == NULL) ? NULL :
+        saved_cursors_find(&c->resume, m.name);
+    if (saved != NULL) {
+        start = saved->slot;
+    }
+    switch (m.start) {
+    case START_EARLIEST:
+        start = (c->journal != NULL) ?
+            journal_first_slot(c->journal, oldest) : oldest;
+        break;
+    case START_LATEST:
+        start = actor_slot(&c->producer);
+        break;
+    case START_AT:
+        start = m.start_slot;
+        break;
+    default:
+        break;
+    }
+    if (start < oldest && c->journal != NULL) {
+        uint64_t first = journal_first_slot(c->journal, oldest);
+        if (start < first) {
+            LOG_INFO("Consumer %zu starts at %llu, the oldest slot "
+                     "journaled, not %llu", i, (long long unsigned)first,
+                     (long long unsigned)start);
+            start = first;
+        }
+    }
+    for (;;) {
+        if (start < oldest && c->journal == NULL) {
+            LOG_INFO("Consumer %zu starts at %llu, the oldest slot held, not "
+                     "%llu", i, (long long unsigned)oldest,
+                     (long long unsigned)start);
+            start = oldest;
+        }
+        actor_set_slot(a, start);
+        a->read = start;
+        if (start < oldest) {
+            ctx->history = malloc(sizeof(*ctx->history));
+            if (ctx->history == NULL) {
+                return -1;
+            }
+            journal_history_open(ctx->history, c->journal, SLOT_UNKNOWN,
+                                 start);
+            actor_set_attachment(a, ACTOR_DETACHED);
+            LOG_INFO("Consumer %zu starts at %llu, read back from the "
+                     "journal", i, (long long unsigned)start);
+            return 0;
+        }
+        if (!c->started) {
+            actor_set_attachment(a, ACTOR_ATTACHED);
+            return 0;
+        }
+        if (crater_join(a)) {
+            return 0;
+        }
+        // The vacuum reclaimed the start before it saw the consumer
+        oldest = actor_slot(&c->vacuum);
+    }
+}
+
+// Returns the index of a vacant consumer place, adding one if there is
+// none, or -1 if a started ring has no room for another
+static ssize_t crater_place_consumer(Crater* c) {
+    size_t n = actors_len(&c->consumers);
+    for (size_t i = 0; i < n; i++) {
+        if (actor_attachment(c->consumers.i[i]) == ACTOR_VACANT) {
+            return (ssize_t)i;
+        }
+    }
+    if (c->started && n == c->consumers.max) {
+        LOG_WARN("Ring %s has room for at most %zu consumers", c->name, n);
+        return -1;
+    }
+    return (actors_fetch(&c->consumers) != NULL) ? (ssize_t)n : -1;
+}
+
+// Returns 1 if crater is ready, 0 if not ready and -1 on invalid
+// configuration.  Once the ring has started, a producer or transformer may
+// only join in place of one that has left, and picks up at its cursor.
 int crater_add_context(Crater* c, Context* ctx, ConfigureMessage m) {
+    // Only consumers may skip items or save their cursors
+    if ((m.filter.op != FILTER_NONE || m.name != NULL) &&
+        m.actor_type != ACTOR_CONSUMER) {
+        return -1;
+    }
     switch (m.actor_type) {
     case ACTOR_PRODUCER:
         if (c->config.have_producer) {
@@ -100,18 +851,25 @@ int crater_add_context(Crater* c, Context* ctx, ConfigureMessage m) {
             return -1;
         }
         ctx->actor = &c->transformer;
+        // Slots leased to the transformer it replaces are leased again
+        ctx->actor->read = actor_slot(ctx->actor);
         c->config.have_transformer = true;
         break;
-    case ACTOR_CONSUMER:
-        ctx->actor = actors_fetch(&c->consumers);
-        if (ctx->actor == NULL) {
+    case ACTOR_CONSUMER: {
+        ssize_t i = crater_place_consumer(c);
+        if (i < 0) {
             return -1;
-        } else if (c->config.have_consumers >= c->config.expect_consumers) {
+        }
+        ctx->actor = c->consumers.i[i];
+        actor_rename_begin(ctx->actor, m.name);
+        int ret = crater_start_consumer(c, ctx, (size_t)i, m);
+        actor_rename_end(ctx->actor);
+        if (ret < 0) {
+            actor_set_attachment(ctx->actor, ACTOR_VACANT);
             return -1;
-        } else {
-            c->config.have_consumers++;
         }
-        break;
+        c->config.have_consumers++;
+    }; break;
     default:
         assert(false);
         return -1;
@@ -123,32 +881,188 @@ int crater_add_context(Crater* c, Context* ctx, ConfigureMessage m) {
     }
     ctx->actor->type = m.actor_type;
     ctx->crater = c;
+    // Not fatal: the thread just runs wherever the scheduler puts it
+    affinity_set_attr(&ctx->thread_attr, placement_for(&c->placement,
+                                                       m.actor_type));
+    filter_copy(&ctx->filter, &m.filter);
     return crater_config_ready(c->config);
 }
 
-// Can only be called immediately after crater_add_context, due to
-// contexts_pop and actors_unfetch implementations
-int crater_undo_add_context(Crater* c, ConfigureMessage m) {
-    if (contexts_pop(&c->contexts) == NULL) {
-        return -1;
-    }
-    switch (m.actor_type) {
+// Takes a context's actor out of the ring, freeing its place for another
+// to join.  Its thread must have stopped, or never started.
+void crater_remove_context(Crater* c, Context* ctx) {
+    contexts_remove(&c->contexts, ctx);
+    Actor* a = ctx->actor;
+    switch (a->type) {
     case ACTOR_PRODUCER:
         c->config.have_producer = false;
+        break;
     case ACTOR_TRANSFORMER:
         c->config.have_transformer = false;
+        break;
     case ACTOR_CONSUMER:
-        return actors_unfetch(&c->consumers);
+        c->config.have_consumers--;
+        // Whoever takes the place starts afresh, but a consumer joining
+        // under this one's name picks up where it left off
+        if (a->name[0] != '\0' &&
+            saved_cursors_set(&c->resume, a->name, actor_slot(a)) < 0) {
+            LOG_WARN("No room to save the cursor of consumer %s", a->name);
+        }
+        actor_set_attachment(a, ACTOR_VACANT);
+        break;
     default:
+        break;
+    }
+    LOG_INFO("%s left ring %s at slot %llu",
+             (a->type == ACTOR_PRODUCER) ? "Producer" :
+             (a->type == ACTOR_TRANSFORMER) ? "Transformer" : "Consumer",
+             c->name, (long long unsigned)actor_slot(a));
+}
+
+// Called by a context's thread as it exits.  A consumer stops holding back
+// the vacuum at once; the rest waits for the server to reap the context.
+void crater_leave(Context* ctx) {
+    if (ctx->actor != NULL && ctx->actor->type == ACTOR_CONSUMER) {
+        actor_set_attachment(ctx->actor, ACTOR_DETACHED);
+    }
+    __atomic_store_n(&ctx->done, true, __ATOMIC_RELEASE);
+}
+
+// Destroys the contexts whose threads have exited and removes their actors.
+// Only the thread adding contexts may call this.
+void crater_reap(Crater* c) {
+    size_t i = 0;
+    while (i < c->contexts.len) {
+        Context* ctx = c->contexts.contexts[i];
+        if (!__atomic_load_n(&ctx->done, __ATOMIC_ACQUIRE)) {
+            i++;
+            continue;
+        }
+        context_destroy(ctx);
+        crater_remove_context(c, ctx);
+        free(ctx);
+    }
+}
+
+static volatile sig_atomic_t stats_requested = 0;
+
+// Asks the vacuum thread to print statistics.  Async-signal-safe.
+void crater_request_stats(void) {
+    stats_requested = 1;
+}
+
+static void crater_stats_print_all(Crater* c, FILE* f) {
+    crater_stats_print(c, f);
+    ActorStats a[CRATER_STATS_ACTORS];
+    size_t n = metrics_collect(c, a, CRATER_STATS_ACTORS);
+    metrics_print(a, (n < CRATER_STATS_ACTORS) ? n : CRATER_STATS_ACTORS,
+                  NULL, f);
+    metrics_print_latency(c, f);
+    if (c->journal != NULL) {
+        journal_stats_print(c->journal, f);
+    }
+    if (c->replica != NULL) {
+        replica_stats_print(c->replica, f);
+    }
+}
+
+void craters_alloc(Craters* r, size_t start) {
+    memset(r, 0, sizeof(*r));
+    r->max = start;
+    r->i = calloc(start, sizeof(*r->i));
+}
+
+// Adds c to the set, which takes ownership of it.  Returns -1 if a ring of
+// that name is already served.
+int craters_add(Craters* r, Crater* c) {
+    if (craters_find(r, c->name) != NULL) {
+        LOG_ERROR("Ring %s is defined twice", c->name);
         return -1;
     }
+    if (r->len == r->max) {
+        size_t max = (r->max == 0) ? 1 : 2 * r->max;
+        Crater** i = realloc(r->i, max * sizeof(*i));
+        if (i == NULL) {
+            return -1;
+        }
+        r->i = i;
+        r->max = max;
+    }
+    r->i[r->len++] = c;
     return 0;
 }
 
-void crater_start(Crater* c) {
-    // Starts the vacuum thread
-    for (;;) {
-        // TODO -- check for dead threads (client closed)
-        sleep(1);
+// Returns the ring called name, the first ring if name is NULL, or NULL
+// if there is none
+Crater* craters_find(Craters* r, const char* name) {
+    if (name == NULL) {
+        return (r->len > 0) ? r->i[0] : NULL;
+    }
+    for (size_t i = 0; i < r->len; i++) {
+        if (strcmp(r->i[i]->name, name) == 0) {
+            return r->i[i];
+        }
+    }
+    return NULL;
+}
+
+// Vacuums every started ring, printing statistics when asked
+static void* craters_run(void* arg) {
+    Craters* r = arg;
+    unsigned spins = 0;
+    while (!__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+        bool stats = stats_requested;
+        if (stats) {
+            stats_requested = 0;
+        }
+        uint64_t freed = 0;
+        for (size_t i = 0; i < r->len; i++) {
+            Crater* c = r->i[i];
+            if (stats) {
+                crater_stats_print_all(c, stdout);
+            }
+            metrics_dump_poll(&c->dump, c, stdout);
+            if (crater_consumers_stable(c)) {
+                freed += crater_vacuum(c);
+            }
+        }
+        if (stats) {
+            pool_stats_print(stdout);
+            fflush(stdout);
+        }
+        if (freed > 0) {
+            spins = 0;
+        } else {
+            crater_backoff(&spins);
+        }
+    }
+    return NULL;
+}
+
+// Starts the thread that vacuums every ring, each once crater_start has
+// been called for it.  The thread runs on the caller's CPUs.  Returns -1
+// on error.
+int craters_start(Craters* r) {
+    int err = pthread_create(&r->vacuum, NULL, craters_run, r);
+    if (err != 0) {
+        LOG_ERROR("Failed to start the vacuum: %s", strerror(err));
+        return -1;
+    }
+    r->vacuuming = true;
+    return 0;
+}
+
+void craters_destroy(Craters* r) {
+    if (r->vacuuming) {
+        __atomic_store_n(&r->stopping, true, __ATOMIC_RELEASE);
+        pthread_join(r->vacuum, NULL);
+        r->vacuuming = false;
+    }
+    for (size_t i = 0; i < r->len; i++) {
+        crater_destroy(r->i[i]);
     }
+    free(r->i);
+    r->i = NULL;
+    r->len = 0;
+    r->max = 0;
 }
@@ -1,19 +1,43 @@
 #ifndef CRATER_H
 #define CRATER_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "actors.h"
+#include "affinity.h"
+#include "memory.h"
 #include "messages.h"
+#include "metrics.h"
 
-// Ring buffer element
+// Ring buffer element.  Slots are Crater.entry_size bytes apart: each Entry
+// is followed by inline_max bytes of input storage and inline_max bytes of
+// output storage, which hold payloads small enough to fit so that reading
+// them does not chase a pointer into the heap.
 typedef struct {
     Buffer input;
+    // For ITEM_SAME, aliases input.  For ITEM_PATCH, holds only the bytes
+    // replacing input[patch_at, patch_at + patch_cut).
     Buffer output;
+    uint32_t patch_at;
+    uint32_t patch_cut;
+    uint8_t output_kind;
 } Entry;
 
+// Monotonic nanoseconds at which a traced slot's input was published and
+// its output written, 0 if not stamped
 typedef struct {
+    uint64_t input_ns;
+    uint64_t output_ns;
+} SlotStamp;
+
+// Largest accepted inline payload size
+#define INLINE_MAX_LIMIT 4096
+
+typedef struct {
+    bool expect_journal;
     bool expect_transformer;
     bool expect_producer;
     size_t expect_consumers;
@@ -22,11 +46,112 @@ typedef struct {
     size_t have_consumers;
 } CraterConfig;
 
+typedef enum {
+    // Producers wait for the vacuum to free bytes
+    BUDGET_BLOCK,
+    // Items that would exceed the budget are refused
+    BUDGET_REJECT
+} BudgetPolicy;
+
+// What becomes of a consumer that has stayed more than max_lag slots behind
+// the writer of the column it reads for lag_grace_usec.  Each client's
+// context checks its own consumer between requests, and at least every tick
+// while the client is silent.
+typedef enum {
+    // The producer waits for it, however far behind
+    LAG_BLOCK,
+    // It is disconnected, and may join again
+    LAG_EVICT,
+    // It stops holding back the ring and reads from the journal until it
+    // is within max_lag again
+    LAG_DETACH
+} LagPolicy;
+
+typedef struct {
+    // Clients join the ring by this name
+    const char* name;
+    // Rings serving a partitioned stream are partition of partitions, and
+    // refuse items keyed for another partition.  partitions is 0 otherwise.
+    uint64_t partition;
+    uint64_t partitions;
+    // Ring slots
+    uint64_t len;
+    // Payloads up to this many bytes are stored inside their slot
+    size_t inline_max;
+    // Payload bytes the ring may hold outside its slots, 0 for no limit.
+    // Only producer input is admitted against it.
+    uint64_t budget_bytes;
+    BudgetPolicy budget_policy;
+    // Largest item accepted from a client
+    uint64_t item_max;
+    size_t n_contexts;
+    size_t n_consumers;
+    // Backing for the slot array
+    MemoryOptions memory;
+    // CPUs for context threads and the vacuum
+    Placement placement;
+    // How often the vacuum prints actor metrics, 0 for never
+    uint64_t metrics_interval_usec;
+    // Every slot divisible by this is stamped and its latency recorded, 0
+    // traces none
+    uint64_t trace_every;
+    // Consumers further behind than this for longer than the grace are
+    // dealt with by lag_policy
+    uint64_t max_lag;
+    uint64_t lag_grace_usec;
+    LagPolicy lag_policy;
+    // Consumers and transformers that send nothing for this long are
+    // disconnected, 0 for never.  Producers may be quiet.
+    uint64_t idle_timeout_usec;
+} CraterOptions;
+
+// Consumer cursors saved by name, for consumers joining later with the
+// same name
+typedef struct {
+    char name[CONSUMERNAMEMAX + 1];
+    uint64_t slot;
+} SavedCursor;
+
+typedef struct {
+    size_t len;
+    size_t max;
+    SavedCursor* i;
+} SavedCursors;
+
+// Largest payload of a saved cursor record: the cursor, then the name
+#define SAVED_CURSOR_MAX (sizeof(uint64_t) + CONSUMERNAMEMAX)
+
 // Core ring buffer
 typedef struct Crater {
+    char name[RINGNAMEMAX + 1];
+    uint64_t partition;
+    uint64_t partitions;
     CraterConfig config;
     uint64_t len;
-    Entry* buffer;
+    char* slots;
+    size_t entry_size;
+    size_t inline_max;
+    Mapping mapping;
+    // Payload bytes held outside the slots.  Added to by writers and
+    // subtracted from by the vacuum.
+    volatile uint64_t bytes;
+    uint64_t bytes_peak;
+    uint64_t budget_bytes;
+    BudgetPolicy budget_policy;
+    uint64_t item_max;
+    uint64_t budget_waits;
+    uint64_t budget_rejects;
+    uint64_t max_lag;
+    uint64_t lag_grace_usec;
+    LagPolicy lag_policy;
+    uint64_t idle_timeout_usec;
+    // Clients disconnected for lag or silence, and consumers detached for
+    // lag
+    uint64_t evictions;
+    uint64_t detaches;
+    // Stamps of traced slots, indexed like the slots, if tracing
+    uint64_t trace_every;
+    SlotStamp* stamps;
     Actor vacuum;
     // Producer writes to input and does not read
     Actor producer;
@@ -34,24 +159,128 @@ typedef struct Crater {
     Actor transformer;
     // Consumers read from either input or output
     Actors consumers;
+    // Every slot below the journaler's cursor is durable, if journaling
+    Actor journaler;
+    struct Journal* journal;
+    // Every slot below the replicator's cursor has been sent to (or, if
+    // synchronous, acknowledged by) the standby, if replicating
+    Actor replicator;
+    struct Replica* replica;
+    // Cursors of named consumers that have left, or that were restored
+    // from the journal or a primary.  Only the thread adding actors uses
+    // them.
+    SavedCursors resume;
+    // Set once every expected actor has joined and the vacuum runs.  After
+    // that, actors may join and leave at any time.
+    volatile bool started;
+    MetricsDump dump;
     ActorGroups groups;
     // Config
     Contexts contexts;
     size_t n_contexts;
+    Placement placement;
 } Crater;
 
-Crater* crater_alloc(uint64_t len, size_t n_contexts, size_t n_consumers);
+// Consumer cursors as a journal or replica last saved them, with the
+// name_seq of each place, so that it saves again only those that have
+// moved or changed hands
+typedef struct {
+    uint64_t* slots;
+    uint32_t* seqs;
+    size_t len;
+} CursorTracker;
+
+// Saves the cursor of the consumer called name.  Returns -1 on error.
+typedef int (*CursorSaveFn)(void* arg, const char* name, uint64_t slot);
+
+// Rings served by one process.  A client names the ring it joins in
+// MSG_CONFIGURE, or joins the first; one thread vacuums them all.
+typedef struct {
+    size_t len;
+    size_t max;
+    Crater** i;
+    pthread_t vacuum;
+    bool vacuuming;
+    volatile bool stopping;
+} Craters;
+
+void crater_options_default(CraterOptions* o);
+Crater* crater_alloc(const CraterOptions* o);
 void crater_destroy(Crater* c);
 Buffer crater_get_input(Crater* c, uint64_t pos);
-Buffer crater_get_output(Crater* c, uint64_t pos);
+Buffer crater_view_output(Crater* c, uint64_t pos, Buffer* scratch);
 void crater_set_input(Crater* c, uint64_t pos, char* data, size_t len, size_t max);
 void crater_set_output(Crater* c, uint64_t pos, char* data, size_t len, size_t max);
 void crater_set_copy_input(Crater* c, uint64_t pos, const char* data, size_t len);
 void crater_set_copy_output(Crater* c, uint64_t pos, const char* data, size_t len);
+void crater_set_output_same(Crater* c, uint64_t pos);
+int crater_set_output_patch(Crater* c, uint64_t pos, char* patch, size_t len, size_t max);
+
+int crater_admit(Crater* c, size_t len);
+uint64_t crater_lag(Crater* c, const Actor* a, SlotDestination io);
+uint64_t crater_bytes(Crater* c);
+void crater_stats_print(Crater* c, FILE* f);
+
+void crater_backoff(unsigned* spins);
+void crater_wait_input(Crater* c, uint64_t pos);
+uint64_t crater_vacuum(Crater* c);
+uint64_t crater_reclaim(Crater* c, uint64_t end);
+void crater_resume(Crater* c, uint64_t base, uint64_t in_end,
+                   uint64_t out_end, SavedCursors* cursors);
+int crater_save_cursors(Crater* c, CursorTracker* t, CursorSaveFn save,
+                        void* arg);
+void cursor_tracker_free(CursorTracker* t);
+
+int saved_cursors_set(SavedCursors* s, const char* name, uint64_t slot);
+SavedCursor* saved_cursors_find(SavedCursors* s, const char* name);
+size_t saved_cursor_encode(char* out, const char* name, uint64_t slot);
+int saved_cursors_add_record(SavedCursors* s, const char* data, size_t len);
+void saved_cursors_free(SavedCursors* s);
+
+// Embedded stage API.  Code running inside the server drives an Actor
+// through the ring directly, with no framing or syscalls:
+//   producer:    slot = crater_claim(c, a, SLOT_INPUT);
+//                crater_set_input(c, slot, ...); crater_publish(a, slot + 1);
+//   transformer: end = crater_wait(c, SLOT_INPUT, slot); read input;
+//                crater_set_output(c, slot, ...); crater_publish(a, slot + 1);
+//   consumer:    end = crater_wait(c, io, slot); read slots up to end;
+//                crater_publish(a, end);
+uint64_t crater_claim(Crater* c, Actor* a, SlotDestination io);
+void crater_trace_write(Crater* c, Actor* a, SlotDestination io,
+                        uint64_t pos);
+void crater_trace_read(Crater* c, Actor* a, SlotDestination io,
+                       uint64_t pos);
+uint64_t crater_wait(Crater* c, SlotDestination io, uint64_t pos);
+uint64_t crater_published(Crater* c, SlotDestination io);
+void crater_publish(Actor* a, uint64_t end);
 
 int crater_create_context(Crater* crater, int client);
-void crater_start(Crater* crater);
+void crater_request_stats(void);
+bool crater_ready(Crater* c);
+void crater_start(Crater* c);
 int crater_add_context(Crater* c, Context* ctx, ConfigureMessage m);
-int crater_undo_add_context(Crater* c, ConfigureMessage m);
+void crater_remove_context(Crater* c, Context* ctx);
+void crater_leave(Context* ctx);
+void crater_reap(Crater* c);
+
+void craters_alloc(Craters* r, size_t start);
+int craters_add(Craters* r, Crater* c);
+Crater* craters_find(Craters* r, const char* name);
+int craters_start(Craters* r);
+void craters_destroy(Craters* r);
+
+// Whether other threads may walk c's consumer list without a lock.  Until
+// the crater has started, the accept loop may still move the list as it
+// grows; crater_start reserves its final room.
+static inline bool crater_consumers_stable(const Crater* c) {
+    return __atomic_load_n(&c->started, __ATOMIC_ACQUIRE);
+}
+
+// Whether slot pos is traced.  Writers of a traced slot call
+// crater_trace_write before publishing it, and consumers call
+// crater_trace_read as they read it.
+static inline bool crater_traced(const Crater* c, uint64_t pos) {
+    return c->trace_every != 0 && pos % c->trace_every == 0;
+}
 
 #endif /* CRATER_H */
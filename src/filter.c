@@ -0,0 +1,47 @@
+// memmem is a GNU extension
+#define _GNU_SOURCE
+#include "filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Returns true if the item passes f.  The comparisons lean on libc's
+// memcmp and memmem, which are vectorized on the platforms we run on.
+bool filter_match(const Filter* f, const char* data, size_t len) {
+    if (f->op == FILTER_NONE) {
+        return true;
+    }
+    if (f->offset > len || len - f->offset < f->len) {
+        return false;
+    }
+    const char* field = &data[f->offset];
+    switch (f->op) {
+    case FILTER_EQUAL:
+        return memcmp(field, f->value, f->len) == 0;
+    case FILTER_NOT_EQUAL:
+        return memcmp(field, f->value, f->len) != 0;
+    case FILTER_LESS:
+        return memcmp(field, f->value, f->len) < 0;
+    case FILTER_GREATER:
+        return memcmp(field, f->value, f->len) > 0;
+    case FILTER_CONTAINS:
+        return memmem(field, len - f->offset, f->value, f->len) != NULL;
+    default:
+        return false;
+    }
+}
+
+void filter_copy(Filter* dst, const Filter* src) {
+    *dst = *src;
+    dst->value = NULL;
+    if (src->value != NULL) {
+        dst->value = malloc(src->len + 1);
+        memcpy(dst->value, src->value, src->len);
+    }
+}
+
+void filter_destroy(Filter* f) {
+    free(f->value);
+    f->value = NULL;
+    f->op = FILTER_NONE;
+}
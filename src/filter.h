@@ -0,0 +1,12 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "messages.h"
+
+bool filter_match(const Filter* f, const char* data, size_t len);
+void filter_copy(Filter* dst, const Filter* src);
+void filter_destroy(Filter* f);
+
+#endif /* FILTER_H */
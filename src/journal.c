@@ -0,0 +1,750 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crater.h"
+#include "log.h"
+#include "pool.h"
+
+#define JOURNAL_ALIGN 8
+#define JOURNAL_PATH_MAX 4096
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Checksum of a record's slot, length, column and payload
+uint32_t journal_crc(const JournalRecord* r, const char* data) {
+    pthread_once(&crc_once, crc_init);
+    uint32_t crc = 0xFFFFFFFF;
+    crc = crc_update(crc, &r->slot, sizeof(r->slot));
+    crc = crc_update(crc, &r->len, sizeof(r->len));
+    crc = crc_update(crc, &r->io, sizeof(r->io));
+    crc = crc_update(crc, data, r->len);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static uint64_t journal_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t journal_align(uint64_t n) {
+    return (n + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+}
+
+void journal_options_default(JournalOptions* o) {
+    o->dir = NULL;
+    o->segment_bytes = 64 * 1024 * 1024;
+    o->sync_usec = 1000;
+    o->max_segments = 0;
+}
+
+static void journal_segment_path(const Journal* j, uint64_t seq, char* path,
+                                 size_t len) {
+    snprintf(path, len, "%s/%020llu.journal", j->opts.dir,
+             (long long unsigned)seq);
+}
+
+// Makes everything appended to the current segment durable
+static int journal_sync(Journal* j) {
+    if (j->map == NULL || j->synced == j->off) {
+        return 0;
+    }
+    uint64_t start = j->synced & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+    uint64_t t = journal_now_usec();
+    if (msync(&j->map[start], j->off - start, MS_SYNC) < 0) {
+        LOG_ERROR("Journal msync failed: %s", strerror(errno));
+        return -1;
+    }
+    j->synced = j->off;
+    __atomic_store_n(&j->syncs, j->syncs + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->sync_usec_total,
+                     j->sync_usec_total + journal_now_usec() - t,
+                     __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void journal_close_segment(Journal* j) {
+    if (j->map == NULL) {
+        return;
+    }
+    journal_sync(j);
+    munmap(j->map, j->size);
+    close(j->fd);
+    j->map = NULL;
+    j->fd = -1;
+}
+
+static int journal_sync_dir(const char* dir) {
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open journal directory: %s", strerror(errno));
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret < 0) {
+        LOG_ERROR("Failed to sync journal directory: %s", strerror(errno));
+    }
+    close(fd);
+    return ret;
+}
+
+// Closes the current segment and starts the next, large enough for at least
+// min_size bytes of records.  Its header names the next input slot to be
+// journaled, whichever record fills the old segment: output and cursor
+// records are journaled between inputs.
+static int journal_open_segment(Journal* j, uint64_t min_size) {
+    journal_close_segment(j);
+    char path[JOURNAL_PATH_MAX];
+    uint64_t size = j->opts.segment_bytes;
+    if (size < sizeof(JournalSegmentHeader) + min_size) {
+        size = sizeof(JournalSegmentHeader) + min_size;
+    }
+    uint64_t seq = j->seq + 1;
+    journal_segment_path(j, seq, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create journal segment: %s", strerror(errno));
+        return -1;
+    }
+    // Reserve the blocks up front, so running out of disk is an error here
+    // rather than a SIGBUS on a later store through the mapping
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    if (err == EINVAL || err == EOPNOTSUPP) {
+        err = (ftruncate(fd, (off_t)size) < 0) ? errno : 0;
+    }
+    if (err != 0) {
+        LOG_ERROR("Failed to size journal segment: %s", strerror(err));
+        close(fd);
+        return -1;
+    }
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map journal segment: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    JournalSegmentHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_SEGMENT_MAGIC, sizeof(h.magic));
+    h.seq = seq;
+    h.first_slot = j->input;
+    h.size = size;
+    memcpy(map, &h, sizeof(h));
+    j->fd = fd;
+    j->map = map;
+    j->size = size;
+    j->off = sizeof(h);
+    j->synced = 0;
+    // History readers move on once the next segment exists
+    __atomic_store_n(&j->seq, seq, __ATOMIC_RELEASE);
+    if (journal_sync_dir(j->opts.dir) < 0) {
+        return -1;
+    }
+    if (j->opts.max_segments > 0 && j->seq > j->opts.max_segments) {
+        journal_segment_path(j, j->seq - j->opts.max_segments, path,
+                             sizeof(path));
+        if (unlink(path) < 0 && errno != ENOENT) {
+            LOG_ERROR("Failed to delete old journal segment: %s",
+                      strerror(errno));
+        }
+    }
+    return 0;
+}
+
+static int journal_append(Journal* j, uint8_t io, uint64_t slot, Buffer b) {
+    uint64_t need = sizeof(JournalRecord) + journal_align(b.len);
+    if (j->map == NULL || j->off + need > j->size) {
+        if (journal_open_segment(j, need) < 0) {
+            return -1;
+        }
+    }
+    JournalRecord r;
+    memset(&r, 0, sizeof(r));
+    r.magic = JOURNAL_RECORD_MAGIC;
+    r.len = (uint32_t)b.len;
+    r.slot = slot;
+    r.io = (uint8_t)io;
+    r.crc = journal_crc(&r, b.buf);
+    memcpy(&j->map[j->off + sizeof(r)], b.buf, b.len);
+    memcpy(&j->map[j->off], &r, sizeof(r));
+    j->off += need;
+    __atomic_store_n(&j->records, j->records + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->bytes, j->bytes + b.len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int journal_save_cursor(void* arg, const char* name, uint64_t slot) {
+    char payload[SAVED_CURSOR_MAX];
+    size_t len = saved_cursor_encode(payload, name, slot);
+    Buffer b = { .buf = payload, .len = len, .max = sizeof(payload) };
+    return journal_append((Journal*)arg, JOURNAL_IO_CURSOR, 0, b);
+}
+
+// Slot below which both columns are journaled
+static uint64_t journal_cursor(Journal* j) {
+    if (j->crater->config.expect_transformer && j->output < j->input) {
+        return j->output;
+    }
+    return j->input;
+}
+
+static void* journal_run(void* arg) {
+    Journal* j = (Journal*)arg;
+    Crater* c = j->crater;
+    pool_thread_attach();
+    buffer_alloc(&j->scratch, 1024);
+    uint64_t last_sync = journal_now_usec();
+    unsigned spins = 0;
+    for (;;) {
+        uint64_t in_end = actor_slot(&c->producer);
+        uint64_t out_end = actor_slot(&c->transformer);
+        // A standby restarting its ring at the primary's slots moves the
+        // vacuum past slots that will never be written
+        uint64_t base = actor_slot(&c->vacuum);
+        if (j->input < base) {
+            j->input = base;
+        }
+        if (j->output < base) {
+            j->output = base;
+        }
+        bool appended = false;
+        for (; j->input < in_end; j->input++) {
+            if (journal_append(j, SLOT_INPUT, j->input,
+                               crater_get_input(c, j->input)) < 0) {
+                goto fail;
+            }
+            appended = true;
+        }
+        if (c->config.expect_transformer) {
+            for (; j->output < out_end; j->output++) {
+                Buffer b = crater_view_output(c, j->output, &j->scratch);
+                if (journal_append(j, SLOT_OUTPUT, j->output, b) < 0) {
+                    goto fail;
+                }
+                appended = true;
+            }
+        }
+        uint64_t durable = journal_cursor(j);
+        uint64_t now = journal_now_usec();
+        if (now - last_sync >= j->opts.sync_usec) {
+            // Consumers that committed since the last sync are covered
+            // by the next one together with the slots
+            if (crater_save_cursors(c, &j->cursors, journal_save_cursor,
+                                    j) < 0) {
+                goto fail;
+            }
+        }
+        if (j->synced < j->off && now - last_sync >= j->opts.sync_usec) {
+            // One sync covers every record appended since the last
+            if (journal_sync(j) < 0) {
+                goto fail;
+            }
+            last_sync = now;
+            actor_set_slot(&c->journaler, durable);
+        }
+        if (appended) {
+            spins = 0;
+        } else {
+            crater_backoff(&spins);
+        }
+    }
+
+fail:
+    // The journaler's cursor stops, so the ring stalls rather than drop
+    // slots that were never made durable
+    LOG_INFO("Journal stopped at slot %llu",
+             (long long unsigned)actor_slot(&c->journaler));
+    buffer_free(&j->scratch);
+    cursor_tracker_free(&j->cursors);
+    pool_thread_detach();
+    return NULL;
+}
+
+static int journal_reader_open(JournalReader* r, const char* path) {
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        LOG_ERROR("Failed to open journal segment: %s", strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(r->fd, &st) < 0 ||
+        (uint64_t)st.st_size < sizeof(JournalSegmentHeader)) {
+        LOG_ERROR("Journal segment %s is truncated", path);
+        close(r->fd);
+        return -1;
+    }
+    r->size = (uint64_t)st.st_size;
+    void* map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map journal segment: %s", strerror(errno));
+        close(r->fd);
+        return -1;
+    }
+    r->map = map;
+    r->off = sizeof(JournalSegmentHeader);
+    if (memcmp(r->map, JOURNAL_SEGMENT_MAGIC,
+               strlen(JOURNAL_SEGMENT_MAGIC)) != 0) {
+        LOG_ERROR("%s is not a journal segment", path);
+        munmap(map, r->size);
+        close(r->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void journal_reader_close(JournalReader* r) {
+    munmap((void*)r->map, r->size);
+    close(r->fd);
+}
+
+// Moves to the next record.  Returns 0 at the end of the segment, which is
+// also where a torn or corrupt record ends it.
+static int journal_reader_next(JournalReader* r, JournalRecord* rec,
+                               const char** data) {
+    if (r->off + sizeof(*rec) > r->size) {
+        return 0;
+    }
+    memcpy(rec, &r->map[r->off], sizeof(*rec));
+    if (rec->magic != JOURNAL_RECORD_MAGIC ||
+        rec->len > r->size - r->off - sizeof(*rec)) {
+        return 0;
+    }
+    *data = &r->map[r->off + sizeof(*rec)];
+    if (journal_crc(rec, *data) != rec->crc) {
+        return 0;
+    }
+    r->off += sizeof(*rec) + journal_align(rec->len);
+    return 1;
+}
+
+static int seq_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Lists the segment sequence numbers in dir, oldest first.  Returns the
+// count, or -1 on error.
+static ssize_t journal_list(const char* dir, uint64_t** seqs) {
+    *seqs = NULL;
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    size_t n = 0;
+    size_t max = 0;
+    struct dirent* e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        char* end = NULL;
+        unsigned long long seq = strtoull(e->d_name, &end, 10);
+        if (end == e->d_name || strcmp(end, ".journal") != 0) {
+            continue;
+        }
+        if (n == max) {
+            max = (max == 0) ? 16 : max * 2;
+            uint64_t* s = realloc(*seqs, max * sizeof(*s));
+            if (s == NULL) {
+                closedir(d);
+                free(*seqs);
+                *seqs = NULL;
+                return -1;
+            }
+            *seqs = s;
+        }
+        (*seqs)[n++] = seq;
+    }
+    closedir(d);
+    qsort(*seqs, n, sizeof(**seqs), seq_compare);
+    return (ssize_t)n;
+}
+
+// What a scan of the journal found
+typedef struct {
+    uint64_t in_min;
+    uint64_t in_end;
+    uint64_t out_end;
+    uint64_t records;
+    SavedCursors cursors;
+    // Highest slot in each segment
+    uint64_t* seg_max;
+} JournalScan;
+
+// Rebuilds the ring's tail from the journal in dir and restores the cursors
+// of every actor, so they resume where the last run left off.  A missing
+// or empty journal leaves c untouched.  Returns -1 on error.
+int journal_recover(Crater* c, const char* dir) {
+    uint64_t t0 = journal_now_usec();
+    uint64_t* seqs = NULL;
+    ssize_t n = journal_list(dir, &seqs);
+    if (n <= 0) {
+        return (int)n;
+    }
+    char path[JOURNAL_PATH_MAX];
+    JournalScan s;
+    memset(&s, 0, sizeof(s));
+    s.in_min = UINT64_MAX;
+    s.seg_max = calloc((size_t)n, sizeof(*s.seg_max));
+    int ret = -1;
+    if (s.seg_max == NULL) {
+        goto done;
+    }
+
+    // First pass: find the extent of each column and the last cursors
+    for (ssize_t i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%020llu.journal", dir,
+                 (long long unsigned)seqs[i]);
+        JournalReader r;
+        if (journal_reader_open(&r, path) < 0) {
+            goto done;
+        }
+        JournalRecord rec;
+        const char* data = NULL;
+        while (journal_reader_next(&r, &rec, &data)) {
+            s.records++;
+            switch (rec.io) {
+            case SLOT_INPUT:
+                s.in_min = (rec.slot < s.in_min) ? rec.slot : s.in_min;
+                s.in_end = (rec.slot + 1 > s.in_end) ? rec.slot + 1 : s.in_end;
+                break;
+            case SLOT_OUTPUT:
+                s.out_end = (rec.slot + 1 > s.out_end) ?
+                    rec.slot + 1 : s.out_end;
+                break;
+            case JOURNAL_IO_CURSOR:
+                if (saved_cursors_add_record(&s.cursors, data,
+                                             rec.len) < 0) {
+                    journal_reader_close(&r);
+                    goto done;
+                }
+                continue;
+            default:
+                continue;
+            }
+            if (rec.slot > s.seg_max[i]) {
+                s.seg_max[i] = rec.slot;
+            }
+        }
+        journal_reader_close(&r);
+    }
+    if (s.in_end == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    // The ring holds the newest len slots.  Untransformed input must stay
+    // in it, as must everything a consumer has yet to commit, so those are
+    // only dropped when the ring is too short for them.
+    uint64_t in_end = s.in_end;
+    uint64_t base = (in_end > c->len) ? in_end - c->len : 0;
+    if (base < s.in_min) {
+        base = s.in_min;
+    }
+    uint64_t out_end = c->config.expect_transformer ? s.out_end : in_end;
+    if (out_end > in_end) {
+        out_end = in_end;
+    }
+    if (out_end < base) {
+        LOG_WARN("Recovery: slots %llu to %llu were never transformed and no "
+                 "longer fit the ring; skipping them",
+                 (long long unsigned)out_end, (long long unsigned)base);
+        out_end = base;
+    }
+    // Second pass: load the tail into the ring
+    Buffer scratch;
+    buffer_alloc(&scratch, 64);
+    uint64_t loaded = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        if (s.seg_max[i] < base) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%020llu.journal", dir,
+                 (long long unsigned)seqs[i]);
+        JournalReader r;
+        if (journal_reader_open(&r, path) < 0) {
+            buffer_free(&scratch);
+            goto done;
+        }
+        JournalRecord rec;
+        const char* data = NULL;
+        while (journal_reader_next(&r, &rec, &data)) {
+            if (rec.slot < base) {
+                continue;
+            }
+            // A slot journaled twice keeps its first copy
+            if (rec.io == SLOT_INPUT && rec.slot < in_end &&
+                crater_get_input(c, rec.slot).buf == NULL) {
+                crater_set_copy_input(c, rec.slot, data, rec.len);
+                loaded++;
+            } else if (rec.io == SLOT_OUTPUT && rec.slot < out_end &&
+                       crater_view_output(c, rec.slot, &scratch).buf ==
+                       NULL) {
+                crater_set_copy_output(c, rec.slot, data, rec.len);
+            }
+        }
+        journal_reader_close(&r);
+    }
+    buffer_free(&scratch);
+
+    crater_resume(c, base, in_end, out_end, &s.cursors);
+    LOG_INFO("Recovered slots %llu to %llu (%llu loaded, transformed up to "
+             "%llu) and %zu consumer cursors from %zd segments, %llu records, "
+             "in %llu ms",
+             (long long unsigned)base, (long long unsigned)in_end,
+             (long long unsigned)loaded, (long long unsigned)out_end,
+             c->resume.len, n, (long long unsigned)s.records,
+             (long long unsigned)((journal_now_usec() - t0) / 1000));
+    ret = 0;
+
+done:
+    saved_cursors_free(&s.cursors);
+    free(s.seg_max);
+    free(seqs);
+    return ret;
+}
+
+// Starts journaling c into o->dir.  Must be called before any slot is
+// published.  Returns NULL on failure.
+Journal* journal_start(Crater* c, const JournalOptions* o) {
+    if (mkdir(o->dir, 0755) < 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create journal directory: %s", strerror(errno));
+        return NULL;
+    }
+    Journal* j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        return NULL;
+    }
+    j->opts = *o;
+    j->crater = c;
+    j->fd = -1;
+    // New segments follow any left by earlier runs
+    uint64_t* seqs = NULL;
+    ssize_t n = journal_list(o->dir, &seqs);
+    j->seq = (n > 0) ? seqs[n - 1] : 0;
+    free(seqs);
+    j->input = actor_slot(&c->producer);
+    j->output = actor_slot(&c->transformer);
+    actor_set_slot(&c->journaler, journal_cursor(j));
+    c->journal = j;
+    c->config.expect_journal = true;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    affinity_set_attr(&attr, &c->placement.journal);
+    int err = pthread_create(&j->thread, &attr, journal_run, j);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        LOG_ERROR("Failed to start journal thread: %s", strerror(err));
+        c->config.expect_journal = false;
+        c->journal = NULL;
+        free(j);
+        return NULL;
+    }
+    return j;
+}
+
+void journal_stats_print(Journal* j, FILE* f) {
+    uint64_t syncs = __atomic_load_n(&j->syncs, __ATOMIC_RELAXED);
+    uint64_t usec = __atomic_load_n(&j->sync_usec_total, __ATOMIC_RELAXED);
+    fprintf(f, "journal: %llu records, %llu bytes, %llu syncs "
+            "(%llu usec avg), durable below slot %llu\n",
+            (long long unsigned)__atomic_load_n(&j->records,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&j->bytes, __ATOMIC_RELAXED),
+            (long long unsigned)syncs,
+            (long long unsigned)((syncs > 0) ? usec / syncs : 0),
+            (long long unsigned)actor_slot(&j->crater->journaler));
+}
+
+static int journal_segment_first_slot(Journal* j, uint64_t seq,
+                                      uint64_t* first) {
+    char path[JOURNAL_PATH_MAX];
+    journal_segment_path(j, seq, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    JournalSegmentHeader h;
+    ssize_t n = pread(fd, &h, sizeof(h), 0);
+    close(fd);
+    if (n != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, JOURNAL_SEGMENT_MAGIC, sizeof(h.magic)) != 0) {
+        return -1;
+    }
+    *first = h.first_slot;
+    return 0;
+}
+
+// Returns the oldest input slot in the journal, or fallback if it is empty
+uint64_t journal_first_slot(Journal* j, uint64_t fallback) {
+    uint64_t* seqs = NULL;
+    ssize_t n = journal_list(j->opts.dir, &seqs);
+    uint64_t first = fallback;
+    for (ssize_t i = 0; i < n; i++) {
+        // The oldest may be deleted as we look
+        if (journal_segment_first_slot(j, seqs[i], &first) == 0) {
+            break;
+        }
+    }
+    free(seqs);
+    return (first < fallback) ? first : fallback;
+}
+
+void journal_history_open(JournalHistory* h, Journal* j, SlotDestination io,
+                          uint64_t slot) {
+    memset(h, 0, sizeof(*h));
+    h->journal = j;
+    h->io = io;
+    h->next = slot;
+}
+
+static int journal_history_read(JournalHistory* h, uint64_t seq) {
+    char path[JOURNAL_PATH_MAX];
+    journal_segment_path(h->journal, seq, path, sizeof(path));
+    if (journal_reader_open(&h->reader, path) < 0) {
+        return -1;
+    }
+    h->open = true;
+    h->seq = seq;
+    return 0;
+}
+
+// Opens the last segment starting at or before the next wanted slot, or
+// the oldest if they all start after it.  Returns 0 if there are none.
+static int journal_history_seek(JournalHistory* h) {
+    uint64_t* seqs = NULL;
+    ssize_t n = journal_list(h->journal->opts.dir, &seqs);
+    if (n <= 0) {
+        return (int)n;
+    }
+    ssize_t pick = -1;
+    for (ssize_t i = 0; i < n; i++) {
+        uint64_t first = 0;
+        if (journal_segment_first_slot(h->journal, seqs[i], &first) < 0) {
+            continue;
+        }
+        if (pick >= 0 && first > h->next) {
+            break;
+        }
+        pick = i;
+    }
+    int ret = 0;
+    if (pick >= 0) {
+        ret = (journal_history_read(h, seqs[pick]) < 0) ? -1 : 1;
+    }
+    free(seqs);
+    return ret;
+}
+
+// Moves to the segment after the current one.  Returns -1 if retention
+// deleted it first, taking slots the reader has yet to read.
+static int journal_history_next_segment(JournalHistory* h) {
+    uint64_t seq = h->seq + 1;
+    journal_history_close(h);
+    char path[JOURNAL_PATH_MAX];
+    journal_segment_path(h->journal, seq, path, sizeof(path));
+    if (access(path, F_OK) < 0) {
+        LOG_WARN("Journal segment %llu was deleted before slot %llu was "
+                 "read from it", (long long unsigned)seq,
+                 (long long unsigned)h->next);
+        return -1;
+    }
+    return (journal_history_read(h, seq) < 0) ? -1 : 1;
+}
+
+// Finds the next record of the reader's column at or after the next wanted
+// slot and below end, the journaler's cursor, without moving past it.
+// Returns 1 with slot and item set, 0 if there is none yet, or -1 on error.
+// Every slot below end is journaled, so a slot missing there is an error.
+int journal_history_peek(JournalHistory* h, uint64_t end, uint64_t* slot,
+                         SlotData* item) {
+    if (!h->open) {
+        int r = journal_history_seek(h);
+        if (r <= 0) {
+            return r;
+        }
+    }
+    bool retried = false;
+    for (;;) {
+        JournalRecord rec;
+        const char* data = NULL;
+        uint64_t off = h->reader.off;
+        if (journal_reader_next(&h->reader, &rec, &data)) {
+            if (rec.io != h->io || rec.slot < h->next) {
+                continue;
+            }
+            if (rec.slot > h->next && h->next < end) {
+                LOG_WARN("Journal is missing slots %llu to %llu",
+                         (long long unsigned)h->next,
+                         (long long unsigned)((rec.slot < end) ?
+                                              rec.slot : end) - 1);
+                return -1;
+            }
+            h->after = h->reader.off;
+            h->reader.off = off;
+            if (rec.slot >= end) {
+                return 0;
+            }
+            h->peeked = rec.slot;
+            *slot = rec.slot;
+            item->buf = (char*)data;
+            item->len = rec.len;
+            return 1;
+        }
+        // Either the segment ends here or the journal is still writing it.
+        // It is complete once the next exists, so look once more and then
+        // move on.
+        if (__atomic_load_n(&h->journal->seq, __ATOMIC_ACQUIRE) <= h->seq) {
+            return 0;
+        }
+        if (!retried) {
+            retried = true;
+            continue;
+        }
+        retried = false;
+        int r = journal_history_next_segment(h);
+        if (r <= 0) {
+            return r;
+        }
+    }
+}
+
+// Moves past the record returned by the last successful peek
+void journal_history_consume(JournalHistory* h) {
+    h->reader.off = h->after;
+    h->next = h->peeked + 1;
+}
+
+void journal_history_close(JournalHistory* h) {
+    if (h->open) {
+        journal_reader_close(&h->reader);
+        h->open = false;
+    }
+}
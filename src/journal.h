@@ -0,0 +1,128 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "crater.h"
+#include "messages.h"
+
+// Append-only journal of ring slots.
+//
+// The journaler is an internal follower of the ring: its thread appends
+// every published input slot, and every output slot once the transformer
+// has written it, to memory-mapped segment files in a directory.  Records
+// are made durable in groups, one msync per batch at most every sync_usec,
+// and only then does the journaler's cursor advance.  The vacuum gates on
+// that cursor, so a slot is never reclaimed before it is on disk.
+// Producers and consumers never wait for the journal unless the ring fills.
+//
+// Segments are named by sequence number (00000000000000000001.journal, ...)
+// and start with a JournalSegmentHeader; records follow, 8-byte aligned,
+// until a header without JOURNAL_RECORD_MAGIC.
+
+#define JOURNAL_SEGMENT_MAGIC "CRATERJ1"
+#define JOURNAL_RECORD_MAGIC 0x4A524352 /* "RCRJ" */
+
+// Record column for a consumer cursor: slot is unused and the payload is a
+// named consumer's committed cursor, as saved_cursor_encode writes it
+#define JOURNAL_IO_CURSOR 2
+
+typedef struct {
+    char magic[8];
+    uint64_t seq;
+    // Slot of the first input record
+    uint64_t first_slot;
+    uint64_t size;
+} JournalSegmentHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t slot;
+    // Over slot, len, io and the payload.  io is a SlotDestination or
+    // JOURNAL_IO_CURSOR.
+    uint32_t crc;
+    uint8_t io;
+    uint8_t pad[3];
+} JournalRecord;
+
+typedef struct {
+    const char* dir;
+    // Size of each segment file
+    uint64_t segment_bytes;
+    // Longest a record may wait to be synced; 0 syncs every batch
+    uint64_t sync_usec;
+    // Oldest segments beyond this many are deleted, 0 keeps all
+    size_t max_segments;
+} JournalOptions;
+
+struct Crater;
+
+typedef struct Journal {
+    JournalOptions opts;
+    struct Crater* crater;
+    pthread_t thread;
+    // Current segment.  Bytes below synced are durable.
+    int fd;
+    uint64_t seq;
+    char* map;
+    uint64_t size;
+    uint64_t off;
+    uint64_t synced;
+    // Next input and output slots to append
+    uint64_t input;
+    uint64_t output;
+    Buffer scratch;
+    // Consumer cursors as last journaled
+    CursorTracker cursors;
+    // Written by the journal thread, read for statistics
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t syncs;
+    uint64_t sync_usec_total;
+} Journal;
+
+// Read-only view of one segment
+typedef struct {
+    int fd;
+    const char* map;
+    uint64_t size;
+    uint64_t off;
+} JournalReader;
+
+// Forward reader over one column of the journal, for consumers starting
+// below the ring.  Segments are mapped, and items point into the mapping
+// until the next call.
+typedef struct JournalHistory {
+    Journal* journal;
+    SlotDestination io;
+    // Lowest slot still wanted
+    uint64_t next;
+    // Segment being read, if open
+    bool open;
+    uint64_t seq;
+    JournalReader reader;
+    // Record returned by the last peek, and where the one after it starts
+    uint64_t peeked;
+    uint64_t after;
+} JournalHistory;
+
+void journal_options_default(JournalOptions* o);
+int journal_recover(struct Crater* c, const char* dir);
+Journal* journal_start(struct Crater* c, const JournalOptions* o);
+void journal_stats_print(Journal* j, FILE* f);
+uint32_t journal_crc(const JournalRecord* r, const char* data);
+
+uint64_t journal_first_slot(Journal* j, uint64_t fallback);
+void journal_history_open(JournalHistory* h, Journal* j, SlotDestination io,
+                          uint64_t slot);
+int journal_history_peek(JournalHistory* h, uint64_t end, uint64_t* slot,
+                         SlotData* item);
+void journal_history_consume(JournalHistory* h);
+void journal_history_close(JournalHistory* h);
+
+#endif /* JOURNAL_H */
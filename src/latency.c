@@ -0,0 +1,92 @@
+#include "latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LATENCY_INC(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define LATENCY_READ(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+uint64_t latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t latency_index(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (size_t)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - (LATENCY_SUB_BITS - 1);
+    uint64_t sub = ns >> shift;
+    return LATENCY_SUB_BUCKETS +
+        (size_t)(msb - LATENCY_SUB_BITS) * (LATENCY_SUB_BUCKETS / 2) +
+        (size_t)(sub - LATENCY_SUB_BUCKETS / 2);
+}
+
+// Highest value counted by bucket i
+static uint64_t latency_bucket_max(size_t i) {
+    if (i < LATENCY_SUB_BUCKETS) {
+        return i;
+    }
+    size_t half = LATENCY_SUB_BUCKETS / 2;
+    int msb = (int)((i - LATENCY_SUB_BUCKETS) / half) + LATENCY_SUB_BITS;
+    uint64_t sub = (i - LATENCY_SUB_BUCKETS) % half + half;
+    int shift = msb - (LATENCY_SUB_BITS - 1);
+    // Wraps to UINT64_MAX for the last bucket
+    return ((sub + 1) << shift) - 1;
+}
+
+// Only the thread owning h records into it
+void latency_record(LatencyHistogram* h, uint64_t ns) {
+    LATENCY_INC(h->counts[latency_index(ns)], 1);
+    LATENCY_INC(h->total, 1);
+    if (ns > h->max) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+// Adds h, which may still be recorded into, to into
+void latency_merge(LatencyHistogram* into, const LatencyHistogram* h) {
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        uint64_t n = LATENCY_READ(h->counts[i]);
+        into->counts[i] += n;
+        into->total += n;
+    }
+    uint64_t max = LATENCY_READ(h->max);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+// Returns the value at or below which p percent of the recorded values lie
+uint64_t latency_percentile(const LatencyHistogram* h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)((p / 100.0) * (double)h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = latency_bucket_max(i);
+            return (v < h->max) ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+void latency_print(const char* name, const LatencyHistogram* h, FILE* f) {
+    static const double pcts[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+    fprintf(f, "latency %-16s %10llu samples", name,
+            (long long unsigned)h->total);
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        fprintf(f, ", p%g %.1fus", pcts[i],
+                (double)latency_percentile(h, pcts[i]) / 1e3);
+    }
+    fprintf(f, ", max %.1fus\n", (double)h->max / 1e3);
+}
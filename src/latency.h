@@ -0,0 +1,52 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Latency histograms in the style of HdrHistogram.
+//
+// Values are nanoseconds.  Those below LATENCY_SUB_BUCKETS are counted
+// exactly; each power of two above is split into LATENCY_SUB_BUCKETS / 2
+// linear buckets, so every value is reported within 1/64 of itself over the
+// whole 64-bit range, in a fixed array of counters.  A histogram is written
+// by one thread with relaxed stores and may be merged by any other.
+//
+// When tracing, the ring stamps every traced slot with the monotonic time
+// its input was published and its output written.  The transformer records
+// input to output, and each consumer records output to read (if it reads
+// output) and input to read, the end-to-end latency.
+
+#define LATENCY_SUB_BITS 7
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS \
+    (LATENCY_SUB_BUCKETS + (64 - LATENCY_SUB_BITS) * (LATENCY_SUB_BUCKETS / 2))
+
+typedef struct {
+    uint64_t total;
+    uint64_t max;
+    uint64_t counts[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+typedef enum {
+    // Input published to output written, recorded by the transformer
+    LATENCY_TRANSFORM,
+    // Output written to read, recorded by consumers of output
+    LATENCY_DELIVER,
+    // Input published to read, recorded by every consumer
+    LATENCY_END_TO_END,
+    LATENCY_STAGES
+} LatencyStage;
+
+typedef struct ActorLatency {
+    LatencyHistogram stage[LATENCY_STAGES];
+} ActorLatency;
+
+uint64_t latency_now_ns(void);
+void latency_record(LatencyHistogram* h, uint64_t ns);
+void latency_merge(LatencyHistogram* into, const LatencyHistogram* h);
+uint64_t latency_percentile(const LatencyHistogram* h, double p);
+void latency_print(const char* name, const LatencyHistogram* h, FILE* f);
+
+#endif /* LATENCY_H */
@@ -0,0 +1,459 @@
+// Load generator for the full socket path.  Opens the producer, an
+// optional transformer and every consumer the server expects, drives the
+// producer on an open-loop schedule and reports throughput and latency.
+//
+// Every item starts with a LoadHeader.  intended_ns is when the schedule
+// meant the item to be sent, so a producer held up by back pressure does
+// not hide the wait from the items queued behind it: latency measured from
+// it is corrected for coordinated omission.  sent_ns is when it was
+// actually queued, for the uncorrected figure.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "client.h"
+#include "latency.h"
+
+#define LOAD_MAX_CONSUMERS 256
+// Marks the last item of a run
+#define LOAD_SEQ_END UINT64_MAX
+
+typedef struct {
+    uint64_t seq;
+    uint64_t intended_ns;
+    uint64_t sent_ns;
+} LoadHeader;
+
+typedef enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXPONENTIAL
+} SizeDistribution;
+
+typedef enum {
+    // Items are due at exact 1/rate intervals
+    SCHEDULE_CONSTANT,
+    // Interarrival times are exponential, as from many independent senders
+    SCHEDULE_POISSON
+} Schedule;
+
+typedef struct {
+    Addr addr;
+    size_t consumers;
+    bool transformer;
+    SlotDestination io;
+    // Items per second, 0 for as fast as the ring takes them
+    double rate;
+    Schedule schedule;
+    uint64_t duration_usec;
+    // Items to send, 0 to run for duration_usec
+    uint64_t items;
+    SizeDistribution sizes;
+    size_t size_min;
+    size_t size_max;
+    ClientOptions client;
+} LoadOptions;
+
+typedef struct {
+    Client client;
+    const LoadOptions* opts;
+    // Producer: items sent.  Consumers: items and bytes received.
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t done_ns;
+    LatencyHistogram* corrected;
+    LatencyHistogram* uncorrected;
+    int ret;
+} LoadConn;
+
+static uint64_t load_start_ns = 0;
+
+static void load_options_default(LoadOptions* o) {
+    memset(o, 0, sizeof(*o));
+    o->consumers = 1;
+    o->transformer = true;
+    o->io = SLOT_OUTPUT;
+    o->rate = 10000;
+    o->schedule = SCHEDULE_CONSTANT;
+    o->duration_usec = 10 * 1000000;
+    o->sizes = SIZE_FIXED;
+    o->size_min = 64;
+    o->size_max = 64;
+    client_options_default(&o->client);
+}
+
+// Parses "n", "min-max" (uniform) or "exp:mean" (exponential)
+static int load_parse_sizes(const char* s, LoadOptions* o) {
+    char* end = NULL;
+    if (strncmp(s, "exp:", 4) == 0) {
+        o->sizes = SIZE_EXPONENTIAL;
+        o->size_min = (size_t)strtoull(&s[4], &end, 10);
+        o->size_max = o->size_min;
+        return (end == &s[4] || *end != '\0' || o->size_min == 0) ? -1 : 0;
+    }
+    o->size_min = (size_t)strtoull(s, &end, 10);
+    if (end == s) {
+        return -1;
+    }
+    if (*end == '\0') {
+        o->sizes = SIZE_FIXED;
+        o->size_max = o->size_min;
+        return 0;
+    }
+    if (*end != '-') {
+        return -1;
+    }
+    const char* max = end + 1;
+    o->size_max = (size_t)strtoull(max, &end, 10);
+    if (end == max || *end != '\0' || o->size_max < o->size_min) {
+        return -1;
+    }
+    o->sizes = SIZE_UNIFORM;
+    return 0;
+}
+
+static double load_uniform(unsigned* seed) {
+    return ((double)rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+static size_t load_next_size(const LoadOptions* o, unsigned* seed) {
+    size_t n = o->size_min;
+    switch (o->sizes) {
+    case SIZE_UNIFORM:
+        n = o->size_min + (size_t)(load_uniform(seed) *
+                                   (double)(o->size_max - o->size_min + 1));
+        if (n > o->size_max) {
+            n = o->size_max;
+        }
+        break;
+    case SIZE_EXPONENTIAL:
+        n = (size_t)(-log(load_uniform(seed)) * (double)o->size_min);
+        break;
+    case SIZE_FIXED:
+    default:
+        break;
+    }
+    return (n < sizeof(LoadHeader)) ? sizeof(LoadHeader) : n;
+}
+
+static void load_sleep_until(uint64_t ns) {
+    uint64_t now = latency_now_ns();
+    if (ns > now) {
+        struct timespec ts = {
+            .tv_sec = (time_t)((ns - now) / 1000000000),
+            .tv_nsec = (long)((ns - now) % 1000000000)
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Queues one item, waiting for the socket while the client is full
+static int load_send(LoadConn* p, Buffer* item, uint64_t seq,
+                     uint64_t intended_ns) {
+    LoadHeader h = { .seq = seq, .intended_ns = intended_ns };
+    for (;;) {
+        h.sent_ns = latency_now_ns();
+        memcpy(item->buf, &h, sizeof(h));
+        int ret = client_produce(&p->client, item->buf, item->len);
+        if (ret != 1) {
+            return ret;
+        }
+        if (client_poll(&p->client, -1) < 0) {
+            return -1;
+        }
+    }
+}
+
+static void* load_produce(void* arg) {
+    LoadConn* p = arg;
+    const LoadOptions* o = p->opts;
+    unsigned seed = 1;
+    Buffer item;
+    buffer_alloc(&item, (o->size_max > sizeof(LoadHeader)) ?
+                 o->size_max : sizeof(LoadHeader));
+    double gap_ns = (o->rate > 0) ? 1e9 / o->rate : 0;
+    double due = (double)load_start_ns;
+    uint64_t end_ns = load_start_ns + o->duration_usec * 1000;
+    uint64_t linger_ns = o->client.linger_usec * 1000;
+    p->ret = 0;
+    for (uint64_t seq = 0;; seq++) {
+        if (o->items > 0 ? seq >= o->items : (uint64_t)due >= end_ns) {
+            break;
+        }
+        uint64_t intended = (uint64_t)due;
+        if (gap_ns > 0) {
+            // Keep batches moving while waiting for the next item
+            while (latency_now_ns() < intended) {
+                if (client_poll(&p->client, 0) < 0) {
+                    p->ret = -1;
+                    goto done;
+                }
+                uint64_t wake = latency_now_ns() + linger_ns;
+                load_sleep_until((wake < intended) ? wake : intended);
+            }
+            due += (o->schedule == SCHEDULE_POISSON) ?
+                -log(load_uniform(&seed)) * gap_ns : gap_ns;
+        } else {
+            intended = latency_now_ns();
+        }
+        size_t len = load_next_size(o, &seed);
+        if (len > item.max && buffer_resize(&item, len) < 0) {
+            p->ret = -1;
+            goto done;
+        }
+        memset(&item.buf[sizeof(LoadHeader)], 'x', len - sizeof(LoadHeader));
+        item.len = len;
+        if (load_send(p, &item, seq, intended) < 0 ||
+            client_poll(&p->client, 0) < 0) {
+            p->ret = -1;
+            goto done;
+        }
+        p->items++;
+        p->bytes += len;
+    }
+    item.len = sizeof(LoadHeader);
+    if (load_send(p, &item, LOAD_SEQ_END, latency_now_ns()) < 0 ||
+        client_flush(&p->client) < 0) {
+        p->ret = -1;
+    }
+done:
+    p->done_ns = latency_now_ns();
+    buffer_free(&item);
+    return NULL;
+}
+
+static int load_forward(void* arg, const char* data, size_t len,
+                        Buffer* out) {
+    return TRANSFORM_SAME;
+}
+
+static void* load_transform(void* arg) {
+    LoadConn* t = arg;
+    t->ret = client_transform(&t->client, load_forward, t);
+    return NULL;
+}
+
+static int load_receive(void* arg, uint64_t slot, const char* data,
+                        size_t len) {
+    LoadConn* c = arg;
+    uint64_t now = latency_now_ns();
+    LoadHeader h;
+    if (len < sizeof(h)) {
+        printf("Item at slot %llu is too short for a load header\n",
+               (long long unsigned)slot);
+        return -1;
+    }
+    memcpy(&h, data, sizeof(h));
+    if (h.seq == LOAD_SEQ_END) {
+        c->done_ns = now;
+        return -1;
+    }
+    latency_record(c->corrected, (now > h.intended_ns) ?
+                   now - h.intended_ns : 0);
+    latency_record(c->uncorrected, (now > h.sent_ns) ? now - h.sent_ns : 0);
+    c->items++;
+    c->bytes += len;
+    return 0;
+}
+
+static void* load_consume(void* arg) {
+    LoadConn* c = arg;
+    c->ret = client_consume(&c->client, c->opts->io, load_receive, c);
+    return NULL;
+}
+
+static void load_report(const LoadOptions* o, LoadConn* producer,
+                        LoadConn* consumers) {
+    LatencyHistogram* corrected = calloc(1, sizeof(*corrected));
+    LatencyHistogram* uncorrected = calloc(1, sizeof(*uncorrected));
+    if (corrected == NULL || uncorrected == NULL) {
+        free(corrected);
+        free(uncorrected);
+        return;
+    }
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+    uint64_t last_ns = producer->done_ns;
+    for (size_t i = 0; i < o->consumers; i++) {
+        latency_merge(corrected, consumers[i].corrected);
+        latency_merge(uncorrected, consumers[i].uncorrected);
+        items += consumers[i].items;
+        bytes += consumers[i].bytes;
+        if (consumers[i].done_ns > last_ns) {
+            last_ns = consumers[i].done_ns;
+        }
+    }
+    double send_secs = (double)(producer->done_ns - load_start_ns) / 1e9;
+    double secs = (double)(last_ns - load_start_ns) / 1e9;
+    printf("sent %llu items (%llu bytes) in %.3fs: %.0f items/s\n",
+           (long long unsigned)producer->items,
+           (long long unsigned)producer->bytes, send_secs,
+           (double)producer->items / send_secs);
+    printf("received %llu items (%llu bytes) over %zu consumer(s) in "
+           "%.3fs: %.0f items/s, %.1f MB/s\n", (long long unsigned)items,
+           (long long unsigned)bytes, o->consumers, secs,
+           (double)items / secs, (double)bytes / secs / 1e6);
+    latency_print("corrected", corrected, stdout);
+    latency_print("uncorrected", uncorrected, stdout);
+    free(corrected);
+    free(uncorrected);
+}
+
+static void usage(void) {
+    printf("Usage: ./crater-load [-c consumers] [-T] [-I] [-r rate] [-P] "
+           "[-d secs | -n items] [-s sizes] [-b bytes] [-l usec] "
+           "[-t ring] host:port\n");
+    printf("  -c  Consumer connections; must match the server's -c "
+           "(default 1)\n");
+    printf("  -T  Do not connect a transformer (the server runs one "
+           "itself)\n");
+    printf("  -I  Consumers read input instead of output\n");
+    printf("  -r  Items per second to send, 0 for as fast as possible "
+           "(default 10000)\n");
+    printf("  -P  Send on a Poisson schedule instead of at fixed "
+           "intervals\n");
+    printf("  -d  Seconds to send for (default 10)\n");
+    printf("  -n  Items to send, instead of a duration\n");
+    printf("  -s  Payload sizes: n, min-max (uniform) or exp:mean "
+           "(default 64, at least %zu)\n", sizeof(LoadHeader));
+    printf("  -b  Producer batch size in bytes\n");
+    printf("  -l  Producer batch linger in microseconds\n");
+    printf("  -t  Load the named ring instead of the server's first\n");
+}
+
+int main(int argc, char** argv) {
+    LoadOptions o;
+    load_options_default(&o);
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hc:TIr:Pd:n:s:b:l:t:")) != -1) {
+        switch (opt) {
+        case 'c':
+            o.consumers = (size_t)atoi(optarg);
+            if (o.consumers == 0 || o.consumers > LOAD_MAX_CONSUMERS) {
+                printf("Between 1 and %d consumers\n", LOAD_MAX_CONSUMERS);
+                return 1;
+            }
+            break;
+        case 'T':
+            o.transformer = false;
+            break;
+        case 'I':
+            o.io = SLOT_INPUT;
+            break;
+        case 'r':
+            o.rate = strtod(optarg, NULL);
+            break;
+        case 'P':
+            o.schedule = SCHEDULE_POISSON;
+            break;
+        case 'd':
+            o.duration_usec = (uint64_t)(strtod(optarg, NULL) * 1e6);
+            break;
+        case 'n':
+            o.items = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            if (load_parse_sizes(optarg, &o) < 0) {
+                printf("Invalid sizes: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            o.client.batch_bytes = (size_t)strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            o.client.linger_usec = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            o.client.ring = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+        return 1;
+    }
+    if (addr_from_hostname(argv[optind], &o.addr) < 0) {
+        printf("Invalid server: %s\n", argv[optind]);
+        return 1;
+    }
+
+    // Every connection is made before the first item is due, so the
+    // server has started by then
+    LoadConn producer = { .opts = &o };
+    LoadConn transformer = { .opts = &o };
+    LoadConn* consumers = calloc(o.consumers, sizeof(*consumers));
+    if (consumers == NULL) {
+        return 1;
+    }
+    if (client_connect(&producer.client, o.addr, ACTOR_PRODUCER,
+                       &o.client) < 0 ||
+        (o.transformer &&
+         client_connect(&transformer.client, o.addr, ACTOR_TRANSFORMER,
+                        &o.client) < 0)) {
+        printf("Failed to connect to %s\n", argv[optind]);
+        return 1;
+    }
+    for (size_t i = 0; i < o.consumers; i++) {
+        LoadConn* c = &consumers[i];
+        c->opts = &o;
+        c->corrected = calloc(1, sizeof(*c->corrected));
+        c->uncorrected = calloc(1, sizeof(*c->uncorrected));
+        if (c->corrected == NULL || c->uncorrected == NULL ||
+            client_connect(&c->client, o.addr, ACTOR_CONSUMER,
+                           &o.client) < 0) {
+            printf("Failed to connect consumer %zu\n", i);
+            return 1;
+        }
+    }
+
+    load_start_ns = latency_now_ns() + 100000000;
+    pthread_t producer_thread;
+    pthread_t transformer_thread;
+    pthread_t* consumer_threads = calloc(o.consumers,
+                                         sizeof(*consumer_threads));
+    if (consumer_threads == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < o.consumers; i++) {
+        pthread_create(&consumer_threads[i], NULL, load_consume,
+                       &consumers[i]);
+    }
+    if (o.transformer) {
+        pthread_create(&transformer_thread, NULL, load_transform,
+                       &transformer);
+    }
+    load_sleep_until(load_start_ns);
+    pthread_create(&producer_thread, NULL, load_produce, &producer);
+
+    pthread_join(producer_thread, NULL);
+    int ret = producer.ret;
+    for (size_t i = 0; i < o.consumers; i++) {
+        pthread_join(consumer_threads[i], NULL);
+        if (consumers[i].ret < 0) {
+            ret = -1;
+        }
+    }
+    load_report(&o, &producer, consumers);
+    // The transformer has no end of its own; exiting closes it
+    client_close(&producer.client);
+    for (size_t i = 0; i < o.consumers; i++) {
+        client_close(&consumers[i].client);
+        free(consumers[i].corrected);
+        free(consumers[i].uncorrected);
+    }
+    free(consumer_threads);
+    free(consumers);
+    return (ret < 0) ? 1 : 0;
+}
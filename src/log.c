@@ -0,0 +1,217 @@
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define CACHELINE 64
+// Records each thread may have waiting for the log thread
+#define LOG_RING_RECORDS 512
+// Longer records are truncated
+#define LOG_TEXT_MAX 248
+// How long the log thread sleeps once every ring is empty
+#define LOG_IDLE_USEC 1000
+
+typedef struct {
+    // Monotonic, to merge the rings in order
+    uint64_t ns;
+    uint32_t len;
+    uint32_t level;
+    char text[LOG_TEXT_MAX];
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord records[LOG_RING_RECORDS];
+    // Written by the owning thread
+    volatile uint64_t head __attribute__((aligned(CACHELINE)));
+    uint64_t dropped;
+    // Written by the log thread
+    volatile uint64_t tail __attribute__((aligned(CACHELINE)));
+    uint64_t reported;
+    // Set when the owning thread exits; the log thread frees the ring once
+    // it is drained
+    volatile bool orphaned;
+    // Log thread only: records below end are being drained, and the ring
+    // is freed after them if its thread had exited
+    uint64_t end;
+    bool last;
+    struct LogRing* next;
+} LogRing;
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+static volatile bool log_running = false;
+static LogRing* rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_t log_thread;
+static __thread LogRing* tls_ring = NULL;
+
+static uint64_t log_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void log_ring_orphan(void* arg) {
+    LogRing* r = arg;
+    __atomic_store_n(&r->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static LogRing* log_ring_attach(void) {
+    LogRing* r = NULL;
+    if (posix_memalign((void**)&r, CACHELINE, sizeof(*r)) != 0) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, r);
+    tls_ring = r;
+    return r;
+}
+
+static void log_write_direct(const char* fmt, va_list ap) {
+    flockfile(stdout);
+    vfprintf(stdout, fmt, ap);
+    fputc('\n', stdout);
+    funlockfile(stdout);
+}
+
+void log_write(LogLevel level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        log_write_direct(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    LogRing* r = tls_ring;
+    if (r == NULL && (r = log_ring_attach()) == NULL) {
+        log_write_direct(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    uint64_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+        LOG_RING_RECORDS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    LogRecord* rec = &r->records[head % LOG_RING_RECORDS];
+    int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        n = 0;
+    }
+    rec->len = ((size_t)n < sizeof(rec->text)) ? (uint32_t)n :
+        (uint32_t)(sizeof(rec->text) - 1);
+    rec->level = level;
+    rec->ns = log_now_ns();
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_report_drops(LogRing* r, FILE* f) {
+    uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped > r->reported) {
+        fprintf(f, "Log dropped %llu records from a busy thread\n",
+                (long long unsigned)(dropped - r->reported));
+        r->reported = dropped;
+    }
+}
+
+// Writes out every record the rings hold, oldest first across rings, and
+// frees the rings of exited threads.  Returns the number of records written.
+static uint64_t log_drain(void) {
+    uint64_t n = 0;
+    pthread_mutex_lock(&rings_lock);
+    bool any = false;
+    for (LogRing* r = rings; r != NULL; r = r->next) {
+        // Read before end, so an orphaned ring is known to be complete
+        r->last = __atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE);
+        r->end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        any = any || r->end > r->tail;
+    }
+    while (any) {
+        LogRing* first = NULL;
+        LogRecord* rec = NULL;
+        for (LogRing* r = rings; r != NULL; r = r->next) {
+            if (r->tail == r->end) {
+                continue;
+            }
+            LogRecord* next = &r->records[r->tail % LOG_RING_RECORDS];
+            if (rec == NULL || next->ns < rec->ns) {
+                first = r;
+                rec = next;
+            }
+        }
+        if (first == NULL) {
+            break;
+        }
+        fwrite(rec->text, 1, rec->len, stdout);
+        fputc('\n', stdout);
+        __atomic_store_n(&first->tail, first->tail + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    LogRing** link = &rings;
+    while (*link != NULL) {
+        LogRing* r = *link;
+        log_report_drops(r, stdout);
+        if (r->last && r->tail == r->end) {
+            *link = r->next;
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (n > 0) {
+        fflush(stdout);
+    }
+    return n;
+}
+
+static void* log_run(void* arg) {
+    for (;;) {
+        if (log_drain() == 0) {
+            usleep(LOG_IDLE_USEC);
+        }
+    }
+    return NULL;
+}
+
+// Writes out every record logged so far.  Registered to run at exit.
+void log_flush(void) {
+    if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        log_drain();
+    }
+}
+
+// Starts the log thread.  Records logged before this were written directly.
+// Returns -1 on error.
+int log_start(void) {
+    if (log_running) {
+        return 0;
+    }
+    if (pthread_key_create(&ring_key, log_ring_orphan) != 0) {
+        return -1;
+    }
+    int err = pthread_create(&log_thread, NULL, log_run, NULL);
+    if (err != 0) {
+        printf("Failed to start log thread: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(log_thread);
+    fflush(stdout);
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+    atexit(log_flush);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Leveled, asynchronous logging for the server.
+//
+// Each thread formats its records into its own ring of fixed-size records,
+// which only it writes and only the log thread reads, so logging takes no
+// lock and never waits on stdout.  The log thread drains every ring to
+// stdout.  A thread whose ring is full drops the record and counts it; the
+// log thread reports the drops.  Until log_start is called, and for the
+// client library, records are written to stdout directly.
+//
+// Records above LOG_MAX_LEVEL are compiled out, and those above log_level
+// cost one comparison.  Per-message and per-slot records are at
+// LOG_LEVEL_TRACE, which is only compiled in when building with
+// -DLOG_MAX_LEVEL=LOG_LEVEL_TRACE.
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE
+} LogLevel;
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern LogLevel log_level;
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+void log_write(LogLevel level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int log_start(void);
+void log_flush(void);
+
+#endif /* LOG_H */
@@ -1,9 +1,16 @@
 #include <stdio.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "crater.h"
+#include "journal.h"
+#include "log.h"
+#include "replica.h"
 #include "server.h"
+#include "stage.h"
 
 /*
 Ring buffer
@@ -13,34 +20,501 @@ Producer/Consumer
 
 */
 
-int main(int argc, char** argv) {
-    if (argc > 1 && strlen(argv[1]) >= 2 && strncmp(argv[1], "-h", 2) == 0) {
-        printf("Usage: ./crater xxx.xx.xx.xxx:yyyy\n");
+#define MAXSTAGES 16
+#define MAXRINGS 16
+
+static void on_sigusr1(int sig) {
+    crater_request_stats();
+}
+
+// Parses a byte count with an optional k, m or g suffix.  Returns -1 if
+// malformed.
+static int parse_size(const char* s, uint64_t* n) {
+    char* end = NULL;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *n = v;
+    return 0;
+}
+
+// Parses slots[:block|evict|detach[:secs]] into o.  Returns -1 if
+// malformed.
+static int parse_lag(const char* s, CraterOptions* o) {
+    char* end = NULL;
+    o->max_lag = strtoull(s, &end, 10);
+    if (end == s) {
+        return -1;
+    }
+    o->lag_policy = LAG_EVICT;
+    if (*end == '\0') {
         return 0;
     }
-    Crater* c = crater_alloc(100, 1, 0);
-    printf("Crater size: %llu\n", (long long unsigned)c->len);
+    const char* policy = end + 1;
+    size_t len = strcspn(policy, ":");
+    if (*end != ':') {
+        return -1;
+    } else if (len == 5 && strncmp(policy, "evict", len) == 0) {
+        o->lag_policy = LAG_EVICT;
+    } else if (len == 6 && strncmp(policy, "detach", len) == 0) {
+        o->lag_policy = LAG_DETACH;
+    } else if (len == 5 && strncmp(policy, "block", len) == 0) {
+        o->lag_policy = LAG_BLOCK;
+    } else {
+        return -1;
+    }
+    if (policy[len] == ':') {
+        const char* secs = &policy[len + 1];
+        double grace = strtod(secs, &end);
+        if (end == secs || *end != '\0' || grace < 0) {
+            return -1;
+        }
+        o->lag_grace_usec = (uint64_t)(grace * 1e6);
+    }
+    return 0;
+}
 
-    const char* hostname = argv[1];
+// Allocates the ring a -t option describes: name[:slots[:consumers]], with
+// every other setting taken from o.  Returns NULL if malformed.
+static Crater* ring_alloc(const char* spec, CraterOptions o) {
+    char name[RINGNAMEMAX + 1];
+    const char* colon = strchr(spec, ':');
+    size_t len = (colon != NULL) ? (size_t)(colon - spec) : strlen(spec);
+    if (len == 0 || len > RINGNAMEMAX) {
+        printf("Ring names are 1 to %d bytes: %s\n", RINGNAMEMAX, spec);
+        return NULL;
+    }
+    memcpy(name, spec, len);
+    name[len] = '\0';
+    o.name = name;
+    if (colon != NULL) {
+        char* end = NULL;
+        o.len = strtoull(colon + 1, &end, 10);
+        if (end == colon + 1 || o.len == 0 || (*end != '\0' && *end != ':')) {
+            printf("Invalid ring: %s\n", spec);
+            return NULL;
+        }
+        if (*end == ':') {
+            const char* n = end + 1;
+            o.n_consumers = (size_t)strtoull(n, &end, 10);
+            if (end == n || *end != '\0') {
+                printf("Invalid ring: %s\n", spec);
+                return NULL;
+            }
+        }
+    }
+    return crater_alloc(&o);
+}
+
+// Adds the partition rings of the stream a -P option describes:
+// name:partitions[:slots[:consumers]], each partition a ring as -t would
+// make it.  Returns -1 if malformed.
+static int stream_alloc(Craters* rings, const char* spec, CraterOptions o) {
+    char stream[RINGNAMEMAX + 1];
+    const char* colon = strchr(spec, ':');
+    size_t len = (colon != NULL) ? (size_t)(colon - spec) : 0;
+    if (len == 0 || len > RINGNAMEMAX) {
+        printf("Invalid stream: %s\n", spec);
+        return -1;
+    }
+    memcpy(stream, spec, len);
+    stream[len] = '\0';
+    char* end = NULL;
+    o.partitions = strtoull(colon + 1, &end, 10);
+    if (end == colon + 1 || o.partitions == 0 ||
+        o.partitions > PARTITIONSMAX || (*end != '\0' && *end != ':')) {
+        printf("Streams have 1 to %d partitions: %s\n", PARTITIONSMAX, spec);
+        return -1;
+    }
+    for (o.partition = 0; o.partition < o.partitions; o.partition++) {
+        char name[RINGNAMEMAX + 1];
+        char ring[2 * RINGNAMEMAX];
+        if (partition_name(name, stream, o.partition) < 0 ||
+            strlen(end) >= sizeof(ring) - RINGNAMEMAX) {
+            printf("Invalid stream: %s\n", spec);
+            return -1;
+        }
+        // The rest of the spec sizes each partition
+        snprintf(ring, sizeof(ring), "%s%s", name, end);
+        Crater* r = ring_alloc(ring, o);
+        if (r == NULL || craters_add(rings, r) < 0) {
+            if (r != NULL) {
+                crater_destroy(r);
+            }
+            return -1;
+        }
+        if (o.partition + 1 == o.partitions) {
+            printf("Stream %s: %llu partitions, %s.0 to %s, of %llu slots "
+                   "and %zu consumers\n", stream,
+                   (long long unsigned)o.partitions, stream, r->name,
+                   (long long unsigned)r->len, r->config.expect_consumers);
+        }
+    }
+    return 0;
+}
+
+static void usage(void) {
+    printf("Usage: ./crater [-c consumers] [-s stage.so[:arg]]... "
+           "[-t name[:slots[:consumers]]]... [-P name:partitions[:slots[:consumers]]]... [-r slots] [-i bytes] [-b bytes [-x]] [-m bytes] [-p pages] [-f] [-l] [-n node] [-a role=cpus]... "
+           "[-j dir [-J usec] [-S bytes] [-K n]] "
+           "[-R host:port [-Y] [-o] | -F host:port] [-g slots[:policy[:secs]]] [-I secs] [-M secs] [-L n] [-v | -q] [xxx.xx.xx.xxx:yyyy]\n");
+    printf("  -c  Consumers a ring waits for over the network before it "
+           "starts; actors may join and leave once it has\n");
+    printf("  -s  Run a transformer or consumer plugin inside the server\n");
+    printf("  -t  Serve another ring, which clients join by name, with its "
+           "own slots and consumers (default -r and -c).  The first ring, "
+           "named default, alone runs stages, journals and replicates.\n");
+    printf("  -P  Serve a stream split into partition rings name.0 to "
+           "name.n-1, each with these slots and consumers.  Producers "
+           "route items to partitions by key, so each key stays in order "
+           "while partitions run on their own threads.\n");
+    printf("  -r  Number of ring slots (default 100)\n");
+    printf("  -i  Store payloads up to this size inside their slot "
+           "(default 64, 0 disables)\n");
+    printf("  -b  Budget for payload bytes held outside the slots; "
+           "producers wait when it is spent\n");
+    printf("  -x  Reject producer items over the budget instead of "
+           "waiting.  The producer is sent MSG_REJECT for each and keeps "
+           "its connection.\n");
+    printf("  -m  Largest accepted item (at most, and by default, 16M)\n");
+    printf("  -p  Ring pages: default, thp, 2m or 1g.  Explicit huge pages "
+           "fall back to thp.\n");
+    printf("  -f  Prefault the ring at startup\n");
+    printf("  -l  Lock the ring in memory\n");
+    printf("  -n  Allocate the ring on this NUMA node\n");
+    printf("  -a  Pin threads of a role (p, t, c, j for the journal, or v "
+           "for the vacuum and accept loop) to a CPU list such as 0,2-3\n");
+    printf("  -j  Journal slots to segment files in this directory\n");
+    printf("  -J  Longest a journaled slot may wait for its sync, in "
+           "microseconds (default 1000, 0 syncs every batch)\n");
+    printf("  -S  Journal segment size (default 64M)\n");
+    printf("  -K  Keep at most this many journal segments (default all)\n");
+    printf("  -R  Replicate the ring to a standby listening here\n");
+    printf("  -Y  Consumers only see slots the standby has acknowledged\n");
+    printf("  -o  Replicate output slots too\n");
+    printf("  -F  Be a standby: follow the primary that connects here, and "
+           "serve clients once it disconnects\n");
+    printf("  -g  Deal with consumers that stay more than this many slots "
+           "behind for secs (default 1): evict (the default) disconnects "
+           "them, detach has them catch up from the journal without "
+           "holding back the ring, block waits for them\n");
+    printf("  -I  Disconnect consumers and transformers that send nothing "
+           "for this many seconds\n");
+    printf("  -M  Print per-actor metrics every this many seconds\n");
+    printf("  -L  Trace the latency of every nth slot (1 traces all), "
+           "printed with the metrics\n");
+    printf("  -v  Log more: connection details, and per-message records "
+           "if built with -DLOG_MAX_LEVEL=LOG_LEVEL_TRACE.  Repeatable.\n");
+    printf("  -q  Log only warnings and errors\n");
+}
+
+int main(int argc, char** argv) {
+    const char* stages[MAXSTAGES];
+    size_t n_stages = 0;
+    const char* ring_specs[MAXRINGS];
+    size_t n_ring_specs = 0;
+    const char* stream_specs[MAXRINGS];
+    size_t n_stream_specs = 0;
+    CraterOptions o;
+    crater_options_default(&o);
+    JournalOptions jo;
+    journal_options_default(&jo);
+    ReplicaOptions ro;
+    replica_options_default(&ro);
+    const char* standby = NULL;
+    const char* primary = NULL;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hc:s:t:P:r:i:b:xm:p:fln:a:j:J:S:K:R:YoF:g:I:M:L:vq")) != -1) {
+        switch (opt) {
+        case 'c':
+            o.n_consumers = (size_t)atoi(optarg);
+            break;
+        case 'r':
+            o.len = strtoull(optarg, NULL, 10);
+            if (o.len == 0) {
+                printf("Invalid ring size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            o.inline_max = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            if (parse_size(optarg, &o.budget_bytes) < 0) {
+                printf("Invalid byte budget: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'x':
+            o.budget_policy = BUDGET_REJECT;
+            break;
+        case 'm':
+            if (parse_size(optarg, &o.item_max) < 0 ||
+                o.item_max > MSGMAXLEN) {
+                printf("Invalid item size cap: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            if (memory_parse_pages(optarg, &o.memory.pages) < 0) {
+                printf("Invalid page size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            o.memory.prefault = true;
+            break;
+        case 'l':
+            o.memory.lock = true;
+            break;
+        case 'n':
+            o.memory.node = atoi(optarg);
+            break;
+        case 'j':
+            jo.dir = optarg;
+            break;
+        case 'J':
+            jo.sync_usec = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            if (parse_size(optarg, &jo.segment_bytes) < 0 ||
+                jo.segment_bytes == 0) {
+                printf("Invalid segment size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'K':
+            jo.max_segments = (size_t)atoi(optarg);
+            break;
+        case 'R':
+            standby = optarg;
+            break;
+        case 'Y':
+            ro.sync = true;
+            break;
+        case 'o':
+            ro.outputs = true;
+            break;
+        case 'F':
+            primary = optarg;
+            break;
+        case 'g':
+            if (parse_lag(optarg, &o) < 0) {
+                printf("Invalid lag limit: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            o.idle_timeout_usec = (uint64_t)(strtod(optarg, NULL) * 1e6);
+            break;
+        case 'M':
+            o.metrics_interval_usec = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'L':
+            o.trace_every = strtoull(optarg, NULL, 10);
+            if (o.trace_every == 0) {
+                printf("Invalid trace interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'v':
+            if (log_level < LOG_LEVEL_TRACE) {
+                log_level++;
+            }
+            break;
+        case 'q':
+            log_level = LOG_LEVEL_WARN;
+            break;
+        case 'a':
+            if (placement_parse(&o.placement, optarg) < 0) {
+                printf("Invalid placement: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (n_stages == MAXSTAGES) {
+                printf("At most %d stages\n", MAXSTAGES);
+                return 1;
+            }
+            stages[n_stages++] = optarg;
+            break;
+        case 't':
+            if (n_ring_specs == MAXRINGS) {
+                printf("At most %d more rings\n", MAXRINGS);
+                return 1;
+            }
+            ring_specs[n_ring_specs++] = optarg;
+            break;
+        case 'P':
+            if (n_stream_specs == MAXRINGS) {
+                printf("At most %d streams\n", MAXRINGS);
+                return 1;
+            }
+            stream_specs[n_stream_specs++] = optarg;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    // Detached consumers read from the journal, which only the first ring
+    // keeps
+    if (o.lag_policy == LAG_DETACH &&
+        (jo.dir == NULL || n_ring_specs > 0 || n_stream_specs > 0)) {
+        printf("Detaching lagging consumers needs a journal (-j), and only "
+               "the first ring has one\n");
+        return 1;
+    }
+
+    // Pin the main thread first, so the ring is prefaulted from, and the
+    // vacuum later runs on, the CPUs chosen for it
+    affinity_set_self(&o.placement.vacuum);
+    Crater* c = crater_alloc(&o);
+    if (c == NULL) {
+        printf("Failed to allocate crater\n");
+        return 1;
+    }
+    printf("Crater size: %llu (%s, %zu bytes%s)\n",
+           (long long unsigned)c->len, memory_pages_name(c->mapping.pages),
+           c->mapping.size, c->mapping.locked ? ", locked" : "");
+    printf("Slot size: %zu bytes, payloads up to %zu bytes inline\n",
+           c->entry_size, c->inline_max);
+    if (c->budget_bytes > 0) {
+        printf("Payload budget: %llu bytes, %s when spent\n",
+               (long long unsigned)c->budget_bytes,
+               (c->budget_policy == BUDGET_REJECT) ? "reject" : "block");
+    }
+    if (c->mapping.node >= 0) {
+        printf("Ring on NUMA node %d\n", c->mapping.node);
+    }
+    if (c->trace_every > 0) {
+        printf("Tracing latency of every %llu slot(s)\n",
+               (long long unsigned)c->trace_every);
+    }
+    if (jo.dir != NULL) {
+        if (journal_recover(c, jo.dir) < 0 || journal_start(c, &jo) == NULL) {
+            crater_destroy(c);
+            return 1;
+        }
+        printf("Journaling to %s\n", jo.dir);
+    }
+    if (standby != NULL && primary != NULL) {
+        printf("A crater is either a primary (-R) or a standby (-F)\n");
+        crater_destroy(c);
+        return 1;
+    }
+    if (primary != NULL) {
+        Addr follow;
+        if (addr_from_hostname(primary, &follow) < 0 ||
+            replica_follow(c, follow) < 0) {
+            printf("Failed to follow primary on %s\n", primary);
+            crater_destroy(c);
+            return 1;
+        }
+    }
+    if (standby != NULL) {
+        if (addr_from_hostname(standby, &ro.standby) < 0 ||
+            replica_start(c, &ro) == NULL) {
+            printf("Failed to replicate to %s\n", standby);
+            crater_destroy(c);
+            return 1;
+        }
+        printf("Replicating %s to %s, %s\n",
+               ro.outputs ? "inputs and outputs" : "inputs", standby,
+               ro.sync ? "synchronously" : "asynchronously");
+    }
+    for (size_t i = 0; i < n_stages; i++) {
+        if (stage_load(c, stages[i]) < 0) {
+            crater_destroy(c);
+            return 1;
+        }
+    }
+    Craters rings;
+    craters_alloc(&rings, 1 + n_ring_specs);
+    if (craters_add(&rings, c) < 0) {
+        crater_destroy(c);
+        return 1;
+    }
+    for (size_t i = 0; i < n_ring_specs; i++) {
+        Crater* r = ring_alloc(ring_specs[i], o);
+        if (r == NULL || craters_add(&rings, r) < 0) {
+            printf("Failed to allocate ring %s\n", ring_specs[i]);
+            if (r != NULL) {
+                crater_destroy(r);
+            }
+            craters_destroy(&rings);
+            return 1;
+        }
+        printf("Ring %s: %llu slots, %zu consumers\n", r->name,
+               (long long unsigned)r->len, r->config.expect_consumers);
+    }
+    for (size_t i = 0; i < n_stream_specs; i++) {
+        if (stream_alloc(&rings, stream_specs[i], o) < 0) {
+            printf("Failed to allocate stream %s\n", stream_specs[i]);
+            craters_destroy(&rings);
+            return 1;
+        }
+    }
+
+    // From here on, clients are served and records go through the log
+    // thread
+    if (log_start() < 0) {
+        craters_destroy(&rings);
+        return 1;
+    }
     Addr addr;
-    if (argc > 1) {
+    if (optind < argc) {
+        const char* hostname = argv[optind];
         if (addr_from_hostname(hostname, &addr) < 0) {
-            printf("Invalid host: %s\n", hostname);
+            LOG_ERROR("Invalid host: %s", hostname);
             return 1;
         }
-        printf("Listening on %s\n", hostname);
+        LOG_INFO("Listening on %s", hostname);
     } else {
         memset(&addr, 0, sizeof(addr));
         addr.port = 0;
         addr.host.s_addr = INADDR_ANY;
-        printf("Listening on random port\n");
+        LOG_INFO("Listening on random port");
     }
-    int ret = server_run(addr, c);
-    if (ret == 0) {
-        crater_start(c);
-    } else {
-        printf("Server run failed\n");
+    // kill -USR1 prints statistics
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // The vacuum runs on this thread's CPUs, and the accept loop on this
+    // thread
+    if (craters_start(&rings) < 0 || server_run(addr, &rings) < 0) {
+        LOG_ERROR("Server run failed");
     }
-    crater_destroy(c);
+    craters_destroy(&rings);
     return 0;
 }
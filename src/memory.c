@@ -0,0 +1,177 @@
+#include "memory.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#define MAX_NODES 1024
+
+#define SIZE_2M ((size_t)2 << 20)
+#define SIZE_1G ((size_t)1 << 30)
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+// Parses "default", "thp", "2m" or "1g".  Returns -1 if unrecognized.
+int memory_parse_pages(const char* s, PageSize* pages) {
+    if (strcmp(s, "default") == 0 || strcmp(s, "4k") == 0) {
+        *pages = PAGES_DEFAULT;
+    } else if (strcmp(s, "thp") == 0) {
+        *pages = PAGES_THP;
+    } else if (strcmp(s, "2m") == 0 || strcmp(s, "2M") == 0) {
+        *pages = PAGES_2M;
+    } else if (strcmp(s, "1g") == 0 || strcmp(s, "1G") == 0) {
+        *pages = PAGES_1G;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char* memory_pages_name(PageSize pages) {
+    switch (pages) {
+    case PAGES_THP:
+        return "transparent huge pages";
+    case PAGES_2M:
+        return "2 MB huge pages";
+    case PAGES_1G:
+        return "1 GB huge pages";
+    case PAGES_DEFAULT:
+    default:
+        return "default pages";
+    }
+}
+
+static void* memory_mmap(size_t size, int flags) {
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return (addr == MAP_FAILED) ? NULL : addr;
+}
+
+// Places the pages of [addr, addr + size) on node.  Must run before the
+// pages are first touched.
+static int memory_bind(void* addr, size_t size, int node) {
+#ifdef SYS_mbind
+    if (node < 0 || node >= MAX_NODES) {
+        return -1;
+    }
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(mask[0]))] |=
+        1UL << (node % (8 * sizeof(mask[0])));
+    if (syscall(SYS_mbind, addr, size, MPOL_BIND, mask,
+                (unsigned long)MAX_NODES, 0) < 0) {
+        perror("mbind failed: ");
+        return -1;
+    }
+    return 0;
+#else
+    printf("NUMA placement is not supported on this platform\n");
+    return -1;
+#endif
+}
+
+// Maps size bytes of zeroed memory as described by o.  Explicit huge pages
+// fall back to transparent huge pages when the kernel has none to give.
+// Returns -1 if the memory could not be mapped or locked.
+int memory_map(Mapping* m, size_t size, MemoryOptions o) {
+    memset(m, 0, sizeof(*m));
+    m->node = -1;
+    void* addr = NULL;
+    PageSize pages = o.pages;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (pages == PAGES_1G) {
+        size_t len = round_up(size, SIZE_1G);
+        addr = memory_mmap(len, MAP_HUGETLB | MAP_HUGE_1GB);
+        if (addr != NULL) {
+            size = len;
+            page = SIZE_1G;
+        } else {
+            printf("No 1 GB huge pages available, trying 2 MB\n");
+            pages = PAGES_2M;
+        }
+    }
+    if (addr == NULL && pages == PAGES_2M) {
+        size_t len = round_up(size, SIZE_2M);
+        addr = memory_mmap(len, MAP_HUGETLB | MAP_HUGE_2MB);
+        if (addr != NULL) {
+            size = len;
+            page = SIZE_2M;
+        } else {
+            printf("No 2 MB huge pages available, using transparent huge "
+                   "pages\n");
+            pages = PAGES_THP;
+        }
+    }
+    if (addr == NULL) {
+        if (pages == PAGES_THP) {
+            size = round_up(size, SIZE_2M);
+        } else {
+            size = round_up(size, page);
+        }
+        addr = memory_mmap(size, 0);
+        if (addr == NULL) {
+            perror("Failed to map ring memory: ");
+            return -1;
+        }
+        // Must be advised before first touch for the fault to use a huge page
+        if (pages == PAGES_THP && madvise(addr, size, MADV_HUGEPAGE) < 0) {
+            perror("madvise(MADV_HUGEPAGE) failed: ");
+        }
+    }
+
+    m->addr = addr;
+    m->size = size;
+    m->pages = pages;
+    if (o.node >= 0 && memory_bind(addr, size, o.node) < 0) {
+        printf("Failed to place ring memory on node %d\n", o.node);
+        memory_unmap(m);
+        return -1;
+    }
+    m->node = o.node;
+    if (o.prefault) {
+        volatile char* p = addr;
+        for (size_t off = 0; off < size; off += page) {
+            p[off] = 0;
+        }
+    }
+    if (o.lock) {
+        if (mlock(addr, size) < 0) {
+            perror("Failed to lock ring memory: ");
+            memory_unmap(m);
+            return -1;
+        }
+        m->locked = true;
+    }
+    return 0;
+}
+
+void memory_unmap(Mapping* m) {
+    if (m->addr == NULL) {
+        return;
+    }
+    if (m->locked) {
+        munlock(m->addr, m->size);
+    }
+    munmap(m->addr, m->size);
+    m->addr = NULL;
+    m->size = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// How ring memory is backed
+typedef enum {
+    PAGES_DEFAULT,
+    // Transparent huge pages, requested with madvise
+    PAGES_THP,
+    // Explicit hugetlbfs pages; fall back to PAGES_THP if none are free
+    PAGES_2M,
+    PAGES_1G
+} PageSize;
+
+typedef struct {
+    PageSize pages;
+    // Touch every page up front instead of faulting on first use
+    bool prefault;
+    // Pin the mapping in RAM
+    bool lock;
+    // NUMA node to place the pages on, or -1 for first-touch placement
+    int node;
+} MemoryOptions;
+
+// An anonymous mapping made by memory_map
+typedef struct {
+    void* addr;
+    size_t size;
+    PageSize pages;
+    bool locked;
+    // NUMA node the pages are bound to, or -1
+    int node;
+} Mapping;
+
+int memory_parse_pages(const char* s, PageSize* pages);
+const char* memory_pages_name(PageSize pages);
+int memory_map(Mapping* m, size_t size, MemoryOptions o);
+void memory_unmap(Mapping* m);
+
+#endif /* MEMORY_H */
@@ -3,18 +3,21 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "pool.h"
+
 // Initializes a Buffer
 void buffer_alloc(Buffer* b, size_t n) {
     b->len = 0;
     b->max = n;
-    b->buf = malloc(n * sizeof(*(b->buf)));
+    b->buf = pool_alloc(n * sizeof(*(b->buf)));
 }
 
 // Releases the Buffer's resources
 void buffer_free(Buffer* b) {
     b->len = 0;
     b->max = 0;
-    free(b->buf);
+    pool_free(b->buf);
+    b->buf = NULL;
 }
 
 // Reset the buffer indices
@@ -22,17 +25,25 @@ void buffer_reset(Buffer* b) {
     b->len = 0;
 }
 
-// Resizes the Buffer to max
+// Resizes the Buffer to max.  Stays in place while the block has room.
 int buffer_resize(Buffer* b, size_t max) {
     if (max == b->max) {
         return 0;
     }
-    char* buf = realloc(b->buf, max * sizeof(*buf));
+    if (max < b->len) {
+        b->len = max;
+    }
+    if (b->buf != NULL && max <= pool_capacity(b->buf)) {
+        b->max = max;
+        return 0;
+    }
+    char* buf = pool_alloc(max * sizeof(*buf));
     if (buf == NULL) {
         return -1;
     }
-    if (max < b->len) {
-        b->len = max;
+    if (b->buf != NULL) {
+        memcpy(buf, b->buf, b->len);
+        pool_free(b->buf);
     }
     b->buf = buf;
     b->max = max;
@@ -45,17 +56,55 @@ int buffer_grow(Buffer* b) {
 }
 
 // Writes bytes to the buffer
-int buffer_write(Buffer* b, char* data, size_t len) {
+int buffer_write(Buffer* b, const char* data, size_t len) {
     while (b->max - b->len < len) {
         if (buffer_grow(b) < 0) {
             return -1;
         }
     }
-    strncpy(&b->buf[len], data, len);
+    memcpy(&b->buf[b->len], data, len);
     b->len += len;
     return 0;
 }
 
+int buffer_write_uint8(Buffer* b, uint8_t val) {
+    return buffer_write(b, (const char*)&val, sizeof(val));
+}
+
+int buffer_write_uint64(Buffer* b, uint64_t val) {
+    return buffer_write(b, (const char*)&val, sizeof(val));
+}
+
+// Writes a transformer output patch: the output is the input with
+// [at, at + cut) replaced by data
+int buffer_write_patch(Buffer* b, uint64_t at, uint64_t cut, const char* data,
+                       size_t len) {
+    if (buffer_write_uint64(b, at) < 0 || buffer_write_uint64(b, cut) < 0) {
+        return -1;
+    }
+    return buffer_write(b, data, len);
+}
+
+// Overwrites a uint64_t previously written at offset at
+void buffer_put_uint64(Buffer* b, size_t at, uint64_t val) {
+    memcpy(&b->buf[at], &val, sizeof(val));
+}
+
+// Writes a message header with a placeholder length.  Returns the offset to
+// pass to buffer_end_message once the body has been written.
+size_t buffer_begin_message(Buffer* b, uint8_t mtype) {
+    size_t start = b->len;
+    buffer_write_uint64(b, 0);
+    buffer_write_uint8(b, mtype);
+    return start;
+}
+
+// Fills in the length of the message started at start
+void buffer_end_message(Buffer* b, size_t start) {
+    size_t body = b->len - start - sizeof(uint64_t) - sizeof(uint8_t);
+    buffer_put_uint64(b, start, body);
+}
+
 // Removes the first up_to bytes and moves the remainder to the beginning
 // of the buffer
 // TODO -- use a circular buffer for reads
@@ -143,6 +192,24 @@ size_t parse_message_header(const char* buf, size_t len, uint64_t* mlen,
     case MSG_CONFIGURE:
         *mtype = MSG_CONFIGURE;
         break;
+    case MSG_DATA:
+        *mtype = MSG_DATA;
+        break;
+    case MSG_COMMIT:
+        *mtype = MSG_COMMIT;
+        break;
+    case MSG_REPLICATE:
+        *mtype = MSG_REPLICATE;
+        break;
+    case MSG_REPLICATE_ACK:
+        *mtype = MSG_REPLICATE_ACK;
+        break;
+    case MSG_STATS:
+        *mtype = MSG_STATS;
+        break;
+    case MSG_REJECT:
+        *mtype = MSG_REJECT;
+        break;
     default:
         *mtype = MSG_UNKNOWN;
         break;
@@ -179,7 +246,292 @@ size_t parse_message_get_data(const char* buf, size_t len, GetDataMsg* m) {
     return r;
 }
 
-size_t parse_message_give_data(const char* buf, size_t len, GiveDataMsg* m) {
+// Prepares p to parse a GIVE_DATA body of body_len bytes
+void give_data_parser_init(GiveDataParser* p, uint64_t body_len) {
+    p->state = GDPARSE_IO;
+    p->io = SLOT_UNKNOWN;
+    p->n = 0;
+    p->i = 0;
+    p->remaining = body_len;
+    p->max_item = MSGMAXLEN;
+    p->item = (Buffer) { .buf = NULL, .len = 0, .max = 0 };
+    p->kind = ITEM_DATA;
+    p->keyed = false;
+    p->key = 0;
+}
+
+// Consumes as much of buf as possible, stopping after each completed item so
+// the caller can publish it.  *used is set to the number of bytes consumed;
+// unconsumed bytes must be presented again on the next call.  Fields are
+// never split across calls, only item payloads are.
+GiveDataParseEvent give_data_parser_feed(GiveDataParser* p, const char* buf,
+                                         size_t len, size_t* used) {
+    size_t r = 0;
+    if (len > p->remaining) {
+        len = p->remaining;
+    }
+    for (;;) {
+        switch (p->state) {
+        case GDPARSE_IO: {
+            uint8_t io = 0;
+            size_t n = parse_uint8(&buf[r], len - r, &io);
+            if (n == 0) {
+                goto need_more;
+            }
+            r += n;
+            p->remaining -= n;
+            p->io = map_slot_dest(io);
+            p->state = GDPARSE_COUNT;
+        }; break;
+
+        case GDPARSE_COUNT: {
+            size_t n = parse_uint64(&buf[r], len - r, &p->n);
+            if (n == 0) {
+                goto need_more;
+            }
+            r += n;
+            p->remaining -= n;
+            p->state = (p->n == 0) ? GDPARSE_DONE : GDPARSE_ITEM_LEN;
+        }; break;
+
+        case GDPARSE_ITEM_LEN: {
+            uint64_t dlen = 0;
+            size_t n = parse_uint64(&buf[r], len - r, &dlen);
+            if (n == 0) {
+                goto need_more;
+            }
+            r += n;
+            p->remaining -= n;
+            uint64_t flags = dlen & ~ITEM_LEN_MASK;
+            dlen &= ITEM_LEN_MASK;
+            // Only whole items are keyed
+            p->keyed = (flags == ITEM_FLAG_KEYED);
+            if (p->keyed) {
+                flags = 0;
+                if (p->remaining < sizeof(uint64_t)) {
+                    *used = r;
+                    return GDEVENT_ERROR;
+                }
+            }
+            if (dlen > p->remaining - (p->keyed ? sizeof(uint64_t) : 0)) {
+                *used = r;
+                return GDEVENT_ERROR;
+            }
+            if (dlen > p->max_item) {
+                *used = r;
+                return GDEVENT_TOO_LARGE;
+            }
+            if (flags == ITEM_FLAG_SAME) {
+                if (dlen != 0) {
+                    *used = r;
+                    return GDEVENT_ERROR;
+                }
+                p->kind = ITEM_SAME;
+                p->item = (Buffer) { .buf = NULL, .len = 0, .max = 0 };
+                p->i++;
+                p->state = (p->i == p->n) ? GDPARSE_DONE : GDPARSE_ITEM_LEN;
+                *used = r;
+                return GDEVENT_ITEM;
+            } else if (flags == ITEM_FLAG_PATCH) {
+                if (dlen < PATCHPREFIX) {
+                    *used = r;
+                    return GDEVENT_ERROR;
+                }
+                p->kind = ITEM_PATCH;
+            } else if (flags == 0) {
+                p->kind = ITEM_DATA;
+            } else {
+                *used = r;
+                return GDEVENT_ERROR;
+            }
+            buffer_alloc(&p->item, dlen);
+            p->state = p->keyed ? GDPARSE_ITEM_KEY : GDPARSE_ITEM_DATA;
+        }; break;
+
+        case GDPARSE_ITEM_KEY: {
+            size_t n = parse_uint64(&buf[r], len - r, &p->key);
+            if (n == 0) {
+                goto need_more;
+            }
+            r += n;
+            p->remaining -= n;
+            p->state = GDPARSE_ITEM_DATA;
+        }; break;
+
+        case GDPARSE_ITEM_DATA: {
+            size_t want = p->item.max - p->item.len;
+            size_t have = len - r;
+            size_t n = (have < want) ? have : want;
+            memcpy(&p->item.buf[p->item.len], &buf[r], n);
+            p->item.len += n;
+            r += n;
+            p->remaining -= n;
+            if (p->item.len < p->item.max) {
+                goto need_more;
+            }
+            p->i++;
+            p->state = (p->i == p->n) ? GDPARSE_DONE : GDPARSE_ITEM_LEN;
+            *used = r;
+            return GDEVENT_ITEM;
+        }; break;
+
+        case GDPARSE_DONE:
+            *used = r;
+            // Trailing bytes or a short body mean the frame is malformed
+            return (p->remaining == 0) ? GDEVENT_DONE : GDEVENT_ERROR;
+        }
+    }
+
+need_more:
+    *used = r;
+    if (p->remaining == 0) {
+        // The frame ended before all of its declared items
+        return GDEVENT_ERROR;
+    }
+    return GDEVENT_NEED_MORE;
+}
+
+// Releases a partially parsed item, if any
+void give_data_parser_destroy(GiveDataParser* p) {
+    buffer_free(&p->item);
+    p->state = GDPARSE_DONE;
+    p->remaining = 0;
+}
+
+static FilterOp map_filter_op(uint8_t op) {
+    switch (op) {
+    case FILTER_NONE:
+    case FILTER_EQUAL:
+    case FILTER_NOT_EQUAL:
+    case FILTER_LESS:
+    case FILTER_GREATER:
+    case FILTER_CONTAINS:
+        return (FilterOp)op;
+    default:
+        return FILTER_UNKNOWN;
+    }
+}
+
+static StartPosition map_start_position(uint8_t start) {
+    switch (start) {
+    case START_DEFAULT:
+    case START_EARLIEST:
+    case START_LATEST:
+    case START_AT:
+        return (StartPosition)start;
+    default:
+        return START_UNKNOWN;
+    }
+}
+
+// Parses a CONFIGURE body: the actor type, optionally followed by a filter
+// (op, offset, value length, value; FILTER_NONE for none), optionally
+// followed by a start position (u8, u64 slot), optionally followed by a
+// ring name (u64 length, name; 0 for the first ring), optionally followed
+// by a consumer name (u64 length, name).  m->filter.value, m->ring and
+// m->name are owned by m.
+size_t parse_message_configure(const char* buf, size_t len, ConfigureMessage* m) {
+    m->filter = (Filter) {
+        .op = FILTER_NONE, .offset = 0, .len = 0, .value = NULL
+    };
+    m->start = START_DEFAULT;
+    m->start_slot = 0;
+    m->ring = NULL;
+    m->name = NULL;
+    uint8_t actor_type = 0;
+    size_t r = parse_uint8(buf, len, &actor_type);
+    if (r == 0) {
+        return 0;
+    }
+    m->actor_type = actor_type;
+    if (r == len) {
+        return r;
+    }
+
+    uint8_t op = 0;
+    size_t n = parse_uint8(&buf[r], len - r, &op);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+    uint64_t offset = 0;
+    n = parse_uint64(&buf[r], len - r, &offset);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+    uint64_t vlen = 0;
+    n = parse_uint64(&buf[r], len - r, &vlen);
+    if (n == 0 || len - r - n < vlen) {
+        return 0;
+    }
+    r += n;
+    m->filter.op = map_filter_op(op);
+    if (m->filter.op == FILTER_UNKNOWN) {
+        return 0;
+    }
+    m->filter.offset = offset;
+    m->filter.len = vlen;
+    m->filter.value = malloc(vlen + 1);
+    memcpy(m->filter.value, &buf[r], vlen);
+    r += vlen;
+    if (r == len) {
+        return r;
+    }
+
+    uint8_t start = 0;
+    n = parse_uint8(&buf[r], len - r, &start);
+    size_t k = (n == 0) ? 0 : parse_uint64(&buf[r + n], len - r - n,
+                                           &m->start_slot);
+    m->start = map_start_position(start);
+    if (k == 0 || m->start == START_UNKNOWN) {
+        configure_msg_destroy(m);
+        return 0;
+    }
+    r += n + k;
+    if (r == len) {
+        return r;
+    }
+
+    uint64_t rlen = 0;
+    n = parse_uint64(&buf[r], len - r, &rlen);
+    if (n == 0 || rlen > RINGNAMEMAX || len - r - n < rlen) {
+        configure_msg_destroy(m);
+        return 0;
+    }
+    r += n;
+    if (rlen > 0) {
+        m->ring = malloc(rlen + 1);
+        memcpy(m->ring, &buf[r], rlen);
+        m->ring[rlen] = '\0';
+    }
+    r += rlen;
+    if (r == len) {
+        return r;
+    }
+
+    uint64_t nlen = 0;
+    n = parse_uint64(&buf[r], len - r, &nlen);
+    if (n == 0 || nlen == 0 || nlen > CONSUMERNAMEMAX ||
+        len - r - n < nlen || memchr(&buf[r + n], '\0', nlen) != NULL) {
+        configure_msg_destroy(m);
+        return 0;
+    }
+    r += n;
+    m->name = malloc(nlen + 1);
+    memcpy(m->name, &buf[r], nlen);
+    m->name[nlen] = '\0';
+    r += nlen;
+    return r;
+}
+
+size_t parse_message_commit(const char* buf, size_t len, CommitMsg* m) {
+    return parse_uint64(buf, len, &m->slot);
+}
+
+// Parses a MSG_DATA body, checking that every item lies within buf.
+// Returns the number of bytes parsed, or 0 if buf is short or malformed.
+size_t parse_message_data(const char* buf, size_t len, DataMsg* m) {
     size_t r = 0;
     uint8_t io = 0;
     size_t n = parse_uint8(buf, len, &io);
@@ -188,6 +540,27 @@ size_t parse_message_give_data(const char* buf, size_t len, GiveDataMsg* m) {
     }
     r += n;
 
+    uint8_t flags = 0;
+    n = parse_uint8(&buf[r], len - r, &flags);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+
+    uint64_t first = 0;
+    n = parse_uint64(&buf[r], len - r, &first);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+
+    uint64_t end = 0;
+    n = parse_uint64(&buf[r], len - r, &end);
+    if (n == 0 || end < first) {
+        return 0;
+    }
+    r += n;
+
     uint64_t count = 0;
     n = parse_uint64(&buf[r], len - r, &count);
     if (n == 0) {
@@ -195,56 +568,209 @@ size_t parse_message_give_data(const char* buf, size_t len, GiveDataMsg* m) {
     }
     r += n;
 
-    SlotData* data = malloc(count * sizeof(*data));
+    size_t items = r;
+    size_t prefix = (flags & DATA_SLOTTED) ? sizeof(uint64_t) : 0;
     for (uint64_t i = 0; i < count; i++) {
         uint64_t dlen = 0;
+        if (len - r < prefix) {
+            return 0;
+        }
+        r += prefix;
         n = parse_uint64(&buf[r], len - r, &dlen);
-        if (n == 0) {
-            free(data);
+        if (n == 0 || len - r - n < dlen) {
             return 0;
         }
-        r += n;
-        data[i].len = dlen;
+        r += n + dlen;
+    }
 
-        char* buf = malloc(dlen * sizeof(*buf));
-        if (len - r < dlen) {
-            free(data);
+    m->io = map_slot_dest(io);
+    m->flags = flags;
+    m->first = first;
+    m->end = end;
+    m->n = count;
+    m->items = &buf[items];
+    m->len = r - items;
+    m->off = 0;
+    m->next = first;
+    return r;
+}
+
+// Points item at the next item of m and sets *slot to its slot number.
+// Returns 0 when there are no more.
+int data_msg_next(DataMsg* m, SlotData* item, uint64_t* slot) {
+    if (m->off >= m->len) {
+        return 0;
+    }
+    if (m->flags & DATA_SLOTTED) {
+        m->off += parse_uint64(&m->items[m->off], m->len - m->off, &m->next);
+    }
+    *slot = m->next++;
+    uint64_t dlen = 0;
+    m->off += parse_uint64(&m->items[m->off], m->len - m->off, &dlen);
+    item->len = dlen;
+    item->buf = (char*)&m->items[m->off];
+    m->off += dlen;
+    return 1;
+}
+
+// Parses a MSG_REPLICATE body, checking that every record lies within buf.
+// Returns the number of bytes parsed, or 0 if buf is short or malformed.
+size_t parse_message_replicate(const char* buf, size_t len, ReplicateMsg* m) {
+    size_t r = 0;
+    uint8_t flags = 0;
+    size_t n = parse_uint8(buf, len, &flags);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+
+    uint64_t count = 0;
+    n = parse_uint64(&buf[r], len - r, &count);
+    if (n == 0) {
+        return 0;
+    }
+    r += n;
+
+    size_t records = r;
+    const size_t prefix = sizeof(uint8_t) + sizeof(uint64_t);
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t dlen = 0;
+        if (len - r < prefix) {
+            return 0;
+        }
+        r += prefix;
+        n = parse_uint64(&buf[r], len - r, &dlen);
+        if (n == 0 || len - r - n < dlen) {
             return 0;
         }
-        strncpy(buf, &buf[r], dlen);
-        r += dlen;
-        data[i].buf = buf;
+        r += n + dlen;
     }
 
-    m->io = map_slot_dest(io);
+    m->flags = flags;
     m->n = count;
-    m->data = data;
+    m->records = &buf[records];
+    m->len = r - records;
+    m->off = 0;
     return r;
 }
 
-size_t parse_message_configure(const char* buf, size_t len, ConfigureMessage* m) {
-    printf("Parsing configure message of len %llu\n", (long long unsigned)len);
-    uint8_t actor_type = 0;
-    size_t n = parse_uint8(buf, len, &actor_type);
+// Points data at the next record of m.  Returns 0 when there are no more.
+int replicate_msg_next(ReplicateMsg* m, uint8_t* io, uint64_t* slot,
+                       SlotData* data) {
+    if (m->off >= m->len) {
+        return 0;
+    }
+    m->off += parse_uint8(&m->records[m->off], m->len - m->off, io);
+    m->off += parse_uint64(&m->records[m->off], m->len - m->off, slot);
+    uint64_t dlen = 0;
+    m->off += parse_uint64(&m->records[m->off], m->len - m->off, &dlen);
+    data->len = dlen;
+    data->buf = (char*)&m->records[m->off];
+    m->off += dlen;
+    return 1;
+}
+
+size_t parse_message_replicate_ack(const char* buf, size_t len,
+                                   ReplicateAckMsg* m) {
+    size_t n = parse_uint64(buf, len, &m->input);
     if (n == 0) {
         return 0;
     }
-    m->actor_type = actor_type;
-    return n;
+    size_t r = parse_uint64(&buf[n], len - n, &m->output);
+    return (r == 0) ? 0 : n + r;
 }
 
-void get_data_msg_destroy(GetDataMsg* m) {
-    m->io = SLOT_UNKNOWN;
-    m->max_type = GDMAX_UNKNOWN;
-    m->max = 0;
+size_t parse_message_reject(const char* buf, size_t len, RejectMsg* m) {
+    size_t n = parse_uint64(buf, len, &m->item);
+    if (n == 0) {
+        return 0;
+    }
+    size_t r = parse_uint64(&buf[n], len - n, &m->len);
+    return (r == 0) ? 0 : n + r;
 }
 
-void give_data_msg_destroy(GiveDataMsg* m) {
-    for (uint64_t i = 0; i < m->n; i++) {
-        free(m->data[i].buf);
+// Parses a MSG_STATS reply body.  Returns the number of bytes parsed, or 0
+// if buf is short or malformed.
+size_t parse_message_stats(const char* buf, size_t len, StatsMsg* m) {
+    size_t r = 0;
+    uint64_t fields[3];
+    for (int i = 0; i < 3; i++) {
+        size_t n = parse_uint64(&buf[r], len - r, &fields[i]);
+        if (n == 0) {
+            return 0;
+        }
+        r += n;
+    }
+    if (fields[2] > (len - r) / STATSRECORDLEN) {
+        return 0;
+    }
+    m->produced = fields[0];
+    m->reclaimed = fields[1];
+    m->n = fields[2];
+    m->actors = &buf[r];
+    m->len = m->n * STATSRECORDLEN;
+    m->off = 0;
+    return r + m->len;
+}
+
+// Fills a with the next actor of m.  Returns 0 when there are no more.
+int stats_msg_next(StatsMsg* m, ActorStats* a) {
+    if (m->off >= m->len) {
+        return 0;
+    }
+    const char* p = &m->actors[m->off];
+    size_t n = m->len - m->off;
+    uint8_t type = 0;
+    size_t r = parse_uint8(p, n, &type);
+    a->type = (ActorType)type;
+    uint64_t* fields[] = {
+        &a->index, &a->cursor, &a->lag, &a->items, &a->bytes,
+        &a->requests, &a->empty_polls, &a->stalls
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        r += parse_uint64(&p[r], n - r, fields[i]);
+    }
+    m->off += r;
+    return 1;
+}
+
+// 64-bit FNV-1a of a key, which producers in any language can compute to
+// route it the way libcrater-client does
+uint64_t key_hash(const char* key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 0x100000001b3ULL;
     }
-    free(m->data);
-    m->data = NULL;
-    m->n = 0;
+    return h;
+}
+
+// Partition of a stream of partitions rings that items keyed with hash
+// belong to
+uint64_t key_partition(uint64_t hash, uint64_t partitions) {
+    return hash % partitions;
+}
+
+// Writes the ring name of one partition of stream to out, which holds
+// RINGNAMEMAX + 1 bytes.  Returns -1 if the name is too long.
+int partition_name(char* out, const char* stream, uint64_t partition) {
+    int n = snprintf(out, RINGNAMEMAX + 1, "%s.%llu", stream,
+                     (long long unsigned)partition);
+    return (n < 0 || n > RINGNAMEMAX) ? -1 : 0;
+}
+
+void configure_msg_destroy(ConfigureMessage* m) {
+    free(m->filter.value);
+    m->filter.value = NULL;
+    m->filter.op = FILTER_NONE;
+    free(m->ring);
+    m->ring = NULL;
+    free(m->name);
+    m->name = NULL;
+}
+
+void get_data_msg_destroy(GetDataMsg* m) {
     m->io = SLOT_UNKNOWN;
+    m->max_type = GDMAX_UNKNOWN;
+    m->max = 0;
 }
@@ -1,6 +1,7 @@
 #ifndef MESSAGES_H
 #define MESSAGES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -17,13 +18,26 @@ void buffer_free(Buffer* b);
 int buffer_resize(Buffer* b, size_t max);
 int buffer_grow(Buffer* b);
 void buffer_reset(Buffer* b);
-int buffer_write(Buffer* b, char* data, size_t len);
+int buffer_write(Buffer* b, const char* data, size_t len);
+int buffer_write_uint8(Buffer* b, uint8_t val);
+int buffer_write_uint64(Buffer* b, uint64_t val);
+int buffer_write_patch(Buffer* b, uint64_t at, uint64_t cut, const char* data,
+                       size_t len);
 void buffer_strip(Buffer* b, size_t up_to);
+size_t buffer_begin_message(Buffer* b, uint8_t mtype);
+void buffer_end_message(Buffer* b, size_t start);
+void buffer_put_uint64(Buffer* b, size_t at, uint64_t val);
 
 typedef enum {
     MSG_GET_DATA,
     MSG_GIVE_DATA,
     MSG_CONFIGURE,
+    MSG_DATA,
+    MSG_COMMIT,
+    MSG_REPLICATE,
+    MSG_REPLICATE_ACK,
+    MSG_STATS,
+    MSG_REJECT,
     MSG_UNKNOWN = 0xFF
 } MessageType;
 
@@ -51,29 +65,240 @@ typedef struct {
     char* buf;
 } SlotData;
 
+// Consumer-side predicate evaluated by the server before an item is sent.
+// Comparisons are bytewise (memcmp order) against the value at offset;
+// items too short to hold the field never match.
+typedef enum {
+    FILTER_NONE,
+    FILTER_EQUAL,
+    FILTER_NOT_EQUAL,
+    FILTER_LESS,
+    FILTER_GREATER,
+    // Value appears anywhere at or after offset
+    FILTER_CONTAINS,
+    FILTER_UNKNOWN = 0xFF
+} FilterOp;
+
+typedef struct {
+    FilterOp op;
+    uint64_t offset;
+    uint64_t len;
+    char* value;
+} Filter;
+
+// A transformer may send an output item by reference to its input by
+// setting one of these bits in the item's GIVE_DATA length word.  A patch
+// body is u64 at, u64 cut, then the bytes replacing input[at, at + cut).
+#define ITEM_FLAG_SAME ((uint64_t)1 << 63) /* Output equals input; no body */
+#define ITEM_FLAG_PATCH ((uint64_t)1 << 62)
+// A producer may tag an input item with the hash of its key.  The length
+// word is then followed by the u64 hash, ahead of the body it counts.
+#define ITEM_FLAG_KEYED ((uint64_t)1 << 61)
+#define ITEM_LEN_MASK (ITEM_FLAG_KEYED - 1)
+#define PATCHPREFIX (2 * sizeof(uint64_t))
+
+typedef enum {
+    ITEM_DATA,
+    ITEM_SAME,
+    ITEM_PATCH
+} ItemKind;
+
+// Result of a transform callback, in libcrater-client or a stage plugin.
+// Negative values stop the transformer.
+typedef enum {
+    // out holds the output
+    TRANSFORM_OUTPUT,
+    // Output equals input; out is ignored
+    TRANSFORM_SAME,
+    // out holds a patch written by buffer_write_patch
+    TRANSFORM_PATCH
+} TransformResult;
+
+// MSG_DATA flags
+#define DATA_SLOTTED 0x01 /* Each item is preceded by its slot number */
+
 typedef struct {
     SlotDestination io;
     GetDataMaxType max_type;
     uint64_t max;
 } GetDataMsg;
 
+// Reply to GET_DATA.  Items are not copied out of the parsed buffer; they
+// are walked in place with data_msg_next and live as long as that buffer.
+// The reply leases [first, end); items holds the n of those slots that
+// passed the consumer's filter, which is all of them without one.
+typedef struct {
+    SlotDestination io;
+    uint8_t flags;
+    uint64_t first;
+    uint64_t end;
+    uint64_t n;
+    const char* items;
+    size_t len;
+    size_t off;
+    uint64_t next;
+} DataMsg;
+
+// Replication batch from a primary.  Like DataMsg, records are walked in
+// place with replicate_msg_next.
+typedef struct {
+    uint8_t flags;
+    uint64_t n;
+    const char* records;
+    size_t len;
+    size_t off;
+} ReplicateMsg;
+
+typedef struct {
+    uint64_t input;
+    uint64_t output;
+} ReplicateAckMsg;
+
+// Sent to a producer for an item the ring refused because its byte budget
+// was spent (crater -x).  Only that item is skipped, and the connection
+// stays open.  item numbers the items given on the connection from 0,
+// refused ones included.
 typedef struct {
+    uint64_t item;
+    uint64_t len;
+} RejectMsg;
+
+// Counters and lag of one actor in a MSG_STATS reply
+typedef struct {
+    ActorType type;
+    // Connection order among consumers, 0 otherwise
+    uint64_t index;
+    uint64_t cursor;
+    // Slots the actor is behind the producer.  For the producer, slots the
+    // ring holds.
+    uint64_t lag;
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t requests;
+    uint64_t empty_polls;
+    uint64_t stalls;
+} ActorStats;
+
+// A MSG_STATS request has no body.  The reply carries the producer's and
+// the vacuum's cursors, then n records of u8 type and eight u64s in
+// ActorStats order, walked in place with stats_msg_next.
+typedef struct {
+    uint64_t produced;
+    uint64_t reclaimed;
+    uint64_t n;
+    const char* actors;
+    size_t len;
+    size_t off;
+} StatsMsg;
+
+#define STATSRECORDLEN (sizeof(uint8_t) + 8 * sizeof(uint64_t))
+
+// Longest ring name a CONFIGURE may carry
+#define RINGNAMEMAX 64
+// Longest consumer name a CONFIGURE may carry
+#define CONSUMERNAMEMAX 64
+
+// A partitioned stream is served as rings named stream.0 to stream.K-1,
+// with K at most PARTITIONSMAX.  Keyed items belong to partition
+// key_partition(hash, K), so every item of a key is read in order.
+#define PARTITIONSMAX 64
+
+// Releases every leased slot below slot back to the ring
+typedef struct {
+    uint64_t slot;
+} CommitMsg;
+
+// Incremental GIVE_DATA body parser.  Items are surfaced one at a time as
+// their bytes arrive, so a large frame never has to be buffered whole.
+typedef enum {
+    GDPARSE_IO,
+    GDPARSE_COUNT,
+    GDPARSE_ITEM_LEN,
+    GDPARSE_ITEM_KEY,
+    GDPARSE_ITEM_DATA,
+    GDPARSE_DONE
+} GiveDataParseState;
+
+typedef enum {
+    GDEVENT_NEED_MORE,
+    GDEVENT_ITEM,
+    GDEVENT_DONE,
+    GDEVENT_ERROR,
+    // An item is larger than max_item
+    GDEVENT_TOO_LARGE
+} GiveDataParseEvent;
+
+typedef struct {
+    GiveDataParseState state;
     SlotDestination io;
+    // Number of items in the message and index of the current one
     uint64_t n;
-    SlotData* data;
-} GiveDataMsg;
+    uint64_t i;
+    // Body bytes not yet consumed
+    uint64_t remaining;
+    // Items larger than this are refused before being buffered
+    uint64_t max_item;
+    // Item being filled; ownership passes to the caller on GDEVENT_ITEM.
+    // ITEM_SAME items have no buffer.
+    Buffer item;
+    ItemKind kind;
+    // Whether the item carried a key hash, and the hash
+    bool keyed;
+    uint64_t key;
+} GiveDataParser;
+
+// Where a consumer starts reading.  Slots that have left the ring are read
+// back from the journal, if there is one.
+typedef enum {
+    // The cursor saved under its name, else the oldest slot in the ring
+    START_DEFAULT,
+    // The oldest slot held, in the journal or the ring
+    START_EARLIEST,
+    // The next slot to be produced
+    START_LATEST,
+    // An explicit slot, or the oldest held if that is gone
+    START_AT,
+    START_UNKNOWN = 0xFF
+} StartPosition;
 
 typedef struct {
     ActorType actor_type;
-    // TODO -- actor group -- use string name (easiest for config)?
+    // Optional, consumers only
+    Filter filter;
+    StartPosition start;
+    uint64_t start_slot;
+    // Ring to join, by name; NULL for the server's first ring
+    char* ring;
+    // Consumers only: name its cursor is saved under, so that a consumer
+    // joining later with the same name resumes there; NULL for none
+    char* name;
 } ConfigureMessage;
 
 size_t parse_message_header(const char* buf, size_t len, uint64_t* mlen, MessageType* mtype);
 size_t parse_message_get_data(const char* buf, size_t len, GetDataMsg* m);
-size_t parse_message_give_data(const char* buf, size_t len, GiveDataMsg* m);
 size_t parse_message_configure(const char* buf, size_t len, ConfigureMessage* m);
+size_t parse_message_commit(const char* buf, size_t len, CommitMsg* m);
+size_t parse_message_data(const char* buf, size_t len, DataMsg* m);
+int data_msg_next(DataMsg* m, SlotData* item, uint64_t* slot);
+size_t parse_message_replicate(const char* buf, size_t len, ReplicateMsg* m);
+int replicate_msg_next(ReplicateMsg* m, uint8_t* io, uint64_t* slot,
+                       SlotData* data);
+size_t parse_message_replicate_ack(const char* buf, size_t len,
+                                   ReplicateAckMsg* m);
+size_t parse_message_stats(const char* buf, size_t len, StatsMsg* m);
+size_t parse_message_reject(const char* buf, size_t len, RejectMsg* m);
+int stats_msg_next(StatsMsg* m, ActorStats* a);
+
+void give_data_parser_init(GiveDataParser* p, uint64_t body_len);
+GiveDataParseEvent give_data_parser_feed(GiveDataParser* p, const char* buf,
+                                         size_t len, size_t* used);
+void give_data_parser_destroy(GiveDataParser* p);
+
+uint64_t key_hash(const char* key, size_t len);
+uint64_t key_partition(uint64_t hash, uint64_t partitions);
+int partition_name(char* out, const char* stream, uint64_t partition);
 
+void configure_msg_destroy(ConfigureMessage* m);
 void get_data_msg_destroy(GetDataMsg* m);
-void give_data_msg_destroy(GiveDataMsg* m);
 
 #endif /* MESSAGES_H */
@@ -0,0 +1,225 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crater.h"
+#include "latency.h"
+
+static uint64_t metrics_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void metrics_read(Actor* a, uint64_t index, uint64_t lag,
+                         ActorStats* s) {
+    s->type = a->type;
+    s->index = index;
+    s->cursor = actor_slot(a);
+    s->lag = lag;
+    s->items = ACTOR_METRIC_READ(a, items);
+    s->bytes = ACTOR_METRIC_READ(a, bytes);
+    s->requests = ACTOR_METRIC_READ(a, requests);
+    s->empty_polls = ACTOR_METRIC_READ(a, empty_polls);
+    s->stalls = ACTOR_METRIC_READ(a, stalls);
+}
+
+// Fills out with up to max actors: the producer, the transformer, then the
+// consumers in connection order.  Returns how many actors there are, which
+// may be more than max.
+size_t metrics_collect(Crater* c, ActorStats* out, size_t max) {
+    uint64_t produced = actor_slot(&c->producer);
+    size_t n = 0;
+    if (c->config.have_producer) {
+        uint64_t held = produced - actor_slot(&c->vacuum);
+        if (n < max) {
+            metrics_read(&c->producer, 0, held, &out[n]);
+        }
+        n++;
+    }
+    if (c->config.have_transformer) {
+        uint64_t t = actor_slot(&c->transformer);
+        if (n < max) {
+            metrics_read(&c->transformer, 0, produced - t, &out[n]);
+        }
+        n++;
+    }
+    if (!crater_consumers_stable(c)) {
+        return n;
+    }
+    size_t n_consumers = actors_len(&c->consumers);
+    for (size_t i = 0; i < n_consumers; i++) {
+        Actor* a = c->consumers.i[i];
+        uint64_t slot = actor_slot(a);
+        if (n < max) {
+            metrics_read(a, i, (produced > slot) ? produced - slot : 0,
+                         &out[n]);
+        }
+        n++;
+    }
+    return n;
+}
+
+static size_t metrics_collect_all(Crater* c, ActorStats** out) {
+    size_t max = 2 + actors_len(&c->consumers);
+    *out = malloc(max * sizeof(**out));
+    if (*out == NULL) {
+        return 0;
+    }
+    size_t n = metrics_collect(c, *out, max);
+    return (n < max) ? n : max;
+}
+
+// Writes a MSG_STATS reply to wbuf
+void metrics_write_stats(Crater* c, Buffer* wbuf) {
+    ActorStats* a = NULL;
+    size_t n = metrics_collect_all(c, &a);
+    size_t start = buffer_begin_message(wbuf, MSG_STATS);
+    buffer_write_uint64(wbuf, actor_slot(&c->producer));
+    buffer_write_uint64(wbuf, actor_slot(&c->vacuum));
+    buffer_write_uint64(wbuf, n);
+    for (size_t i = 0; i < n; i++) {
+        buffer_write_uint8(wbuf, a[i].type);
+        buffer_write_uint64(wbuf, a[i].index);
+        buffer_write_uint64(wbuf, a[i].cursor);
+        buffer_write_uint64(wbuf, a[i].lag);
+        buffer_write_uint64(wbuf, a[i].items);
+        buffer_write_uint64(wbuf, a[i].bytes);
+        buffer_write_uint64(wbuf, a[i].requests);
+        buffer_write_uint64(wbuf, a[i].empty_polls);
+        buffer_write_uint64(wbuf, a[i].stalls);
+    }
+    buffer_end_message(wbuf, start);
+    free(a);
+}
+
+static const char* metrics_actor_name(ActorType t) {
+    switch (t) {
+    case ACTOR_PRODUCER:
+        return "producer";
+    case ACTOR_TRANSFORMER:
+        return "transformer";
+    case ACTOR_CONSUMER:
+        return "consumer";
+    default:
+        return "unknown";
+    }
+}
+
+// Prints one line per actor.  rates, if given, holds items per second.
+void metrics_print(const ActorStats* a, size_t n, const double* rates,
+                   FILE* f) {
+    fprintf(f, "%-14s %12s %8s %12s %14s %10s %10s %8s %12s\n", "actor",
+            "cursor", "lag", "items", "bytes", "requests", "empty",
+            "stalls", "items/s");
+    for (size_t i = 0; i < n; i++) {
+        char name[32];
+        if (a[i].type == ACTOR_CONSUMER) {
+            snprintf(name, sizeof(name), "%s %llu",
+                     metrics_actor_name(a[i].type),
+                     (long long unsigned)a[i].index);
+        } else {
+            snprintf(name, sizeof(name), "%s", metrics_actor_name(a[i].type));
+        }
+        fprintf(f, "%-14s %12llu %8llu %12llu %14llu %10llu %10llu %8llu ",
+                name, (long long unsigned)a[i].cursor,
+                (long long unsigned)a[i].lag, (long long unsigned)a[i].items,
+                (long long unsigned)a[i].bytes,
+                (long long unsigned)a[i].requests,
+                (long long unsigned)a[i].empty_polls,
+                (long long unsigned)a[i].stalls);
+        if (rates != NULL) {
+            fprintf(f, "%12.0f\n", rates[i]);
+        } else {
+            fprintf(f, "%12s\n", "-");
+        }
+    }
+}
+
+static void metrics_merge_latency(LatencyHistogram* into, Actor* a,
+                                  LatencyStage s) {
+    ActorLatency* l = __atomic_load_n(&a->latency, __ATOMIC_ACQUIRE);
+    if (l != NULL) {
+        latency_merge(into, &l->stage[s]);
+    }
+}
+
+// Prints each stage's latency, merged over every actor recording it, if
+// the crater traces slots
+void metrics_print_latency(Crater* c, FILE* f) {
+    if (c->trace_every == 0) {
+        return;
+    }
+    LatencyHistogram* h = calloc(LATENCY_STAGES, sizeof(*h));
+    if (h == NULL) {
+        return;
+    }
+    metrics_merge_latency(&h[LATENCY_TRANSFORM], &c->transformer,
+                          LATENCY_TRANSFORM);
+    if (crater_consumers_stable(c)) {
+        size_t n = actors_len(&c->consumers);
+        for (size_t i = 0; i < n; i++) {
+            Actor* a = c->consumers.i[i];
+            metrics_merge_latency(&h[LATENCY_DELIVER], a, LATENCY_DELIVER);
+            metrics_merge_latency(&h[LATENCY_END_TO_END], a,
+                                  LATENCY_END_TO_END);
+        }
+    }
+    latency_print("input->output", &h[LATENCY_TRANSFORM], f);
+    latency_print("output->read", &h[LATENCY_DELIVER], f);
+    latency_print("end-to-end", &h[LATENCY_END_TO_END], f);
+    free(h);
+}
+
+void metrics_dump_init(MetricsDump* d, uint64_t interval_usec) {
+    memset(d, 0, sizeof(*d));
+    d->interval_usec = interval_usec;
+    d->last_usec = metrics_now_usec();
+}
+
+// Prints every actor's metrics if the interval has passed.  Only the vacuum
+// thread calls this.
+void metrics_dump_poll(MetricsDump* d, Crater* c, FILE* f) {
+    if (d->interval_usec == 0) {
+        return;
+    }
+    uint64_t now = metrics_now_usec();
+    if (now - d->last_usec < d->interval_usec) {
+        return;
+    }
+    ActorStats* a = NULL;
+    size_t n = metrics_collect_all(c, &a);
+    double* rates = calloc(n + 1, sizeof(*rates));
+    if (n > d->n_last) {
+        uint64_t* last = realloc(d->last_items, n * sizeof(*last));
+        if (last != NULL) {
+            memset(&last[d->n_last], 0, (n - d->n_last) * sizeof(*last));
+            d->last_items = last;
+            d->n_last = n;
+        }
+    }
+    double secs = (double)(now - d->last_usec) / 1e6;
+    for (size_t i = 0; i < n && i < d->n_last; i++) {
+        if (rates != NULL) {
+            rates[i] = (double)(a[i].items - d->last_items[i]) / secs;
+        }
+        d->last_items[i] = a[i].items;
+    }
+    fprintf(f, "metrics %s: produced %llu, reclaimed %llu\n", c->name,
+            (long long unsigned)actor_slot(&c->producer),
+            (long long unsigned)actor_slot(&c->vacuum));
+    metrics_print(a, n, rates, f);
+    metrics_print_latency(c, f);
+    fflush(f);
+    free(rates);
+    free(a);
+    d->last_usec = now;
+}
+
+void metrics_dump_destroy(MetricsDump* d) {
+    free(d->last_items);
+    d->last_items = NULL;
+    d->n_last = 0;
+}
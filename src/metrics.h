@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "messages.h"
+
+// Per-actor throughput and lag.
+//
+// Every actor counts items, bytes, requests, empty polls and stalls in its
+// ActorMetrics, written only by the thread driving it.  Readers take the
+// counters as they find them and add each actor's lag behind the producer.
+// They are served to clients as a MSG_STATS reply and, every interval, by
+// the vacuum to stdout along with each actor's rate since the last dump.
+
+struct Crater;
+
+typedef struct {
+    // 0 disables the dump
+    uint64_t interval_usec;
+    uint64_t last_usec;
+    // Items per actor at the last dump, in report order
+    uint64_t* last_items;
+    size_t n_last;
+} MetricsDump;
+
+size_t metrics_collect(struct Crater* c, ActorStats* out, size_t max);
+void metrics_write_stats(struct Crater* c, Buffer* wbuf);
+void metrics_print(const ActorStats* a, size_t n, const double* rates,
+                   FILE* f);
+void metrics_print_latency(struct Crater* c, FILE* f);
+
+void metrics_dump_init(MetricsDump* d, uint64_t interval_usec);
+void metrics_dump_poll(MetricsDump* d, struct Crater* c, FILE* f);
+void metrics_dump_destroy(MetricsDump* d);
+
+#endif /* METRICS_H */
@@ -0,0 +1,240 @@
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define CACHELINE 64
+// Payload bytes each class may keep cached before frees go to the heap
+#define POOL_CACHE_BYTES (4 * 1024 * 1024)
+#define POOL_CACHE_MIN 4
+
+// Counters are only written by the owning thread; relaxed stores keep the
+// hot path free of locked instructions while pool_stats reads them
+#define POOL_STAT_INC(x) __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+#define POOL_STAT_READ(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+struct Pool;
+
+// Precedes every block.  pool is NULL for heap-backed blocks.
+typedef struct {
+    struct Pool* pool;
+    uint64_t cap;
+} PoolBlock;
+
+// Free blocks are linked through their payload
+typedef struct PoolFree {
+    struct PoolFree* next;
+} PoolFree;
+
+typedef struct {
+    // Owner side
+    PoolFree* local;
+    uint64_t cached;
+    uint64_t allocs;
+    uint64_t misses;
+    uint64_t frees;
+    uint64_t releases;
+    // Pushed to by other threads, taken whole by the owner
+    PoolFree* remote __attribute__((aligned(CACHELINE)));
+    uint64_t remote_frees;
+} __attribute__((aligned(CACHELINE))) PoolClass;
+
+typedef struct Pool {
+    PoolClass cls[POOL_CLASSES];
+    struct Pool* next;
+    bool attached;
+} Pool;
+
+// Pools are never freed: a detached pool keeps receiving remote frees for
+// blocks still in the ring and is adopted by the next thread to attach
+static Pool* pools = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Pool* tls_pool = NULL;
+
+static int pool_class(size_t n) {
+    int k = 0;
+    size_t size = (size_t)1 << POOL_MIN_SHIFT;
+    while (size < n) {
+        if (++k == POOL_CLASSES) {
+            return -1;
+        }
+        size <<= 1;
+    }
+    return k;
+}
+
+static size_t pool_class_size(int k) {
+    return (size_t)1 << (POOL_MIN_SHIFT + k);
+}
+
+static uint64_t pool_cache_max(int k) {
+    uint64_t n = POOL_CACHE_BYTES >> (POOL_MIN_SHIFT + k);
+    return (n < POOL_CACHE_MIN) ? POOL_CACHE_MIN : n;
+}
+
+static void* pool_heap_alloc(Pool* p, size_t cap) {
+    PoolBlock* b = malloc(sizeof(*b) + cap);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->pool = p;
+    b->cap = cap;
+    return b + 1;
+}
+
+static void pool_heap_free(void* ptr) {
+    free((PoolBlock*)ptr - 1);
+}
+
+// Attaches a pool to the calling thread, adopting a detached one if any
+void pool_thread_attach(void) {
+    if (tls_pool != NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pools_lock);
+    Pool* p = pools;
+    while (p != NULL && p->attached) {
+        p = p->next;
+    }
+    if (p == NULL) {
+        p = calloc(1, sizeof(*p));
+        if (p != NULL) {
+            p->next = pools;
+            pools = p;
+        }
+    }
+    if (p != NULL) {
+        p->attached = true;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    tls_pool = p;
+}
+
+void pool_thread_detach(void) {
+    if (tls_pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pools_lock);
+    tls_pool->attached = false;
+    pthread_mutex_unlock(&pools_lock);
+    tls_pool = NULL;
+}
+
+// Moves blocks freed by other threads into the local cache
+static void pool_take_remote(PoolClass* c, int k) {
+    PoolFree* f = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+    uint64_t max = pool_cache_max(k);
+    while (f != NULL) {
+        PoolFree* next = f->next;
+        if (c->cached < max) {
+            f->next = c->local;
+            c->local = f;
+            POOL_STAT_INC(c->cached);
+        } else {
+            POOL_STAT_INC(c->releases);
+            pool_heap_free(f);
+        }
+        f = next;
+    }
+}
+
+// Returns a block of at least n bytes, or NULL if the heap is exhausted
+void* pool_alloc(size_t n) {
+    int k = pool_class(n);
+    Pool* p = tls_pool;
+    if (k < 0) {
+        return pool_heap_alloc(NULL, n);
+    }
+    if (p == NULL) {
+        return pool_heap_alloc(NULL, pool_class_size(k));
+    }
+    PoolClass* c = &p->cls[k];
+    POOL_STAT_INC(c->allocs);
+    if (c->local == NULL) {
+        pool_take_remote(c, k);
+    }
+    PoolFree* f = c->local;
+    if (f == NULL) {
+        POOL_STAT_INC(c->misses);
+        return pool_heap_alloc(p, pool_class_size(k));
+    }
+    c->local = f->next;
+    __atomic_store_n(&c->cached, c->cached - 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+// Releases a block from pool_alloc.  May be called from any thread.
+void pool_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    PoolBlock* b = (PoolBlock*)ptr - 1;
+    Pool* p = b->pool;
+    if (p == NULL) {
+        free(b);
+        return;
+    }
+    int k = pool_class(b->cap);
+    PoolClass* c = &p->cls[k];
+    PoolFree* f = (PoolFree*)ptr;
+    if (p == tls_pool) {
+        POOL_STAT_INC(c->frees);
+        if (c->cached >= pool_cache_max(k)) {
+            POOL_STAT_INC(c->releases);
+            free(b);
+            return;
+        }
+        f->next = c->local;
+        c->local = f;
+        POOL_STAT_INC(c->cached);
+        return;
+    }
+    // Only the owner takes from the remote list, and always all of it, so
+    // a plain CAS push is free of ABA
+    PoolFree* head = __atomic_load_n(&c->remote, __ATOMIC_RELAXED);
+    do {
+        f->next = head;
+    } while (!__atomic_compare_exchange_n(&c->remote, &head, f, true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+    __atomic_fetch_add(&c->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+// Usable bytes in a block from pool_alloc
+size_t pool_capacity(const void* ptr) {
+    return ((const PoolBlock*)ptr - 1)->cap;
+}
+
+void pool_stats(PoolStats* s) {
+    *s = (PoolStats) { 0 };
+    pthread_mutex_lock(&pools_lock);
+    for (Pool* p = pools; p != NULL; p = p->next) {
+        s->pools++;
+        if (p->attached) {
+            s->attached++;
+        }
+        for (int k = 0; k < POOL_CLASSES; k++) {
+            PoolClass* c = &p->cls[k];
+            uint64_t cached = POOL_STAT_READ(c->cached);
+            s->allocs += POOL_STAT_READ(c->allocs);
+            s->misses += POOL_STAT_READ(c->misses);
+            s->frees += POOL_STAT_READ(c->frees);
+            s->remote_frees += POOL_STAT_READ(c->remote_frees);
+            s->releases += POOL_STAT_READ(c->releases);
+            s->cached += cached;
+            s->cached_bytes += cached * pool_class_size(k);
+        }
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+void pool_stats_print(FILE* f) {
+    PoolStats s;
+    pool_stats(&s);
+    fprintf(f, "pool: %lu pools (%lu attached), %lu allocs, %lu misses, "
+            "%lu frees, %lu remote frees, %lu released, "
+            "%lu cached (%lu bytes)\n",
+            s.pools, s.attached, s.allocs, s.misses, s.frees,
+            s.remote_frees, s.releases, s.cached, s.cached_bytes);
+}
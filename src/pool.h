@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Size-class block allocator backing Buffer storage.
+//
+// Each context thread attaches a Pool that caches freed blocks per
+// power-of-two class, so buffer churn is served from thread-local free
+// lists instead of the global heap.  A block freed by another thread (the
+// vacuum freeing slot storage, typically) is pushed onto its owner's
+// lock-free remote list and picked up on the owner's next miss.  Threads
+// without a pool, and requests above the largest class, use the heap.
+
+#define POOL_MIN_SHIFT 6  /* 64 B */
+#define POOL_MAX_SHIFT 20 /* 1 MiB */
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+typedef struct {
+    // Thread pools in existence, and how many are attached
+    size_t pools;
+    size_t attached;
+    uint64_t allocs;
+    // Allocations the cache could not serve
+    uint64_t misses;
+    // Frees by the owning thread and by other threads
+    uint64_t frees;
+    uint64_t remote_frees;
+    // Frees handed back to the heap because the class cache was full
+    uint64_t releases;
+    // Blocks and payload bytes sitting in local caches
+    uint64_t cached;
+    uint64_t cached_bytes;
+} PoolStats;
+
+void pool_thread_attach(void);
+void pool_thread_detach(void);
+
+void* pool_alloc(size_t n);
+void pool_free(void* ptr);
+size_t pool_capacity(const void* ptr);
+
+void pool_stats(PoolStats* s);
+void pool_stats_print(FILE* f);
+
+#endif /* POOL_H */
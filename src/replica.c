@@ -0,0 +1,581 @@
+#include "replica.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "crater.h"
+#include "journal.h"
+#include "log.h"
+#include "pool.h"
+#include "server.h"
+
+// Payload bytes gathered into one MSG_REPLICATE
+#define REPLICA_BATCH_BYTES (256 * 1024)
+#define REPLICA_CONNECT_TRIES 50
+#define REPLICA_CONNECT_USEC 100000
+// How long the standby waits for a batch before acknowledging anyway
+#define REPLICA_POLL_MSEC 1
+
+void replica_options_default(ReplicaOptions* o) {
+    memset(&o->standby, 0, sizeof(o->standby));
+    o->sync = false;
+    o->outputs = false;
+    o->max_pending = 4 * 1024 * 1024;
+}
+
+static int replica_connect(Addr addr) {
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(addr.port);
+    sin.sin_addr = addr.host;
+    // The standby may still be starting
+    for (int i = 0; i < REPLICA_CONNECT_TRIES; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            LOG_ERROR("Failed to open replication socket: %s", strerror(errno));
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr*)&sin, sizeof(sin)) == 0) {
+            int one = 1;
+            if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                           sizeof(one)) < 0) {
+                LOG_ERROR("Failed to set TCP_NODELAY: %s", strerror(errno));
+            }
+            return fd;
+        }
+        close(fd);
+        usleep(REPLICA_CONNECT_USEC);
+    }
+    LOG_ERROR("Failed to connect to standby: %s", strerror(errno));
+    return -1;
+}
+
+static int replica_write_record(Buffer* b, uint8_t io, uint64_t slot,
+                                const char* data, size_t len) {
+    if (buffer_write_uint8(b, io) < 0 ||
+        buffer_write_uint64(b, slot) < 0 ||
+        buffer_write_uint64(b, len) < 0 ||
+        buffer_write(b, data, len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    Buffer* wbuf;
+    uint64_t n;
+} ReplicaCursors;
+
+static int replica_save_cursor(void* arg, const char* name, uint64_t slot) {
+    ReplicaCursors* rc = (ReplicaCursors*)arg;
+    char payload[SAVED_CURSOR_MAX];
+    size_t len = saved_cursor_encode(payload, name, slot);
+    if (replica_write_record(rc->wbuf, JOURNAL_IO_CURSOR, 0, payload,
+                             len) < 0) {
+        return -1;
+    }
+    rc->n++;
+    return 0;
+}
+
+// Queues one batch of whatever the ring has published since the last.
+// Returns the number of records queued, or -1 on error.
+static int64_t replica_queue(Replica* r, Buffer* scratch) {
+    Crater* c = r->crater;
+    if (r->wbuf.len - r->wsent >= r->opts.max_pending) {
+        return 0;
+    }
+    uint64_t in_end = actor_slot(&c->producer);
+    uint64_t out_end = actor_slot(&c->transformer);
+    size_t start = buffer_begin_message(&r->wbuf, MSG_REPLICATE);
+    if (buffer_write_uint8(&r->wbuf, r->opts.outputs ? REPL_OUTPUT : 0) < 0) {
+        return -1;
+    }
+    size_t count_at = r->wbuf.len;
+    if (buffer_write_uint64(&r->wbuf, 0) < 0) {
+        return -1;
+    }
+    size_t body = r->wbuf.len;
+    uint64_t n = 0;
+    for (; r->input < in_end &&
+           r->wbuf.len - body < REPLICA_BATCH_BYTES; r->input++, n++) {
+        Buffer b = crater_get_input(c, r->input);
+        if (replica_write_record(&r->wbuf, SLOT_INPUT, r->input, b.buf,
+                                 b.len) < 0) {
+            return -1;
+        }
+    }
+    if (r->opts.outputs) {
+        for (; r->output < out_end && r->output < r->input &&
+               r->wbuf.len - body < REPLICA_BATCH_BYTES; r->output++, n++) {
+            Buffer b = crater_view_output(c, r->output, scratch);
+            if (replica_write_record(&r->wbuf, SLOT_OUTPUT, r->output, b.buf,
+                                     b.len) < 0) {
+                return -1;
+            }
+        }
+    }
+    // Along with the cursor of every consumer that has committed since the
+    // last batch
+    ReplicaCursors rc = { .wbuf = &r->wbuf, .n = n };
+    if (crater_save_cursors(c, &r->cursors, replica_save_cursor, &rc) < 0) {
+        return -1;
+    }
+    n = rc.n;
+    if (n == 0) {
+        r->wbuf.len = start;
+        return 0;
+    }
+    buffer_put_uint64(&r->wbuf, count_at, n);
+    buffer_end_message(&r->wbuf, start);
+    __atomic_store_n(&r->batches, r->batches + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->records, r->records + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->bytes, r->bytes + (r->wbuf.len - start),
+                     __ATOMIC_RELAXED);
+    return (int64_t)n;
+}
+
+// Writes as much of the queue as the socket takes.  Returns bytes sent, or
+// -1 if the standby is gone.
+static ssize_t replica_send(Replica* r) {
+    ssize_t total = 0;
+    while (r->wsent < r->wbuf.len) {
+        ssize_t n = send(r->fd, &r->wbuf.buf[r->wsent],
+                         r->wbuf.len - r->wsent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        r->wsent += n;
+        total += n;
+    }
+    if (r->wsent == r->wbuf.len) {
+        buffer_reset(&r->wbuf);
+        r->wsent = 0;
+    }
+    return total;
+}
+
+// Reads and applies any acknowledgements.  Returns how many, or -1 if the
+// standby is gone.
+static int replica_read_acks(Replica* r) {
+    int acks = 0;
+    for (;;) {
+        if (r->rbuf.len == r->rbuf.max && buffer_grow(&r->rbuf) < 0) {
+            return -1;
+        }
+        ssize_t n = recv(r->fd, &r->rbuf.buf[r->rbuf.len],
+                         r->rbuf.max - r->rbuf.len, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        r->rbuf.len += n;
+    }
+    size_t off = 0;
+    for (;;) {
+        uint64_t mlen = 0;
+        MessageType mtype = MSG_UNKNOWN;
+        size_t h = parse_message_header(&r->rbuf.buf[off], r->rbuf.len - off,
+                                        &mlen, &mtype);
+        if (h == 0 || r->rbuf.len - off - h < mlen) {
+            break;
+        }
+        ReplicateAckMsg m;
+        if (mtype != MSG_REPLICATE_ACK ||
+            parse_message_replicate_ack(&r->rbuf.buf[off + h], mlen,
+                                        &m) == 0) {
+            LOG_WARN("Unexpected message from standby");
+            return -1;
+        }
+        __atomic_store_n(&r->acked_input, m.input, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->acked_output, m.output, __ATOMIC_RELEASE);
+        off += h + mlen;
+        acks++;
+    }
+    buffer_strip(&r->rbuf, off);
+    __atomic_store_n(&r->acks, r->acks + acks, __ATOMIC_RELAXED);
+    return acks;
+}
+
+// Slot below which the vacuum may reclaim on the replica's account
+static uint64_t replica_cursor(Replica* r) {
+    uint64_t input = r->input;
+    uint64_t output = r->output;
+    if (r->opts.sync) {
+        input = __atomic_load_n(&r->acked_input, __ATOMIC_ACQUIRE);
+        output = __atomic_load_n(&r->acked_output, __ATOMIC_ACQUIRE);
+    }
+    return (r->opts.outputs && output < input) ? output : input;
+}
+
+static void* replica_run(void* arg) {
+    Replica* r = (Replica*)arg;
+    Crater* c = r->crater;
+    pool_thread_attach();
+    Buffer scratch;
+    buffer_alloc(&scratch, 1024);
+    unsigned spins = 0;
+    for (;;) {
+        int64_t queued = replica_queue(r, &scratch);
+        ssize_t sent = (queued < 0) ? -1 : replica_send(r);
+        int acks = (sent < 0) ? -1 : replica_read_acks(r);
+        if (acks < 0) {
+            break;
+        }
+        actor_set_slot(&c->replicator, replica_cursor(r));
+        if (queued > 0 || sent > 0 || acks > 0) {
+            spins = 0;
+        } else {
+            crater_backoff(&spins);
+        }
+    }
+
+    // Stop gating the ring and hiding slots from consumers
+    __atomic_store_n(&r->live, false, __ATOMIC_RELEASE);
+    LOG_WARN("Standby lost at slot %llu; continuing without replication",
+             (long long unsigned)r->input);
+    close(r->fd);
+    r->fd = -1;
+    buffer_free(&scratch);
+    pool_thread_detach();
+    return NULL;
+}
+
+// Connects to the standby and starts streaming the ring to it, from the
+// oldest slot still held.  Must run before the crater starts.
+Replica* replica_start(Crater* c, const ReplicaOptions* o) {
+    int fd = replica_connect(o->standby);
+    if (fd < 0) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Replica* r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        close(fd);
+        return NULL;
+    }
+    r->opts = *o;
+    r->crater = c;
+    r->fd = fd;
+    buffer_alloc(&r->wbuf, 64 * 1024);
+    buffer_alloc(&r->rbuf, 1024);
+    r->input = actor_slot(&c->vacuum);
+    r->output = r->input;
+    r->acked_input = r->input;
+    r->acked_output = r->input;
+    actor_set_slot(&c->replicator, r->input);
+    r->live = true;
+    c->replica = r;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    affinity_set_attr(&attr, &c->placement.journal);
+    int err = pthread_create(&r->thread, &attr, replica_run, r);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        LOG_ERROR("Failed to start replica thread: %s", strerror(err));
+        c->replica = NULL;
+        close(fd);
+        buffer_free(&r->wbuf);
+        buffer_free(&r->rbuf);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void replica_stats_print(Replica* r, FILE* f) {
+    fprintf(f, "replica: %s%s, %llu batches, %llu records, %llu bytes, "
+            "%llu acks, acknowledged below slot %llu\n",
+            replica_live(r) ? "live" : "lost",
+            r->opts.sync ? " (sync)" : "",
+            (long long unsigned)__atomic_load_n(&r->batches,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&r->records,
+                                                __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&r->bytes, __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&r->acks, __ATOMIC_RELAXED),
+            (long long unsigned)__atomic_load_n(&r->acked_input,
+                                                __ATOMIC_ACQUIRE));
+}
+
+// Standby side
+
+typedef struct {
+    Crater* crater;
+    bool outputs;
+    // Whether the ring has been aligned with the primary's slots
+    bool based;
+    SavedCursors cursors;
+    uint64_t applied;
+    // Last acknowledged
+    uint64_t acked_input;
+    uint64_t acked_output;
+} Follower;
+
+// Slot below which the journal, if any, has made both columns durable
+static uint64_t follower_durable(Crater* c, uint64_t end) {
+    if (c->config.expect_journal) {
+        uint64_t j = actor_slot(&c->journaler);
+        if (j < end) {
+            return j;
+        }
+    }
+    return end;
+}
+
+// Empties the ring and restarts it at slot, where the primary's stream
+// begins.  Anything still held is journaled first.
+static void follower_rebase(Crater* c, uint64_t slot) {
+    uint64_t end = actor_slot(&c->producer);
+    unsigned spins = 0;
+    while (follower_durable(c, end) < end) {
+        crater_backoff(&spins);
+    }
+    crater_reclaim(c, end);
+    // The vacuum moves first, so the journal skips rather than reads the
+    // slots in between
+    actor_set_slot(&c->vacuum, slot);
+    c->producer.read = slot;
+    actor_set_slot(&c->producer, slot);
+    c->transformer.read = slot;
+    actor_set_slot(&c->transformer, slot);
+}
+
+static void follower_apply_input(Follower* f, uint64_t slot, SlotData d) {
+    Crater* c = f->crater;
+    uint64_t end = actor_slot(&c->producer);
+    if (slot < end && f->based) {
+        // Already applied
+        return;
+    }
+    if (!f->based || slot > end) {
+        if (f->based) {
+            LOG_WARN("Standby: slots %llu to %llu missing, restarting at %llu",
+                     (long long unsigned)end, (long long unsigned)slot,
+                     (long long unsigned)slot);
+        }
+        follower_rebase(c, slot);
+        f->based = true;
+    }
+    // The primary's ring may be larger; reclaim what it must already have
+    // moved past, once journaled
+    unsigned spins = 0;
+    while (slot >= actor_slot(&c->vacuum) + c->len) {
+        uint64_t target = follower_durable(c, slot - c->len + 1);
+        if (target > actor_slot(&c->vacuum)) {
+            crater_reclaim(c, target);
+        } else {
+            crater_backoff(&spins);
+        }
+    }
+    crater_set_copy_input(c, slot, d.buf, d.len);
+    crater_publish(&c->producer, slot + 1);
+}
+
+static void follower_apply_output(Follower* f, uint64_t slot, SlotData d) {
+    Crater* c = f->crater;
+    if (slot < actor_slot(&c->transformer) ||
+        slot < actor_slot(&c->vacuum) ||
+        slot >= actor_slot(&c->producer)) {
+        return;
+    }
+    crater_set_copy_output(c, slot, d.buf, d.len);
+    crater_publish(&c->transformer, slot + 1);
+}
+
+static int follower_apply(Follower* f, const char* buf, size_t len) {
+    ReplicateMsg m;
+    if (parse_message_replicate(buf, len, &m) == 0) {
+        return -1;
+    }
+    uint8_t io = 0;
+    uint64_t slot = 0;
+    SlotData d;
+    while (replicate_msg_next(&m, &io, &slot, &d)) {
+        switch (io) {
+        case SLOT_INPUT:
+            follower_apply_input(f, slot, d);
+            break;
+        case SLOT_OUTPUT:
+            follower_apply_output(f, slot, d);
+            break;
+        case JOURNAL_IO_CURSOR:
+            if (saved_cursors_add_record(&f->cursors, d.buf, d.len) < 0) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+        f->applied++;
+    }
+    return 0;
+}
+
+static int follower_ack(Follower* f, int fd) {
+    Crater* c = f->crater;
+    uint64_t input = follower_durable(c, actor_slot(&c->producer));
+    uint64_t output = follower_durable(c, actor_slot(&c->transformer));
+    if (input == f->acked_input && output == f->acked_output) {
+        return 0;
+    }
+    f->acked_input = input;
+    f->acked_output = output;
+    char msg[32];
+    Buffer b = { .buf = msg, .len = 0, .max = sizeof(msg) };
+    size_t start = buffer_begin_message(&b, MSG_REPLICATE_ACK);
+    buffer_write_uint64(&b, input);
+    buffer_write_uint64(&b, output);
+    buffer_end_message(&b, start);
+    size_t off = 0;
+    while (off < b.len) {
+        ssize_t n = send(fd, &b.buf[off], b.len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+// Hands the ring to clients once the primary is gone
+static void follower_promote(Follower* f) {
+    Crater* c = f->crater;
+    uint64_t base = actor_slot(&c->vacuum);
+    uint64_t in_end = actor_slot(&c->producer);
+    uint64_t out_end = actor_slot(&c->transformer);
+    if (!f->outputs) {
+        // Transform everything held again
+        out_end = base;
+    }
+    LOG_INFO("Standby: primary gone after %llu records; serving slots %llu to "
+             "%llu (transformed up to %llu) and %zu consumer cursors",
+             (long long unsigned)f->applied, (long long unsigned)base,
+             (long long unsigned)in_end, (long long unsigned)out_end,
+             f->cursors.len);
+    crater_resume(c, base, in_end, out_end, &f->cursors);
+}
+
+// Serves as standby to the primary that connects to addr, applying its
+// stream to c until it disconnects.  Returns 0 once c holds the primary's
+// ring and may serve clients, or -1 if no primary could be followed.
+int replica_follow(Crater* c, Addr addr) {
+    int server = server_listen(addr);
+    if (server < 0) {
+        return -1;
+    }
+    LOG_INFO("Standby: waiting for primary on port %d", addr.port);
+    int fd = server_accept(server);
+    close(server);
+    if (fd < 0) {
+        LOG_ERROR("Failed to accept primary: %s", strerror(errno));
+        return -1;
+    }
+    LOG_INFO("Standby: following primary");
+
+    Follower f;
+    memset(&f, 0, sizeof(f));
+    f.crater = c;
+    f.based = actor_slot(&c->producer) > actor_slot(&c->vacuum);
+    // Without replicated outputs, nothing transforms on the standby, and
+    // its journal must not wait for outputs
+    bool expect_transformer = c->config.expect_transformer;
+    Buffer rbuf;
+    buffer_alloc(&rbuf, 64 * 1024);
+    int ret = 0;
+    bool first = true;
+    for (;;) {
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        int ready = poll(&p, 1, REPLICA_POLL_MSEC);
+        if (ready < 0 && errno != EINTR) {
+            LOG_ERROR("Standby poll failed: %s", strerror(errno));
+            break;
+        }
+        if (ready > 0) {
+            if (rbuf.len == rbuf.max && buffer_grow(&rbuf) < 0) {
+                ret = -1;
+                break;
+            }
+            ssize_t n = recv(fd, &rbuf.buf[rbuf.len], rbuf.max - rbuf.len, 0);
+            if (n <= 0) {
+                break;
+            }
+            rbuf.len += n;
+        }
+        size_t off = 0;
+        bool bad = false;
+        for (;;) {
+            uint64_t mlen = 0;
+            MessageType mtype = MSG_UNKNOWN;
+            size_t h = parse_message_header(&rbuf.buf[off], rbuf.len - off,
+                                            &mlen, &mtype);
+            if (h == 0 || rbuf.len - off - h < mlen) {
+                // Make room for the whole frame
+                if (h != 0 && h + mlen > rbuf.max) {
+                    buffer_strip(&rbuf, off);
+                    off = 0;
+                    if (buffer_resize(&rbuf, h + mlen) < 0) {
+                        bad = true;
+                    }
+                }
+                break;
+            }
+            if (mtype != MSG_REPLICATE) {
+                bad = true;
+                break;
+            }
+            if (first) {
+                f.outputs = (rbuf.buf[off + h] & REPL_OUTPUT) != 0;
+                c->config.expect_transformer = f.outputs;
+                first = false;
+            }
+            if (follower_apply(&f, &rbuf.buf[off + h], mlen) < 0) {
+                bad = true;
+                break;
+            }
+            off += h + mlen;
+        }
+        buffer_strip(&rbuf, off);
+        if (bad) {
+            LOG_WARN("Standby: malformed stream from primary");
+            break;
+        }
+        if (follower_ack(&f, fd) < 0) {
+            break;
+        }
+    }
+    close(fd);
+    buffer_free(&rbuf);
+    c->config.expect_transformer = expect_transformer;
+    if (ret == 0) {
+        follower_promote(&f);
+    }
+    saved_cursors_free(&f.cursors);
+    return ret;
+}
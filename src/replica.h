@@ -0,0 +1,100 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "addr.h"
+#include "crater.h"
+#include "messages.h"
+
+// Streaming replication to a standby crater.
+//
+// On the primary, a replicator thread follows the ring like the journaler
+// does, and streams input slots (and, optionally, output slots) together
+// with consumer cursors to the standby as MSG_REPLICATE batches, without
+// waiting for each batch to be acknowledged.  The standby applies them to
+// its own ring and answers with MSG_REPLICATE_ACK.
+//
+// Asynchronously, the replicator's cursor follows what has been sent, so
+// the standby may lag by whatever is in flight.  Synchronously, it follows
+// what has been acknowledged, and consumers only see acknowledged slots.
+// If the standby goes away the primary carries on alone.
+//
+// The standby (crater -F) serves no clients until the primary disconnects;
+// it then takes over the ring with the replicated cursors.
+//
+// MSG_REPLICATE body: u8 flags, u64 n, then n records of
+//   u8 io, u64 slot, u64 len, bytes
+// where io is a SlotDestination, or JOURNAL_IO_CURSOR for a consumer
+// cursor (slot is the consumer's index, the payload its u64 cursor).
+// MSG_REPLICATE_ACK body: u64 input, u64 output -- the slots below which
+// each column is applied (and, if the standby journals, durable).
+
+#define REPL_OUTPUT 0x01 /* Output slots are replicated */
+
+typedef struct {
+    Addr standby;
+    // Consumers only see what the standby has acknowledged
+    bool sync;
+    // Replicate output slots too.  Without them, a promoted standby
+    // transforms every slot it holds again.
+    bool outputs;
+    // Bytes queued for the standby before the replicator stops reading
+    // the ring
+    size_t max_pending;
+} ReplicaOptions;
+
+struct Crater;
+
+typedef struct Replica {
+    ReplicaOptions opts;
+    struct Crater* crater;
+    pthread_t thread;
+    int fd;
+    volatile bool live;
+    Buffer wbuf;
+    size_t wsent;
+    Buffer rbuf;
+    // Next slots to send
+    uint64_t input;
+    uint64_t output;
+    // Slots below these are applied on the standby
+    volatile uint64_t acked_input;
+    volatile uint64_t acked_output;
+    // Consumer cursors as last sent
+    CursorTracker cursors;
+    // Written by the replica thread, read for statistics
+    uint64_t batches;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t acks;
+} Replica;
+
+void replica_options_default(ReplicaOptions* o);
+Replica* replica_start(struct Crater* c, const ReplicaOptions* o);
+int replica_follow(struct Crater* c, Addr addr);
+void replica_stats_print(Replica* r, FILE* f);
+
+static inline bool replica_live(const Replica* r) {
+    return __atomic_load_n(&r->live, __ATOMIC_ACQUIRE);
+}
+
+// Caps a column's readable end at what a synchronous standby has
+// acknowledged
+static inline uint64_t replica_visible(const Replica* r, SlotDestination io,
+                                       uint64_t end) {
+    if (!r->opts.sync || !replica_live(r)) {
+        return end;
+    }
+    if (io == SLOT_OUTPUT) {
+        return r->opts.outputs ?
+            __atomic_load_n(&r->acked_output, __ATOMIC_ACQUIRE) : end;
+    }
+    return __atomic_load_n(&r->acked_input, __ATOMIC_ACQUIRE);
+}
+
+#endif /* REPLICA_H */
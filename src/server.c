@@ -6,16 +6,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "messages.h"
+#include "log.h"
 
-static int server_listen(Addr addr) {
+// How long a new client has to send its configure frame
+#define CONFIG_TIMEOUT_USEC 1000000
+
+int server_listen(Addr addr) {
     // Open a new socket
     int server = socket(AF_INET, SOCK_STREAM, 0);
     if (server < 0) {
-        perror(NULL);
+        LOG_ERROR("%s", strerror(errno));
         return -1;
     }
 
@@ -26,13 +32,15 @@ static int server_listen(Addr addr) {
     sin.sin_port = htons(addr.port);
     sin.sin_addr = addr.host;
     if (bind(server, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
-        perror("Socket bind failed: ");
+        LOG_ERROR("Socket bind failed: %s", strerror(errno));
         return -1;
     }
 
-    // Listen on the socket
-    if (listen(server, 1) < 0) {
-        perror("Listen failed: ");
+    // Listen on the socket.  A client of a partitioned stream connects to
+    // every partition at once, which a short backlog would hold up for a
+    // SYN retry.
+    if (listen(server, SOMAXCONN) < 0) {
+        LOG_ERROR("Listen failed: %s", strerror(errno));
         return -1;
     }
 
@@ -40,158 +48,187 @@ static int server_listen(Addr addr) {
 }
 
 // Accept a client connection
-static int server_accept(int server) {
+int server_accept(int server) {
     struct sockaddr_in cin;
     memset(&cin, 0, sizeof(cin));
     socklen_t sin_size = sizeof(cin);
-    return accept(server, (struct sockaddr*)&cin, &sin_size);
+    int client = accept(server, (struct sockaddr*)&cin, &sin_size);
+    if (client >= 0) {
+        // Replies are small and latency sensitive
+        int one = 1;
+        if (setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one,
+                       sizeof(one)) < 0) {
+            LOG_ERROR("Failed to set TCP_NODELAY: %s", strerror(errno));
+        }
+    }
+    return client;
 }
 
 static void terminate_client(int client) {
     if (close(client) < 0) {
-        perror("Client close failed: ");
+        LOG_ERROR("Client close failed: %s", strerror(errno));
     }
 }
 
-// Blocks while waiting for ConfigureMessage from a client socket.
-// Returns -1 on error, 0 on success.
-static int read_client_config(int client, Buffer* buf, ConfigureMessage* m) {
+// Reads exactly len bytes from the client into buf
+static int recv_exact(int client, char* buf, size_t len) {
     size_t rd = 0;
-    for (;;) {
-        // The configure message should fit in the buffer we were given
-        // If not, fail
-        if (buf->len >= buf->max) {
-            return -1;
-        }
-        // Read from the client socket
-        ssize_t r = recv(client, &buf->buf[rd], buf->max - rd, 0);
+    while (rd < len) {
+        ssize_t r = recv(client, &buf[rd], len - rd, 0);
         if (r < 0) {
-            perror("Client read failed: ");
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                LOG_WARN("Client sent no configuration in time");
+                return -1;
+            }
+            LOG_ERROR("Client read failed: %s", strerror(errno));
             return -1;
         } else if (r == 0) {
-            printf("Client terminated\n");
-            return -1;
-        }
-        rd += r;
-        printf("Read %ld bytes\n", r);
-        // Update the buffer
-        buf->len += (size_t)r;
-        // Parse the message header
-        uint64_t rmlen = 0;
-        MessageType rmtype = MSG_UNKNOWN;
-        size_t n = parse_message_header(buf->buf, buf->len, &rmlen, &rmtype);
-        if (rmlen > MSGMAXLEN) {
-            printf("Invalid msg length %llu\n", (long long unsigned)rmlen);
+            LOG_INFO("Client terminated");
             return -1;
         }
-        if (rmtype != MSG_CONFIGURE) {
-            printf("Invalid msg type %d\n", rmtype);
-            return -1;
-        }
-        if (rmlen < buf->len - n) {
-            printf("Not enough data\n");
-            continue;
-        }
-        // If we were unable to parse the header, go read more from the client
-        if (n == 0) {
-            continue;
-        }
-        // Parse the message body
-        if (parse_message_configure(&buf->buf[n], buf->len - n, m) == 0) {
-            printf("Client configuration failed\n");
-            return -1;
-        }
-        break;
+        rd += (size_t)r;
     }
     return 0;
 }
 
+// Sets how long a recv on the client may block, 0 for ever
+static int set_recv_timeout(int client, uint64_t usec) {
+    struct timeval tv = {
+        .tv_sec = (time_t)(usec / 1000000),
+        .tv_usec = (suseconds_t)(usec % 1000000)
+    };
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        LOG_ERROR("Failed to set SO_RCVTIMEO: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-// Listens on Addr until all expected clients have connected.  Returns -1
-// if it fails to achieve this.
-int server_run(Addr addr, Crater* crater) {
+// Waits up to CONFIG_TIMEOUT_USEC for ConfigureMessage from a client
+// socket, so a client that never sends one cannot hold up the accept loop.
+// Only the configure frame is read, so anything the client pipelines
+// behind it is left on the socket for its context.
+// Returns -1 on error, 0 on success.
+static int read_client_config(int client, Buffer* buf, ConfigureMessage* m) {
+    const size_t hlen = sizeof(uint64_t) + sizeof(uint8_t);
+    if (set_recv_timeout(client, CONFIG_TIMEOUT_USEC) < 0) {
+        return -1;
+    }
+    if (recv_exact(client, buf->buf, hlen) < 0) {
+        return -1;
+    }
+    buf->len = hlen;
+    uint64_t rmlen = 0;
+    MessageType rmtype = MSG_UNKNOWN;
+    size_t n = parse_message_header(buf->buf, buf->len, &rmlen, &rmtype);
+    if (n == 0) {
+        return -1;
+    }
+    if (rmtype != MSG_CONFIGURE) {
+        LOG_WARN("Invalid msg type %d", rmtype);
+        return -1;
+    }
+    // The configure message should fit in the buffer we were given
+    // If not, fail
+    if (rmlen > buf->max - n) {
+        LOG_WARN("Invalid msg length %llu", (long long unsigned)rmlen);
+        return -1;
+    }
+    if (recv_exact(client, &buf->buf[n], rmlen) < 0) {
+        return -1;
+    }
+    buf->len += rmlen;
+    // Parse the message body
+    LOG_DEBUG("Parsing configure message of len %llu",
+              (long long unsigned)rmlen);
+    if (parse_message_configure(&buf->buf[n], rmlen, m) == 0) {
+        LOG_WARN("Client configuration failed");
+        return -1;
+    }
+    // The context thread waits on the client for as long as it likes
+    if (set_recv_timeout(client, 0) < 0) {
+        configure_msg_destroy(m);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Listens on Addr for as long as the server runs, adding each client to
+// the ring its configure message names.  A ring starts once it has every
+// actor it expects; after that, actors join and leave it at will.  Only
+// returns, with -1, if it cannot listen.
+int server_run(Addr addr, Craters* rings) {
     int server = server_listen(addr);
     if (server < 0) {
         return -1;
     }
     Buffer buf;
     buffer_alloc(&buf, 1024);
+    // Embedded stages may already have completed a configuration
+    for (size_t i = 0; i < rings->len; i++) {
+        if (crater_ready(rings->i[i])) {
+            crater_start(rings->i[i]);
+            LOG_INFO("Ring %s ready", rings->i[i]->name);
+        }
+    }
     for (;;) {
         int client = server_accept(server);
         if (client < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("Server accept failed: ");
+                LOG_ERROR("Server accept failed: %s", strerror(errno));
             }
             continue;
         }
-        printf("Got new connection\n");
-
-        // Block on client read until we get a configuration packet from them.
-        // This may interfere with other client connection attempts, if this
-        // client is misbehaving.  We want the configuration first so we can
-        // avoid having the context thread handle it, requiring a lock on
-        // the crater's actors.  If this is a problem, we can collect client
-        // descriptors into an array and use a non-blocking select, while using
-        // a timeout for accept
+        LOG_INFO("Got new connection");
+        // Actors that have left make way for those joining
+        for (size_t i = 0; i < rings->len; i++) {
+            crater_reap(rings->i[i]);
+        }
+
+        // Read the configuration here, before the context thread exists, so
+        // placing the client needs no lock on the crater's actors.  A client
+        // that does not send it in time is dropped.
         ConfigureMessage m;
         int ret = read_client_config(client, &buf, &m);
         buffer_reset(&buf);
         if (ret < 0) {
-            printf("Failed to read client config\n");
+            LOG_ERROR("Failed to read client config");
+            terminate_client(client);
+            continue;
+        }
+        LOG_DEBUG("Client actor type: %d", m.actor_type);
+        Crater* crater = craters_find(rings, m.ring);
+        if (crater == NULL) {
+            LOG_WARN("No ring named %s", m.ring);
+            configure_msg_destroy(&m);
             terminate_client(client);
             continue;
         }
-        printf("Client actor type: %d\n", m.actor_type);
 
         // Start a new context for this client
         Context* ctx = context_alloc(client);
         int ready = crater_add_context(crater, ctx, m);
+        configure_msg_destroy(&m);
         if (ready < 0) {
+            LOG_WARN("Ring %s refused the client", crater->name);
+            free(ctx);
             terminate_client(client);
             continue;
         }
         if (context_spawn(ctx) != 0) {
-            crater_undo_add_context(crater, m);
-            terminate_client(client);
-            ready = 0;
-        } else {
-            printf("Spawned client thread\n");
+            // The failed spawn closed the client
+            crater_remove_context(crater, ctx);
+            free(ctx);
+            continue;
         }
-        if (ready > 0) {
-            printf("Ready\n");
-            break;
+        LOG_DEBUG("Spawned client thread");
+        if (ready > 0 && !crater->started) {
+            crater_start(crater);
+            LOG_INFO("Ring %s ready", crater->name);
         }
     }
-    buffer_free(&buf);
-    if (close(server) < 0) {
-        perror("Failed to close server: ");
-    }
-    return 0;
-}
-
-// Converts hostname of the form "xxx.xx.xx.xxx:yyyy" to an Addr
-// Returns 0 on success, -1 on error.
-int addr_from_hostname(const char* hostname, Addr* addr) {
-    uint16_t port = 0;
-    char* colon = strchr(hostname, ':');
-    if (colon != NULL) {
-        int iport = atoi(colon + 1);
-        if (iport < 0 || iport > UINT16_MAX) {
-            return -1;
-        }
-        port = (uint16_t)iport;
-    }
-    addr->port = port;
-    size_t ip_len = 0;
-    if (colon == NULL) {
-        ip_len = strlen(hostname);
-    } else {
-        ip_len = colon - hostname;
-    }
-    char* ip = malloc(ip_len + 1);
-    strncpy(ip, hostname, ip_len);
-    ip[ip_len] = '\0';
-    int ret = inet_aton(ip, &addr->host);
-    free(ip);
-    return ret;
 }
@@ -5,14 +5,11 @@
 #include <sys/types.h>
 #include <stdint.h>
 
+#include "addr.h"
 #include "crater.h"
 
-typedef struct {
-    struct in_addr host;
-    uint16_t port;
-} Addr;
-
-int server_run(Addr addr, Crater* crater);
-int addr_from_hostname(const char* hostname, Addr* addr);
+int server_listen(Addr addr);
+int server_accept(int server);
+int server_run(Addr addr, Craters* rings);
 
 #endif /* SERVER_H */
@@ -0,0 +1,186 @@
+#include "stage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "crater.h"
+#include "log.h"
+#include "pool.h"
+#include "trace.h"
+
+typedef struct {
+    void* handle;
+    const CraterStage* iface;
+    void* state;
+} Stage;
+
+static void stage_destroy(Stage* s) {
+    if (s->iface != NULL && s->iface->destroy != NULL) {
+        s->iface->destroy(s->state);
+    }
+    if (s->handle != NULL) {
+        dlclose(s->handle);
+    }
+    free(s);
+}
+
+static void* stage_run_transformer(Context* ctx, Stage* s) {
+    Crater* c = ctx->crater;
+    Actor* a = ctx->actor;
+    uint64_t slot = a->slot;
+    for (;;) {
+        uint64_t end = crater_wait(c, SLOT_INPUT, slot);
+        for (; slot < end; slot++) {
+            Buffer in = crater_get_input(c, slot);
+            Buffer out;
+            buffer_alloc(&out, (in.len > 0) ? in.len : 1);
+            int ret = s->iface->transform(s->state, in.buf, in.len, &out);
+            if (ret == TRANSFORM_SAME) {
+                buffer_free(&out);
+                crater_set_output_same(c, slot);
+            } else if (ret == TRANSFORM_PATCH) {
+                if (crater_set_output_patch(c, slot, out.buf, out.len,
+                                            out.max) < 0) {
+                    LOG_WARN("Stage patch for slot %lu is outside its input",
+                             slot);
+                    buffer_free(&out);
+                    return ctx;
+                }
+            } else if (ret == TRANSFORM_OUTPUT) {
+                crater_set_output(c, slot, out.buf, out.len, out.max);
+            } else {
+                buffer_free(&out);
+                return ctx;
+            }
+            CRATER_PROBE(transform, slot, a, out.len);
+            if (crater_traced(c, slot)) {
+                crater_trace_write(c, a, SLOT_OUTPUT, slot);
+            }
+            crater_publish(a, slot + 1);
+            ACTOR_METRIC_ADD(a, items, 1);
+            ACTOR_METRIC_ADD(a, bytes, out.len);
+        }
+    }
+}
+
+static void* stage_run_consumer(Context* ctx, Stage* s) {
+    Crater* c = ctx->crater;
+    Actor* a = ctx->actor;
+    uint64_t slot = a->slot;
+    Buffer scratch;
+    buffer_alloc(&scratch, 1024);
+    for (;;) {
+        uint64_t end = crater_wait(c, s->iface->io, slot);
+        for (; slot < end; slot += a->stride) {
+            Buffer b = (s->iface->io == SLOT_OUTPUT) ?
+                crater_view_output(c, slot, &scratch) :
+                crater_get_input(c, slot);
+            if (s->iface->consume(s->state, slot, b.buf, b.len) < 0) {
+                crater_publish(a, slot);
+                buffer_free(&scratch);
+                return ctx;
+            }
+            CRATER_PROBE(consume, slot, a, b.len);
+            if (crater_traced(c, slot)) {
+                crater_trace_read(c, a, s->iface->io, slot);
+            }
+            ACTOR_METRIC_ADD(a, items, 1);
+            ACTOR_METRIC_ADD(a, bytes, b.len);
+        }
+        crater_publish(a, slot);
+    }
+}
+
+// Thread main function for an embedded stage
+static void* stage_run(void* context) {
+    Context* ctx = (Context*)context;
+    Stage* s = (Stage*)ctx->stage;
+    void* ret = NULL;
+    pool_thread_attach();
+    switch (s->iface->type) {
+    case ACTOR_TRANSFORMER:
+        ret = stage_run_transformer(ctx, s);
+        break;
+    case ACTOR_CONSUMER:
+        ret = stage_run_consumer(ctx, s);
+        break;
+    default:
+        break;
+    }
+    // The plugin may free pool buffers, so it goes before the detach
+    stage_destroy(s);
+    ctx->stage = NULL;
+    pool_thread_detach();
+    LOG_INFO("Stage stopped");
+    crater_leave(ctx);
+    return ret;
+}
+
+// Loads the plugin named by spec ("path.so" or "path.so:arg"), registers it
+// as an actor and starts its thread.  Returns -1 on error.
+int stage_load(Crater* c, const char* spec) {
+    char* path = strdup(spec);
+    char* arg = strchr(path, ':');
+    if (arg != NULL) {
+        *arg++ = '\0';
+    }
+    Stage* s = calloc(1, sizeof(*s));
+    int ret = -1;
+
+    s->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (s->handle == NULL) {
+        LOG_ERROR("Failed to load stage %s: %s", path, dlerror());
+        goto done;
+    }
+    s->iface = (const CraterStage*)dlsym(s->handle, STAGE_SYMBOL);
+    if (s->iface == NULL) {
+        LOG_ERROR("Stage %s has no %s", path, STAGE_SYMBOL);
+        goto done;
+    }
+    if ((s->iface->type == ACTOR_TRANSFORMER && s->iface->transform == NULL) ||
+        (s->iface->type == ACTOR_CONSUMER && s->iface->consume == NULL) ||
+        (s->iface->type != ACTOR_TRANSFORMER &&
+         s->iface->type != ACTOR_CONSUMER)) {
+        LOG_ERROR("Stage %s is not a transformer or consumer", path);
+        s->iface = NULL;
+        goto done;
+    }
+    if (s->iface->init != NULL) {
+        s->state = s->iface->init(arg);
+    }
+
+    // Consumer stages come on top of the consumers expected over the network
+    if (s->iface->type == ACTOR_CONSUMER) {
+        c->config.expect_consumers++;
+    }
+    Context* ctx = context_alloc(-1);
+    ctx->stage = s;
+    ConfigureMessage m = {
+        .actor_type = s->iface->type, .filter = { .op = FILTER_NONE }
+    };
+    if (crater_add_context(c, ctx, m) < 0) {
+        LOG_ERROR("Stage %s does not fit the configuration", path);
+        if (s->iface->type == ACTOR_CONSUMER) {
+            c->config.expect_consumers--;
+        }
+        free(ctx);
+        goto done;
+    }
+    if (context_spawn_with(ctx, &stage_run) != 0) {
+        crater_remove_context(c, ctx);
+        free(ctx);
+        goto done;
+    }
+    LOG_INFO("Loaded stage %s", path);
+    s = NULL;
+    ret = 0;
+
+done:
+    if (s != NULL) {
+        stage_destroy(s);
+    }
+    free(path);
+    return ret;
+}
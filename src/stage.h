@@ -0,0 +1,35 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "messages.h"
+
+// A stage plugin is a shared object exporting a CraterStage named
+// crater_stage.  The server runs it on its own thread against the ring, so
+// items reach it with no framing, copies or syscalls.
+#define STAGE_SYMBOL "crater_stage"
+
+typedef struct {
+    // ACTOR_TRANSFORMER or ACTOR_CONSUMER
+    ActorType type;
+    // Column a consumer reads; transformers always read input
+    SlotDestination io;
+    // Returns the state passed to the other callbacks.  arg is the text
+    // after the first ':' of the -s option, or NULL.
+    void* (*init)(const char* arg);
+    // Transformers write the output for one input item to out, which the
+    // ring takes ownership of, and return a TransformResult: TRANSFORM_SAME
+    // forwards the input without a copy, TRANSFORM_PATCH stores a patch
+    // against it.  Return < 0 to stop the stage.
+    int (*transform)(void* state, const char* data, size_t len, Buffer* out);
+    // Consumers see every item in order.  Return < 0 to stop the stage.
+    int (*consume)(void* state, uint64_t slot, const char* data, size_t len);
+    void (*destroy)(void* state);
+} CraterStage;
+
+struct Crater;
+
+int stage_load(struct Crater* c, const char* spec);
+
+#endif /* STAGE_H */
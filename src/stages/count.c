@@ -0,0 +1,46 @@
+// Consumer stage: counts output items and bytes, reporting every N items
+// (N is the stage argument, default 100000)
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../stage.h"
+
+typedef struct {
+    uint64_t every;
+    uint64_t items;
+    uint64_t bytes;
+} Count;
+
+static void* count_init(const char* arg) {
+    Count* c = calloc(1, sizeof(*c));
+    c->every = (arg != NULL) ? strtoull(arg, NULL, 10) : 0;
+    if (c->every == 0) {
+        c->every = 100000;
+    }
+    return c;
+}
+
+static int count_consume(void* state, uint64_t slot, const char* data,
+                         size_t len) {
+    Count* c = (Count*)state;
+    c->items++;
+    c->bytes += len;
+    if (c->items % c->every == 0) {
+        printf("count: %llu items, %llu bytes, last slot %llu\n",
+               (long long unsigned)c->items, (long long unsigned)c->bytes,
+               (long long unsigned)slot);
+    }
+    return 0;
+}
+
+static void count_destroy(void* state) {
+    free(state);
+}
+
+const CraterStage crater_stage = {
+    .type = ACTOR_CONSUMER,
+    .io = SLOT_OUTPUT,
+    .init = count_init,
+    .consume = count_consume,
+    .destroy = count_destroy,
+};
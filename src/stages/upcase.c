@@ -0,0 +1,35 @@
+// Transformer stage: writes each input item in upper case.  Only the span
+// between the first and last lower case letters is sent back, as a patch.
+#include <ctype.h>
+
+#include "../stage.h"
+
+static int upcase_transform(void* state, const char* data, size_t len,
+                            Buffer* out) {
+    size_t at = 0;
+    while (at < len && !islower((unsigned char)data[at])) {
+        at++;
+    }
+    if (at == len) {
+        return TRANSFORM_SAME;
+    }
+    size_t end = len;
+    while (!islower((unsigned char)data[end - 1])) {
+        end--;
+    }
+    buffer_reset(out);
+    if (buffer_write_patch(out, at, end - at, &data[at], end - at) < 0) {
+        return -1;
+    }
+    char* span = &out->buf[out->len - (end - at)];
+    for (size_t i = 0; i < end - at; i++) {
+        span[i] = (char)toupper((unsigned char)span[i]);
+    }
+    return TRANSFORM_PATCH;
+}
+
+const CraterStage crater_stage = {
+    .type = ACTOR_TRANSFORMER,
+    .io = SLOT_INPUT,
+    .transform = upcase_transform,
+};
@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Static tracepoints on the ring.
+//
+// Built with -DCRATER_USDT (make USDT=1, which needs systemtap's
+// <sys/sdt.h>), each CRATER_PROBE is a USDT probe in provider "crater": a
+// single nop in the code and a note in the binary, which perf or bpftrace
+// can attach to without rebuilding.  Otherwise probes compile to nothing
+// and their arguments are not evaluated.
+//
+// Every probe carries (slot, actor type, actor id, size); the id is the
+// Actor's address, so events of one consumer can be told apart.
+//   claim      slot a writer may fill next; size is the SlotDestination
+//   publish    cursor an actor moved to; size is how many slots it moved
+//   produce    input slot written; size is the payload length
+//   transform  output slot written; size is the bytes sent for it, 0 when
+//              the input is forwarded
+//   consume    slot read by a consumer; size is the payload length
+//   reclaim    cursor the vacuum freed up to; size is how many slots
+//
+// For example, the time from claim to publish of each input slot:
+//   bpftrace -e 'usdt:./crater:crater:claim { @t[arg0] = nsecs; }
+//     usdt:./crater:crater:produce /@t[arg0]/ {
+//       @ns = hist(nsecs - @t[arg0]); delete(@t[arg0]); }'
+
+#ifdef CRATER_USDT
+#include <sys/sdt.h>
+#define CRATER_PROBE(name, slot, actor, size) \
+    DTRACE_PROBE4(crater, name, (uint64_t)(slot), (int)(actor)->type, \
+                  (uintptr_t)(actor), (uint64_t)(size))
+#else
+#define CRATER_PROBE(name, slot, actor, size) ((void)0)
+#endif
+
+#endif /* TRACE_H */